@@ -56,6 +56,7 @@
 #include "net.h"
 #include "socket.h"
 #include "event.h"
+#include "process.h"
 #include "system/Time.h"
 #include "exceptions/AssertException.h"
 
@@ -79,9 +80,29 @@ typedef enum {
 #define RETRY_INTERVAL 100000 // 100ms
 
 
+/* Set when some service was visited since the last reset_depend() */
+static volatile boolean_t visited = false;
+
+
+static pthread_once_t controlonce = PTHREAD_ONCE_INIT;
+static Mutex_T controlmutex;
+
+
 /* ----------------------------------------------------------------- Private */
 
 
+/*
+ * Initialize the recursive control mutex
+ */
+static void _controlInit() {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&controlmutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+}
+
+
 static int _getOutput(InputStream_T in, char *buf, int buflen) {
         InputStream_setTimeout(in, 0);
         return InputStream_readBytes(in, buf, buflen - 1);
@@ -166,12 +187,27 @@ static Process_Status _waitProcessStart(Service_T s, long *timeout) {
 }
 
 
-static Process_Status _waitProcessStop(int pid, long *timeout) {
+/*
+ * Wait for the process exit. If the service holds a pidfd of the process,
+ * the wait blocks on the descriptor (in slices, so the Monit stop request
+ * is handled), otherwise the process existence is polled.
+ */
+static Process_Status _waitProcessStop(Service_T s, int pid, long *timeout) {
+        int pidfd = pid && pid == s->inf->priv.process.pidfd_pid ? s->inf->priv.process.pidfd : -1;
         do {
-                if (! pid || (getpgid(pid) == -1 && errno != EPERM))
+                if (! pid)
                         return Process_Stopped;
-                Time_usleep(RETRY_INTERVAL);
-                *timeout -= RETRY_INTERVAL;
+                if (pidfd >= 0) {
+                        long long started = Time_micro();
+                        if (waitprocessfd(pidfd, MIN(*timeout, USEC_PER_SEC)))
+                                return Process_Stopped;
+                        *timeout -= Time_micro() - started;
+                } else {
+                        if (getpgid(pid) == -1 && errno != EPERM)
+                                return Process_Stopped;
+                        Time_usleep(RETRY_INTERVAL);
+                        *timeout -= RETRY_INTERVAL;
+                }
         } while (*timeout > 0 && ! (Run.flags & Run_Stopped));
         return Process_Started;
 }
@@ -187,7 +223,7 @@ static boolean_t _doStart(Service_T s) {
         ASSERT(s);
         boolean_t rv = true;
         if (! s->visited) {
-                s->visited = true;
+                s->visited = visited = true;
                 if (s->dependantlist) {
                         for (Dependant_T d = s->dependantlist; d; d = d->next ) {
                                 Service_T parent = Util_getService(d->dependant);
@@ -241,7 +277,7 @@ static boolean_t _doStop(Service_T s, boolean_t unmonitor) {
         ASSERT(s);
         boolean_t rv = true;
         if (! s->depend_visited) {
-                s->depend_visited = true;
+                s->depend_visited = visited = true;
                 if (s->stop) {
                         int exitStatus;
                         char msg[STRLEN];
@@ -250,7 +286,7 @@ static boolean_t _doStop(Service_T s, boolean_t unmonitor) {
                                 int pid = Util_isProcessRunning(s, true);
                                 if (pid) {
                                         exitStatus = _executeStop(s, msg, sizeof(msg), &timeout);
-                                        rv = _waitProcessStop(pid, &timeout) == Process_Stopped ? true : false;
+                                        rv = _waitProcessStop(s, pid, &timeout) == Process_Stopped ? true : false;
                                         _evaluateStop(s, rv, exitStatus, msg);
                                 }
                         } else {
@@ -305,7 +341,7 @@ static boolean_t _doRestart(Service_T s) {
 static void _doMonitor(Service_T s) {
         ASSERT(s);
         if (! s->visited) {
-                s->visited = true;
+                s->visited = visited = true;
                 if (s->dependantlist) {
                         for (Dependant_T d = s->dependantlist; d; d = d->next ) {
                                 Service_T parent = Util_getService(d->dependant);
@@ -325,7 +361,7 @@ static void _doMonitor(Service_T s) {
 static void _doUnmonitor(Service_T s) {
         ASSERT(s);
         if (! s->depend_visited) {
-                s->depend_visited = true;
+                s->depend_visited = visited = true;
                 Util_monitorUnset(s);
         }
 }
@@ -359,6 +395,59 @@ static void _doDepend(Service_T s, Action_Type action, boolean_t unmonitor) {
 }
 
 
+/*
+ * Do the action. The actions run one at a time, as they share the visited
+ * flags of the dependency chains
+ */
+static boolean_t _control(Service_T s, Action_Type A) {
+        boolean_t rv = true;
+        switch (A) {
+                case Action_Start:
+                        /* We only start this service and all prerequisite services. Chain of services which depends on this service keeps its state */
+                        rv = _doStart(s);
+                        break;
+
+                case Action_Stop:
+                        _doDepend(s, Action_Stop, true);
+                        rv = _doStop(s, true);
+                        break;
+
+                case Action_Restart:
+                        LogInfo("'%s' trying to restart\n", s->name);
+                        _doDepend(s, Action_Stop, false);
+                        if (s->restart) {
+                                rv = _doRestart(s);
+                                _doDepend(s, Action_Start, false);
+                        } else {
+                                if (_doStop(s, false)) {
+                                        /* Only start if stop succeeded */
+                                        rv = _doStart(s);
+                                        _doDepend(s, Action_Start, false);
+                                } else {
+                                        rv = false;
+                                        /* enable monitoring of this service again to allow the restart retry in the next cycle up to timeout limit */
+                                        Util_monitorSet(s);
+                                }
+                        }
+                        break;
+
+                case Action_Monitor:
+                        /* We only enable monitoring of this service and all prerequisite services. Chain of services which depends on this service keeps its state */
+                        _doMonitor(s);
+                        break;
+
+                case Action_Unmonitor:
+                        /* We disable monitoring of this service and all services which depends on it */
+                        _doDepend(s, Action_Unmonitor, false);
+                        _doUnmonitor(s);
+                        break;
+
+                default:
+                        LogError("Service '%s' -- invalid action %d\n", s->name, A);
+                        return false;
+        }
+        return rv;
+}
 
 
 /* ------------------------------------------------------------------ Public */
@@ -453,24 +542,6 @@ err1:
 }
 
 
-/**
- * Check to see if we should try to start/stop service
- * @param S A service name as stated in the config file
- * @param A A string describing the action to execute
- * @return false for error, otherwise true
- */
-boolean_t control_service_string(const char *S, const char *A) {
-        Action_Type a;
-        ASSERT(S);
-        ASSERT(A);
-        if ((a = Util_getAction(A)) == Action_Ignored) {
-                LogError("Service '%s' -- invalid action %s\n", S, A);
-                return false;
-        }
-        return control_service(S, a);
-}
-
-
 /**
  * Check to see if we should try to start/stop service
  * @param S A service name as stated in the config file
@@ -479,65 +550,32 @@ boolean_t control_service_string(const char *S, const char *A) {
  */
 boolean_t control_service(const char *S, Action_Type A) {
         Service_T s = NULL;
-        boolean_t rv = true;
+        boolean_t rv = false;
         ASSERT(S);
         if (! (s = Util_getService(S))) {
                 LogError("Service '%s' -- doesn't exist\n", S);
                 return false;
         }
-        switch (A) {
-                case Action_Start:
-                        /* We only start this service and all prerequisite services. Chain of services which depends on this service keeps its state */
-                        rv = _doStart(s);
-                        break;
-
-                case Action_Stop:
-                        _doDepend(s, Action_Stop, true);
-                        rv = _doStop(s, true);
-                        break;
-
-                case Action_Restart:
-                        LogInfo("'%s' trying to restart\n", s->name);
-                        _doDepend(s, Action_Stop, false);
-                        if (s->restart) {
-                                rv = _doRestart(s);
-                                _doDepend(s, Action_Start, false);
-                        } else {
-                                if (_doStop(s, false)) {
-                                        /* Only start if stop succeeded */
-                                        rv = _doStart(s);
-                                        _doDepend(s, Action_Start, false);
-                                } else {
-                                        rv = false;
-                                        /* enable monitoring of this service again to allow the restart retry in the next cycle up to timeout limit */
-                                        Util_monitorSet(s);
-                                }
-                        }
-                        break;
-
-                case Action_Monitor:
-                        /* We only enable monitoring of this service and all prerequisite services. Chain of services which depends on this service keeps its state */
-                        _doMonitor(s);
-                        break;
-
-                case Action_Unmonitor:
-                        /* We disable monitoring of this service and all services which depends on it */
-                        _doDepend(s, Action_Unmonitor, false);
-                        _doUnmonitor(s);
-                        break;
-
-                default:
-                        LogError("Service '%s' -- invalid action %d\n", S, A);
-                        return false;
+        /* The services may be validated in parallel. The lock is recursive, as the
+         * events posted by an action may run other actions */
+        pthread_once(&controlonce, _controlInit);
+        LOCK(controlmutex)
+        {
+                rv = _control(s, A);
         }
+        END_LOCK;
         return rv;
 }
 
 
 /*
- * Reset the visited flags used when handling dependencies
+ * Reset the visited flags used when handling dependencies. Only the actions
+ * set the flags, so the service list is walked only if some action ran
  */
 void reset_depend() {
+        if (! visited)
+                return;
+        visited = false;
         for (Service_T s = servicelist; s; s = s->next)
                 s->visited = s->depend_visited = false;
 }
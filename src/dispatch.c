@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+
+
+#include "config.h"
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "monit.h"
+#include "event.h"
+#include "queue.h"
+#include "dispatch.h"
+
+// libmonit
+#include "exceptions/AssertException.h"
+
+
+/**
+ * Implementation of the notification dispatcher. The dispatcher queue is a
+ * ring of DISPATCH_QUEUE event copies. The copy holds the event data and
+ * action, so the event outlives the service event which it was posted from.
+ *
+ * The handlers still use the configuration from the dispatcher thread:
+ * handle_alert() looks the service up by the event source and reads its
+ * mail list, handle_mmonit() reports the status of all services. So the
+ * configuration must not change while the dispatcher runs, which is why
+ * Dispatch_stop() has to be called before the configuration is reloaded or
+ * released.
+ *
+ * @file
+ */
+
+
+/* ------------------------------------------------------------- Definitions */
+
+
+#define DISPATCH_QUEUE 256
+
+
+typedef struct DispatchJob_T {
+        struct myevent event;
+        struct myeventaction action;
+        struct myaction failed;
+        struct myaction succeeded;
+} *DispatchJob_T;
+
+
+static struct {
+        Thread_T thread;
+        boolean_t running;                 /**< true if the dispatcher is running */
+        boolean_t stopped;                   /**< true if the dispatcher should stop */
+        boolean_t replay;                  /**< true if the event queue should be replayed */
+        unsigned int head;
+        unsigned int tail;
+        DispatchJob_T jobs[DISPATCH_QUEUE];
+} dispatcher;
+
+
+static Mutex_T dispatchmutex = PTHREAD_MUTEX_INITIALIZER;
+static Sem_T dispatchready = PTHREAD_COND_INITIALIZER;
+
+
+/* ----------------------------------------------------------------- Private */
+
+
+static DispatchJob_T _copy(Event_T E) {
+        DispatchJob_T job;
+        NEW(job);
+        job->event = *E;
+        job->event.source = E->source ? Str_dup(E->source) : NULL;
+        job->event.message = E->message ? Str_dup(E->message) : NULL;
+        job->event.action = &job->action;
+        job->event.next = NULL;
+        job->failed = *E->action->failed;
+        job->failed.exec = NULL;
+        job->succeeded = *E->action->succeeded;
+        job->succeeded.exec = NULL;
+        job->action.failed = &job->failed;
+        job->action.succeeded = &job->succeeded;
+        job->action.slot = -1;
+        return job;
+}
+
+
+static void _free(DispatchJob_T *job) {
+        FREE((*job)->event.source);
+        FREE((*job)->event.message);
+        FREE(*job);
+}
+
+
+/*
+ * Save the event to the event queue for later delivery by all handlers
+ */
+static void _save(Event_T E, const char *reason) {
+        E->flag = Handler_Alert | Handler_Mmonit;
+        if (! Run.eventlist_dir || ! Queue_add(E))
+                LogError("Aborting event - %s\n", reason);
+        E->flag = Handler_Succeeded;
+}
+
+
+static void *_dispatcher(void *args) {
+        LogInfo("Notification dispatcher started\n");
+        LOCK(dispatchmutex)
+        {
+                while (! dispatcher.stopped) {
+                        if (dispatcher.head != dispatcher.tail) {
+                                DispatchJob_T job = dispatcher.jobs[dispatcher.head++ % DISPATCH_QUEUE];
+                                Mutex_unlock(dispatchmutex);
+                                Event_notify(&job->event);
+                                _free(&job);
+                                Mutex_lock(dispatchmutex);
+                        } else if (dispatcher.replay) {
+                                dispatcher.replay = false;
+                                Mutex_unlock(dispatchmutex);
+                                Event_queue_process();
+                                sendmail_idle();
+                                Mutex_lock(dispatchmutex);
+                        } else {
+                                Sem_wait(dispatchready, dispatchmutex);
+                        }
+                }
+        }
+        END_LOCK;
+#ifdef HAVE_OPENSSL
+        Ssl_threadCleanup();
+#endif
+        LogInfo("Notification dispatcher stopped\n");
+        return NULL;
+}
+
+
+/* ------------------------------------------------------------------ Public */
+
+
+void Dispatch_start() {
+        if (dispatcher.running)
+                return;
+        dispatcher.stopped = false;
+        dispatcher.replay = false;
+        TRY
+        {
+                Thread_create(dispatcher.thread, _dispatcher, NULL);
+                dispatcher.running = true;
+        }
+        ELSE
+        {
+                LogError("Cannot start the notification dispatcher, the notifications are sent by the validation -- %s\n", Exception_frame.message);
+        }
+        END_TRY;
+}
+
+
+void Dispatch_stop() {
+        if (! dispatcher.running)
+                return;
+        LOCK(dispatchmutex)
+        {
+                dispatcher.running = false;
+                dispatcher.stopped = true;
+                Sem_signal(dispatchready);
+        }
+        END_LOCK;
+        Thread_join(dispatcher.thread);
+        /* The thread is stopped, the queue can be accessed without the lock */
+        while (dispatcher.head != dispatcher.tail) {
+                DispatchJob_T job = dispatcher.jobs[dispatcher.head++ % DISPATCH_QUEUE];
+                if (Run.eventlist_dir)
+                        _save(&job->event, "the notification dispatcher is stopped");
+                else
+                        Event_notify(&job->event);
+                _free(&job);
+        }
+}
+
+
+boolean_t Dispatch_event(Event_T E) {
+        ASSERT(E);
+        boolean_t taken = false, full = false;
+        LOCK(dispatchmutex)
+        {
+                if (dispatcher.running) {
+                        if (dispatcher.tail - dispatcher.head < DISPATCH_QUEUE) {
+                                dispatcher.jobs[dispatcher.tail++ % DISPATCH_QUEUE] = _copy(E);
+                                Sem_signal(dispatchready);
+                        } else {
+                                full = true;
+                        }
+                        taken = true;
+                }
+        }
+        END_LOCK;
+        /* Backpressure: the dispatcher is behind, most likely a handler is down */
+        if (full)
+                _save(E, "the notification dispatcher queue is full");
+        return taken;
+}
+
+
+boolean_t Dispatch_replay() {
+        boolean_t running = false;
+        LOCK(dispatchmutex)
+        {
+                if ((running = dispatcher.running)) {
+                        dispatcher.replay = true;
+                        Sem_signal(dispatchready);
+                }
+        }
+        END_LOCK;
+        return running;
+}
+
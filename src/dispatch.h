@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+
+#ifndef MONIT_DISPATCH_H
+#define MONIT_DISPATCH_H
+
+
+/**
+ * Notification dispatcher.
+ *
+ * In daemon mode the alert and M/Monit notifications of the events are sent
+ * by a dispatcher thread, so a slow or unreachable mail server or M/Monit
+ * doesn't hold up the service checks. A copy of the event is handed to the
+ * dispatcher through a bounded queue. If the queue is full, the event is
+ * saved to the event queue for later delivery, or dropped if the event queue
+ * is not enabled. The events which the dispatcher fails to deliver are saved
+ * to the event queue too, and the dispatcher replays the event queue.
+ *
+ *  @file
+ */
+
+
+/**
+ * Start the dispatcher thread
+ */
+void Dispatch_start();
+
+
+/**
+ * Stop the dispatcher thread. The events left in the dispatcher queue are
+ * saved to the event queue if enabled, otherwise they are sent by the
+ * calling thread. Must be called before the configuration is released
+ */
+void Dispatch_stop();
+
+
+/**
+ * Hand the event notification to the dispatcher
+ * @param E An event object
+ * @return true if the dispatcher took the event or saved it to the event
+ * queue, false if the dispatcher is not running and the caller has to send
+ * the notification
+ */
+boolean_t Dispatch_event(Event_T E);
+
+
+/**
+ * Ask the dispatcher to replay the event queue
+ * @return false if the dispatcher is not running and the caller has to
+ * replay the event queue
+ */
+boolean_t Dispatch_replay();
+
+
+#endif
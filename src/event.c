@@ -44,28 +44,13 @@
 #include <time.h>
 #endif
 
-
-#ifdef HAVE_SYS_STAT_H
-#include <sys/stat.h>
-#endif
-
-#ifdef HAVE_UNISTD_H
-#include <unistd.h>
-#endif
-
-#ifdef HAVE_DIRENT_H
-#include <dirent.h>
-#endif
-
 #include "monit.h"
 #include "alert.h"
 #include "event.h"
+#include "queue.h"
+#include "dispatch.h"
 #include "process.h"
 
-// libmonit
-#include "io/File.h"
-#include "system/Time.h"
-
 /**
  * Implementation of the event interface.
  *
@@ -111,13 +96,28 @@ EventTable_T Event_Table[] = {
 };
 
 
+/* The event action, which is run after the event mutex was released */
+typedef struct EventJob_T {
+        Service_T service;
+        Action_T action;
+        Event_T event;                  /**< Copy of the event for the exec action */
+} EventJob_T;
+
+
+static pthread_once_t eventonce = PTHREAD_ONCE_INIT;
+static Mutex_T eventmutex;
+
+
 /* -------------------------------------------------------------- Prototypes */
 
 
-static void handle_event(Service_T, Event_T);
-static void handle_action(Event_T, Action_T);
-static void Event_queue_add(Event_T);
-static void Event_queue_update(Event_T, const char *);
+static void handle_event(Service_T, Event_T, EventJob_T *);
+static void handle_action(Event_T, Action_T, EventJob_T *);
+static void _doAction(EventJob_T *);
+static void _eventInit();
+static Event_T _find(Service_T, long, EventAction_T);
+static boolean_t _isHandled(Event_T);
+static void _post(Service_T, long, State_Type, EventAction_T, EventJob_T *, const char *, va_list);
 
 
 /* ------------------------------------------------------------------ Public */
@@ -137,91 +137,21 @@ void Event_post(Service_T service, long id, State_Type state, EventAction_T acti
         ASSERT(s);
         ASSERT(state == State_Failed || state == State_Succeeded || state == State_Changed || state == State_ChangedNot);
 
-        va_list ap;
-        va_start(ap, s);
-        char *message = Str_vcat(s, ap);
-        va_end(ap);
-
-        Event_T e = service->eventlist;
-        if (! e) {
-                /* Only first failed/changed event can initialize the queue for given event type, thus succeeded events are ignored until first error. */
-                if (state == State_Succeeded || state == State_ChangedNot) {
-                        DEBUG("'%s' %s\n", service->name, message);
-                        FREE(message);
-                        return;
-                }
-
-                /* Initialize event list and add first event. The manadatory informations
-                 * are cloned so the event is as standalone as possible and may be saved
-                 * to the queue without the dependency on the original service, thus
-                 * persistent and managable across monit restarts */
-                NEW(e);
-                e->id = id;
-                gettimeofday(&e->collected, NULL);
-                e->source = Str_dup(service->name);
-                e->mode = service->mode;
-                e->type = service->type;
-                e->state = State_Init;
-                e->state_map = 1;
-                e->action = action;
-                e->message = message;
-                service->eventlist = e;
-        } else {
-                /* Try to find the event with the same origin and type identification. Each service and each test have its own custom actions object, so we share actions object address to identify event source. */
-                do {
-                        if (e->action == action && e->id == id) {
-                                gettimeofday(&e->collected, NULL);
-
-                                /* Shift the existing event flags to the left and set the first bit based on actual state */
-                                e->state_map <<= 1;
-                                e->state_map |= ((state == State_Succeeded || state == State_ChangedNot) ? 0 : 1);
-
-                                /* Update the message */
-                                FREE(e->message);
-                                e->message = message;
-                                break;
-                        }
-                        e = e->next;
-                } while (e);
-
-                if (! e) {
-                        /* Only first failed/changed event can initialize the queue for given event type, thus succeeded events are ignored until first error. */
-                        if (state == State_Succeeded || state == State_ChangedNot) {
-                                DEBUG("'%s' %s\n", service->name, message);
-                                FREE(message);
-                                return;
-                        }
-
-                        /* Event was not found in the pending events list, we will add it.
-                         * The manadatory informations are cloned so the event is as standalone
-                         * as possible and may be saved to the queue without the dependency on
-                         * the original service, thus persistent and managable across monit
-                         * restarts */
-                        NEW(e);
-                        e->id = id;
-                        gettimeofday(&e->collected, NULL);
-                        e->source = Str_dup(service->name);
-                        e->mode = service->mode;
-                        e->type = service->type;
-                        e->state = State_Init;
-                        e->state_map = 1;
-                        e->action = action;
-                        e->message = message;
-                        e->next = service->eventlist;
-                        service->eventlist = e;
-                }
+        /* Services may be validated in parallel, so the event handling is serialized.
+         * The action, such as a restart, runs after the lock was released, so it
+         * doesn't hold up the events of the services validated by other workers */
+        EventJob_T job = {};
+        pthread_once(&eventonce, _eventInit);
+        LOCK(eventmutex)
+        {
+                va_list ap;
+                va_start(ap, s);
+                _post(service, id, state, action, &job, s, ap);
+                va_end(ap);
         }
-
-        e->state_changed = Event_check_state(e, state);
-
-        /* In the case that the state changed, update it and reset the counter */
-        if (e->state_changed) {
-                e->state = state;
-                e->count = 1;
-        } else
-                e->count++;
-
-        handle_event(service, e);
+        END_LOCK;
+        if (job.action)
+                _doAction(&job);
 }
 
 
@@ -438,190 +368,176 @@ const char *Event_get_action_description(Event_T E) {
 }
 
 
+/**
+ * Send the alert and M/Monit notifications of the event. In the case that
+ * some handler failed, the event is saved to the event queue for later
+ * delivery
+ * @param E An event object
+ */
+void Event_notify(Event_T E) {
+        ASSERT(E);
+
+        E->flag = Handler_Succeeded;
+        E->flag |= handle_mmonit(E);
+        E->flag |= handle_alert(E);
+
+        /* In the case that some subhandler failed, enqueue the event for
+         * partial reprocessing */
+        if (E->flag != Handler_Succeeded) {
+                if (! Run.eventlist_dir || ! Queue_add(E))
+                        LogError("Aborting event\n");
+        }
+}
+
+
 /**
  * Reprocess the partially handled event queue
  */
 void Event_queue_process() {
+        Run.handler_flag = Handler_Succeeded;
         /* return in the case that the eventqueue is not enabled or empty */
         if (! Run.eventlist_dir || (! (Run.flags & Run_HandlerInit) && ! Run.handler_queue[Handler_Alert] && ! Run.handler_queue[Handler_Mmonit]))
                 return;
+        Queue_process(Handler_Alert, handle_alert);
+        Queue_process(Handler_Mmonit, handle_mmonit);
+        Queue_sync();
+}
 
-        DIR *dir = opendir(Run.eventlist_dir);
-        if (! dir) {
-                if (errno != ENOENT)
-                        LogError("Cannot open the directory %s -- %s\n", Run.eventlist_dir, STRERROR);
-                return;
-        }
 
-        struct dirent *de = readdir(dir);
-        if (de)
-                DEBUG("Processing postponed events queue\n");
+/* ----------------------------------------------------------------- Private */
 
-        Action_T a;
-        NEW(a);
 
-        EventAction_T ea;
-        NEW(ea);
+/*
+ * Initialize the recursive event mutex
+ */
+static void _eventInit() {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&eventmutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+}
 
-        while (de) {
-                int handlers_passed = 0;
 
-                /* In the case that all handlers failed, skip the further processing in this cycle. Alert handler is currently defined anytime (either explicitly or localhost by default) */
-                if ( (Run.mmonits && FLAG(Run.handler_flag, Handler_Mmonit) && FLAG(Run.handler_flag, Handler_Alert)) || FLAG(Run.handler_flag, Handler_Alert))
-                        break;
+/*
+ * Find the event with the same origin and type identification. Each service
+ * and each test have its own custom actions object, so we share actions object
+ * address to identify event source. The action slot indexes the first event
+ * created for the action, an empty slot means the action has no event yet. The
+ * event list is searched only if the action posts several event types or was
+ * not created for this service
+ */
+static Event_T _find(Service_T service, long id, EventAction_T action) {
+        if (action->slot >= 0 && action->slot < service->events.count) {
+                Event_T e = service->events.slot ? service->events.slot[action->slot] : NULL;
+                if (! e || (e->action == action && e->id == id))
+                        return e;
+        }
+        for (Event_T e = service->eventlist; e; e = e->next)
+                if (e->action == action && e->id == id)
+                        return e;
+        return NULL;
+}
 
-                char file_name[PATH_MAX];
-                snprintf(file_name, sizeof(file_name), "%s/%s", Run.eventlist_dir, de->d_name);
 
-                if (File_isFile(file_name)) {
-                        LogInfo("Processing queued event %s\n", file_name);
+/*
+ * Return true if the event will be handled. Only the first succeeded event is
+ * handled, recurrent succeeded events or insufficient succeeded events during
+ * failed service state are ignored. Failed events are handled each time.
+ */
+static boolean_t _isHandled(Event_T E) {
+        return E->state_changed || ! (E->state == State_Succeeded || E->state == State_ChangedNot || ((E->state_map & 0x1) ^ 0x1));
+}
 
-                        FILE *file = fopen(file_name, "r");
-                        if (! file) {
-                                LogError("Queued event processing failed - cannot open the file %s -- %s\n", file_name, STRERROR);
-                                goto error1;
-                        }
 
-                        size_t size;
+/*
+ * Log the message of an event which is not handled. The message is formatted
+ * only if debug logging is enabled
+ */
+static void _postDebug(Service_T service, const char *format, va_list ap) {
+        if (Run.debug) {
+                char *message = Str_vcat(format, ap);
+                DEBUG("'%s' %s\n", service->name, message);
+                FREE(message);
+        }
+}
 
-                        /* read event structure version */
-                        int *version = file_readQueue(file, &size);
-                        if (! version) {
-                                LogError("skipping queued event %s - unknown data format\n", file_name);
-                                goto error2;
-                        }
-                        if (size != sizeof(int)) {
-                                LogError("Aborting queued event %s - invalid size %lu\n", file_name, (unsigned long)size);
-                                goto error3;
-                        }
-                        if (*version != EVENT_VERSION) {
-                                LogError("Aborting queued event %s - incompatible data format version %d\n", file_name, *version);
-                                goto error3;
-                        }
 
-                        /* read event structure */
-                        Event_T e = file_readQueue(file, &size);
-                        if (! e)
-                                goto error3;
-                        if (size != sizeof(*e))
-                                goto error4;
-
-                        /* read source */
-                        if (! (e->source = file_readQueue(file, &size)))
-                                goto error4;
-
-                        /* read message */
-                        if (! (e->message = file_readQueue(file, &size)))
-                                goto error5;
-
-                        /* read event action */
-                        Action_Type *action = file_readQueue(file, &size);
-                        if (! action)
-                                goto error6;
-                        if (size != sizeof(Action_Type))
-                                goto error7;
-                        a->id = *action;
-                        switch (e->state) {
-                                case State_Succeeded:
-                                case State_ChangedNot:
-                                        ea->succeeded = a;
-                                        break;
-                                case State_Failed:
-                                case State_Changed:
-                                case State_Init:
-                                        ea->failed = a;
-                                        break;
-                                default:
-                                        LogError("Aborting queue event %s -- invalid state: %d\n", file_name, e->state);
-                                        goto error7;
-                        }
-                        e->action = ea;
-
-                        /* Retry all remaining handlers */
-
-                        /* alert */
-                        if (e->flag & Handler_Alert) {
-                                if (Run.flags & Run_HandlerInit)
-                                        Run.handler_queue[Handler_Alert]++;
-                                if ((Run.handler_flag & Handler_Alert) != Handler_Alert) {
-                                        if ( handle_alert(e) != Handler_Alert ) {
-                                                e->flag &= ~Handler_Alert;
-                                                Run.handler_queue[Handler_Alert]--;
-                                                handlers_passed++;
-                                        } else {
-                                                LogError("Alert handler failed, retry scheduled for next cycle\n");
-                                                Run.handler_flag |= Handler_Alert;
-                                        }
-                                }
-                        }
-
-                        /* mmonit */
-                        if (e->flag & Handler_Mmonit) {
-                                if (Run.flags & Run_HandlerInit)
-                                        Run.handler_queue[Handler_Mmonit]++;
-                                if ((Run.handler_flag & Handler_Mmonit) != Handler_Mmonit) {
-                                        if ( handle_mmonit(e) != Handler_Mmonit ) {
-                                                e->flag &= ~Handler_Mmonit;
-                                                Run.handler_queue[Handler_Mmonit]--;
-                                                handlers_passed++;
-                                        } else {
-                                                LogError("M/Monit handler failed, retry scheduled for next cycle\n");
-                                                Run.handler_flag |= Handler_Mmonit;
-                                        }
-                                }
-                        }
+/*
+ * Update the service event list with the posted state and handle the event.
+ * The message is formatted only when the event is handled or debug logging is
+ * enabled, most posts are recurrent succeeded states which need no message
+ */
+static void _post(Service_T service, long id, State_Type state, EventAction_T action, EventJob_T *job, const char *format, va_list ap) {
+        Event_T e = _find(service, id, action);
+        if (e) {
+                gettimeofday(&e->collected, NULL);
 
-                        /* If no error persists, remove it from the queue */
-                        if (e->flag == Handler_Succeeded) {
-                                DEBUG("Removing queued event %s\n", file_name);
-                                if (unlink(file_name) < 0)
-                                        LogError("Failed to remove queued event file '%s' -- %s\n", file_name, STRERROR);
-                        } else if (handlers_passed > 0) {
-                                DEBUG("Updating queued event %s (some handlers passed)\n", file_name);
-                                Event_queue_update(e, file_name);
-                        }
+                /* Shift the existing event flags to the left and set the first bit based on actual state */
+                e->state_map <<= 1;
+                e->state_map |= ((state == State_Succeeded || state == State_ChangedNot) ? 0 : 1);
+        } else {
+                /* Only first failed/changed event can initialize the queue for given event type, thus succeeded events are ignored until first error. */
+                if (state == State_Succeeded || state == State_ChangedNot) {
+                        _postDebug(service, format, ap);
+                        return;
+                }
 
-                error7:
-                        FREE(action);
-                error6:
-                        FREE(e->message);
-                error5:
-                        FREE(e->source);
-                error4:
-                        FREE(e);
-                error3:
-                        FREE(version);
-                error2:
-                        fclose(file);
+                /* Event was not found in the pending events list, we will add it.
+                 * The manadatory informations are cloned so the event is as standalone
+                 * as possible and may be saved to the queue without the dependency on
+                 * the original service, thus persistent and managable across monit
+                 * restarts */
+                NEW(e);
+                e->id = id;
+                gettimeofday(&e->collected, NULL);
+                e->source = Str_dup(service->name);
+                e->mode = service->mode;
+                e->type = service->type;
+                e->state = State_Init;
+                e->state_map = 1;
+                e->action = action;
+                e->next = service->eventlist;
+                service->eventlist = e;
+                if (action->slot >= 0 && action->slot < service->events.count) {
+                        if (! service->events.slot)
+                                service->events.slot = CALLOC(service->events.count, sizeof(*service->events.slot));
+                        if (! service->events.slot[action->slot])
+                                service->events.slot[action->slot] = e;
                 }
-        error1:
-                de = readdir(dir);
         }
-        Run.flags &= ~Run_HandlerInit;
-        closedir(dir);
-        FREE(a);
-        FREE(ea);
-        return;
-}
 
+        e->state_changed = Event_check_state(e, state);
 
-/* ----------------------------------------------------------------- Private */
+        /* In the case that the state changed, update it and reset the counter */
+        if (e->state_changed) {
+                e->state = state;
+                e->count = 1;
+        } else
+                e->count++;
+
+        /* Update the message. The message of an event which won't be handled (see
+         * handle_event) is dropped rather than kept stale */
+        FREE(e->message);
+        if (Run.debug || _isHandled(e))
+                e->message = Str_vcat(format, ap);
+
+        handle_event(service, e, job);
+}
 
 
 /*
  * Handle the event
  * @param E An event
+ * @param job Set to the action to run after the event mutex was released
  */
-static void handle_event(Service_T S, Event_T E) {
+static void handle_event(Service_T S, Event_T E, EventJob_T *job) {
         ASSERT(E);
         ASSERT(E->action);
         ASSERT(E->action->failed);
         ASSERT(E->action->succeeded);
 
-        /* We will handle only first succeeded event, recurrent succeeded events
-         * or insufficient succeeded events during failed service state are
-         * ignored. Failed events are handled each time. */
-        if (! E->state_changed && (E->state == State_Succeeded || E->state == State_ChangedNot || ((E->state_map & 0x1) ^ 0x1))) {
+        if (! _isHandled(E)) {
                 DEBUG("'%s' %s\n", S->name, E->message);
                 return;
         }
@@ -650,10 +566,10 @@ static void handle_event(Service_T S, Event_T E) {
                         else
                                 S->error_hint &= ~E->id;
                 }
-                handle_action(E, E->action->failed);
+                handle_action(E, E->action->failed, job);
         } else {
                 S->error &= ~E->id;
-                handle_action(E, E->action->succeeded);
+                handle_action(E, E->action->succeeded, job);
         }
 
         /* Possible event state change was handled so we will reset the flag. */
@@ -661,7 +577,7 @@ static void handle_event(Service_T S, Event_T E) {
 }
 
 
-static void handle_action(Event_T E, Action_T A) {
+static void handle_action(Event_T E, Action_T A, EventJob_T *job) {
         Service_T s;
 
         ASSERT(E);
@@ -672,18 +588,9 @@ static void handle_action(Event_T E, Action_T A) {
         if (A->id == Action_Ignored)
                 return;
 
-        /* Alert and mmonit event notification are common actions */
-        E->flag |= handle_mmonit(E);
-        E->flag |= handle_alert(E);
-
-        /* In the case that some subhandler failed, enqueue the event for
-         * partial reprocessing */
-        if (E->flag != Handler_Succeeded) {
-                if (Run.eventlist_dir)
-                        Event_queue_add(E);
-                else
-                        LogError("Aborting event\n");
-        }
+        /* Alert and mmonit event notification are common actions, sent by the dispatcher thread in daemon mode */
+        if (! Dispatch_event(E))
+                Event_notify(E);
 
         if (! (s = Event_get_source(E))) {
                 LogError("Event action handling aborted\n");
@@ -697,145 +604,33 @@ static void handle_action(Event_T E, Action_T A) {
                 return;
         } else if (A->id == Action_Exec) {
                 LogInfo("'%s' exec: %s\n", s->name, A->exec->arg[0]);
-                spawn(s, A->exec, E);
-                return;
+                /* The event may change once the mutex was released, the program gets a copy */
+                NEW(job->event);
+                *job->event = *E;
+                job->event->source = Str_dup(E->source);
+                job->event->message = E->message ? Str_dup(E->message) : NULL;
+                job->event->next = NULL;
         } else {
                 if (s->actionratelist && (A->id == Action_Start || A->id == Action_Restart))
                         s->nstart++;
 
                 if (s->mode == Monitor_Passive && (A->id == Action_Start || A->id == Action_Stop  || A->id == Action_Restart))
                         return;
-
-                control_service(s->name, A->id);
         }
+        job->service = s;
+        job->action = A;
 }
 
 
-/**
- * Add the partialy handled event to the global queue
- * @param E An event object
+/*
+ * Run the event action, the event mutex is not held
  */
-static void Event_queue_add(Event_T E) {
-        ASSERT(E);
-        ASSERT(E->flag != Handler_Succeeded);
-
-        if (! file_checkQueueDirectory(Run.eventlist_dir)) {
-                LogError("Aborting event - cannot access the directory %s\n", Run.eventlist_dir);
-                return;
-        }
-
-        if (! file_checkQueueLimit(Run.eventlist_dir, Run.eventlist_slots)) {
-                LogError("Aborting event - queue over quota\n");
-                return;
-        }
-
-        /* compose the file name of actual timestamp and service name */
-        char file_name[PATH_MAX];
-        snprintf(file_name, PATH_MAX, "%s/%lld_%lx", Run.eventlist_dir, (long long)Time_now(), (long unsigned)E->source);
-
-        LogInfo("Adding event to the queue file %s for later delivery\n", file_name);
-
-        FILE *file = fopen(file_name, "w");
-        if (! file) {
-                LogError("Aborting event - cannot open the event file %s -- %s\n", file_name, STRERROR);
-                return;
-        }
-
-        boolean_t  rv;
-
-        /* write event structure version */
-        int version = EVENT_VERSION;
-        if (! (rv = file_writeQueue(file, &version, sizeof(int))))
-                goto error;
-
-        /* write event structure */
-        if (! (rv = file_writeQueue(file, E, sizeof(*E))))
-                goto error;
-
-        /* write source */
-        if (! (rv = file_writeQueue(file, E->source, E->source ? strlen(E->source) + 1 : 0)))
-                goto error;
-
-        /* write message */
-        if (! (rv = file_writeQueue(file, E->message, E->message ? strlen(E->message) + 1 : 0)))
-                goto error;
-
-        /* write event action */
-        Action_Type action = Event_get_action(E);
-        if (! (rv = file_writeQueue(file, &action, sizeof(Action_Type))))
-                goto error;
-
-error:
-        fclose(file);
-        if (! rv) {
-                LogError("Aborting event - unable to save event information to %s\n",  file_name);
-                if (unlink(file_name) < 0)
-                        LogError("Failed to remove event file '%s' -- %s\n", file_name, STRERROR);
+static void _doAction(EventJob_T *job) {
+        if (job->action->id == Action_Exec) {
+                spawn(job->service, job->action->exec, job->event);
+                gc_event(&job->event);
         } else {
-                if (! (Run.flags & Run_HandlerInit) && E->flag & Handler_Alert)
-                        Run.handler_queue[Handler_Alert]++;
-                if (! (Run.flags & Run_HandlerInit) && E->flag & Handler_Mmonit)
-                        Run.handler_queue[Handler_Mmonit]++;
+                control_service(job->service->name, job->action->id);
         }
-
-        return;
-}
-
-
-/**
- * Update the partialy handled event in the global queue
- * @param E An event object
- * @param file_name File name
- */
-static void Event_queue_update(Event_T E, const char *file_name) {
-        int version = EVENT_VERSION;
-        Action_Type action = Event_get_action(E);
-        boolean_t rv;
-
-        ASSERT(E);
-        ASSERT(E->flag != Handler_Succeeded);
-
-        if (! file_checkQueueDirectory(Run.eventlist_dir)) {
-                LogError("Aborting event - cannot access the directory %s\n", Run.eventlist_dir);
-                return;
-        }
-
-        DEBUG("Updating event in the queue file %s for later delivery\n", file_name);
-
-        FILE *file = fopen(file_name, "w");
-        if (! file) {
-                LogError("Aborting event - cannot open the event file %s -- %s\n", file_name, STRERROR);
-                return;
-        }
-
-        /* write event structure version */
-        if (! (rv = file_writeQueue(file, &version, sizeof(int))))
-                goto error;
-
-        /* write event structure */
-        if (! (rv = file_writeQueue(file, E, sizeof(*E))))
-                goto error;
-
-        /* write source */
-        if (! (rv = file_writeQueue(file, E->source, E->source ? strlen(E->source) + 1 : 0)))
-                goto error;
-
-        /* write message */
-        if (! (rv = file_writeQueue(file, E->message, E->message ? strlen(E->message) + 1 : 0)))
-                goto error;
-
-        /* write event action */
-        if (! (rv = file_writeQueue(file, &action, sizeof(Action_Type))))
-                goto error;
-
-error:
-        fclose(file);
-        if (! rv) {
-                LogError("Aborting event - unable to update event information to %s\n", file_name);
-                if (unlink(file_name) < 0)
-                        LogError("Failed to remove event file '%s' -- %s\n", file_name, STRERROR);
-        }
-
-        return;
 }
 
@@ -202,6 +202,14 @@ Action_Type Event_get_action(Event_T E);
 const char *Event_get_action_description(Event_T E);
 
 
+/**
+ * Send the alert and M/Monit notifications of the event. In the case that
+ * some handler failed, the event is saved to the event queue
+ * @param E An event object
+ */
+void Event_notify(Event_T E);
+
+
 /**
  * Reprocess the partialy handled event queue
  */
@@ -60,10 +60,6 @@
 #include <fcntl.h>
 #endif
 
-#ifdef HAVE_DIRENT_H
-#include <dirent.h>
-#endif
-
 #include "monit.h"
 #include "engine.h"
 
@@ -236,59 +232,6 @@ boolean_t file_checkQueueDirectory(char *path) {
 }
 
 
-boolean_t file_checkQueueLimit(char *path, int limit) {
-        if (limit < 0)
-                return true;
-        DIR *dir = opendir(path);
-        if (! dir) {
-                LogError("Cannot open the event queue directory %s -- %s\n", path, STRERROR);
-                return false;
-        }
-        int used = 0;
-        struct dirent *de = NULL;
-        while ((de = readdir(dir)) ) {
-                char buf[PATH_MAX];
-                snprintf(buf, sizeof(buf), "%s/%s", path, de->d_name);
-                if (File_isFile(buf) && ++used > limit) {
-                        LogError("Event queue is full\n");
-                        closedir(dir);
-                        return false;
-                }
-        }
-        closedir(dir);
-        return true;
-}
-
-
-boolean_t file_writeQueue(FILE *file, void *data, size_t size) {
-        size_t rv;
-
-        ASSERT(file);
-
-        /* write size */
-        if ((rv = fwrite(&size, 1, sizeof(size_t), file)) != sizeof(size_t)) {
-                if (feof(file) || ferror(file))
-                        LogError("Queued event file: unable to write event size -- %s\n", feof(file) ? "end of file" : "stream error");
-                else
-                        LogError("Queued event file: unable to write event size -- read returned %lu bytes\n", (unsigned long)rv);
-                return false;
-        }
-
-        /* write data if any */
-        if (size > 0) {
-                if ((rv = fwrite(data, 1, size, file)) != size) {
-                        if (feof(file) || ferror(file))
-                                LogError("Queued event file: unable to write event size -- %s\n", feof(file) ? "end of file" : "stream error");
-                        else
-                                LogError("Queued event file: unable to write event size -- read returned %lu bytes\n", (unsigned long)rv);
-                        return false;
-                }
-        }
-
-        return true;
-}
-
-
 void *file_readQueue(FILE *file, size_t *size) {
         size_t rv;
         void *data = NULL;
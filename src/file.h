@@ -98,26 +98,8 @@ boolean_t file_checkQueueDirectory(char *path);
 
 
 /**
- * Check the queue size limit.
- * @param path The fully qualified path to the directory
- * @param mode The queue limit
- * @return true if the succeeded otherwise false
- */
-boolean_t file_checkQueueLimit(char *path, int limit);
-
-
-/**
- * Write data to the queue file
- * @param file Filedescriptor to write to
- * @param data Data to be written
- * @param size Size of the data to be written
- * @return true if the succeeded otherwise false
- */
-boolean_t file_writeQueue(FILE *file, void *data, size_t size);
-
-
-/**
- * Read the data from the queue file's actual position
+ * Read the data from the queue file's actual position. Used to read the
+ * event files of the previous event queue format
  * @param file Filedescriptor to read from
  * @param size Size of the data read
  * @return The data read if any or NULL. The size parameter is set
@@ -101,6 +101,8 @@ void gc() {
                 _gcath(&Run.httpd.credentials);
         if (Run.maillist)
                 gc_mail_list(&Run.maillist);
+        /* Close the mail session before its server is released */
+        sendmail_close();
         if (Run.mailservers)
                 _gc_mail_server(&Run.mailservers);
         if (Run.mmonits)
@@ -258,14 +260,19 @@ static void _gc_service(Service_T *s) {
                 _gc_eventaction(&(*s)->action_ACTION);
         if ((*s)->eventlist)
                 gc_event(&(*s)->eventlist);
+        FREE((*s)->events.slot);
         if ((*s)->inf) {
                 if ((*s)->type == Service_Net)
                         Link_free(&((*s)->inf->priv.net.stats));
+                else if ((*s)->type == Service_Process && (*s)->inf->priv.process.pidfd >= 0)
+                        close((*s)->inf->priv.process.pidfd);
                 FREE((*s)->inf);
         }
         FREE((*s)->name);
         FREE((*s)->path);
+        FREE((*s)->cgroup);
         (*s)->next = NULL;
+        Mutex_destroy((*s)->mutex);
         FREE(*s);
 }
 
@@ -351,6 +358,7 @@ static void _gcportlist(Port_T *p) {
                 FREE((*p)->target.net.SSL.clientpemfile);
         }
         FREE((*p)->hostname);
+        FREE((*p)->probe.error);
         if ((*p)->protocol->check == check_http) {
                 FREE((*p)->parameters.http.request);
                 FREE((*p)->parameters.http.checksum);
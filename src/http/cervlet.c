@@ -78,6 +78,8 @@
 #include "process.h"
 #include "device.h"
 #include "protocol.h"
+#include "schedule.h"
+#include "profile.h"
 
 #define ACTION(c) ! strncasecmp(req->url, c, sizeof(c))
 
@@ -93,6 +95,24 @@
 #define VIEWLOG     "/_viewlog"
 #define DOACTION    "/_doaction"
 #define FAVICON     "/favicon.ico"
+#define METRICS     "/metrics"
+
+#define METRICS_BUFFER 65536
+#define METRICS_LABELS 1024
+
+
+/* The metrics writer. The metrics are formatted into a fixed buffer which is
+ written to the socket when full, so the response needs no heap allocations
+ regardless of the number of services */
+typedef struct {
+        Socket_T socket;
+        int length;
+        char buffer[METRICS_BUFFER];
+} Metrics_T;
+
+
+static Metrics_T metrics;
+static Mutex_T metricsmutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Private prototypes */
 static boolean_t is_readonly(HttpRequest);
@@ -114,6 +134,7 @@ static void do_home_host(HttpRequest, HttpResponse);
 static void do_about(HttpRequest, HttpResponse);
 static void do_ping(HttpRequest, HttpResponse);
 static void do_getid(HttpRequest, HttpResponse);
+static void do_metrics(HttpRequest, HttpResponse);
 static void do_runtime(HttpRequest, HttpResponse);
 static void do_viewlog(HttpRequest, HttpResponse);
 static void handle_action(HttpRequest, HttpResponse);
@@ -123,6 +144,7 @@ static void is_monit_running(HttpRequest, HttpResponse);
 static void do_service(HttpRequest, HttpResponse, Service_T);
 static void print_alerts(HttpResponse, Mail_T);
 static void print_buttons(HttpRequest, HttpResponse, Service_T);
+static void print_histogram(HttpResponse, const char *, Histogram_T *);
 static void print_service_rules_timeout(HttpResponse, Service_T);
 static void print_service_rules_existence(HttpResponse, Service_T);
 static void print_service_rules_port(HttpResponse, Service_T);
@@ -267,6 +289,8 @@ static void doGet(HttpRequest req, HttpResponse res) {
                 do_ping(req, res);
         } else if (ACTION(GETID)) {
                 do_getid(req, res);
+        } else if (ACTION(METRICS)) {
+                do_metrics(req, res);
         } else if (ACTION(STATUS)) {
                 print_status(req, res, 1);
         } else if (ACTION(STATUS2)) {
@@ -380,9 +404,12 @@ static void do_foot(HttpResponse res) {
 
 
 static void do_home(HttpRequest req, HttpResponse res) {
-        char *uptime = Util_getUptime(getProcessUptime(getpid(), ptree, ptreesize), "&nbsp;");
+        pthread_rwlock_rdlock(&ptreelock);
+        time_t monituptime = getProcessUptime(getpid(), ptree, ptreesize);
+        pthread_rwlock_unlock(&ptreelock);
+        char *uptime = Util_getUptime(monituptime, "&nbsp;");
 
-        do_head(res, "", "", Run.polltime);
+        do_head(res, "", "", MAX(Run.polltime / 1000, 1));
         StringBuffer_append(res->outputbuffer,
                             "<table id='header' width='100%%'>"
                             " <tr>"
@@ -442,6 +469,258 @@ static void do_getid(HttpRequest req, HttpResponse res) {
         StringBuffer_append(res->outputbuffer, "%s", Run.id);
 }
 
+
+static void metrics_flush(Metrics_T *m) {
+        if (m->length > 0) {
+                Socket_write(m->socket, m->buffer, m->length);
+                m->length = 0;
+        }
+}
+
+
+static void metrics_family(Metrics_T *m, const char *name, const char *type, const char *help) {
+        if (m->length + STRLEN > METRICS_BUFFER)
+                metrics_flush(m);
+        m->length += snprintf(m->buffer + m->length, METRICS_BUFFER - m->length, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+
+static void metrics_sample(Metrics_T *m, const char *name, const char *labels, double value) {
+        if (m->length + METRICS_LABELS + STRLEN > METRICS_BUFFER)
+                metrics_flush(m);
+        m->length += snprintf(m->buffer + m->length, METRICS_BUFFER - m->length, *labels ? "%s{%s} %.15g\n" : "%s%s %.15g\n", name, labels, value);
+}
+
+
+/**
+ * Append the label name="value" to the label set, with the value escaped. The
+ * label is left out if the label set is full
+ */
+static void metrics_label(char *labels, const char *name, const char *value) {
+        int length = (int)strlen(labels);
+        int start = length;
+        length += snprintf(labels + length, METRICS_LABELS - length, "%s%s=\"", length ? "," : "", name);
+        for (const char *c = value ? value : ""; *c && length < METRICS_LABELS - 4; c++) {
+                if (*c == '\\' || *c == '"') {
+                        labels[length++] = '\\';
+                        labels[length++] = *c;
+                } else if (*c == '\n') {
+                        labels[length++] = '\\';
+                        labels[length++] = 'n';
+                } else {
+                        labels[length++] = *c;
+                }
+        }
+        if (length >= METRICS_LABELS - 2) {
+                labels[start] = 0;
+                return;
+        }
+        labels[length++] = '"';
+        labels[length] = 0;
+}
+
+
+static void metrics_service_labels(Service_T s, char *labels) {
+        *labels = 0;
+        metrics_label(labels, "service", s->name);
+        metrics_label(labels, "type", servicetypes[s->type]);
+}
+
+
+static void metrics_summary(Metrics_T *m, const char *name, const char *labels, Histogram_T *h) {
+        static const double quantiles[] = {0.5, 0.95, 0.99};
+        char buf[METRICS_LABELS + 32];
+        char sample[STRLEN];
+        for (int i = 0; i < 3; i++) {
+                snprintf(buf, sizeof(buf), "%s%squantile=\"%g\"", labels, *labels ? "," : "", quantiles[i]);
+                metrics_sample(m, name, buf, Profile_percentile(h, quantiles[i] * 100) / 1000000.);
+        }
+        snprintf(sample, sizeof(sample), "%s_sum", name);
+        metrics_sample(m, sample, labels, h->sum / 1000000.);
+        snprintf(sample, sizeof(sample), "%s_count", name);
+        metrics_sample(m, sample, labels, (double)h->count);
+}
+
+
+/**
+ * Print the metrics in the OpenMetrics text format. The metrics of one family
+ * must be grouped, so the service list is walked once per family
+ */
+static void do_metrics(HttpRequest req, HttpResponse res) {
+        char labels[METRICS_LABELS];
+        LOCK(metricsmutex)
+        {
+                Metrics_T *m = &metrics;
+                m->socket = res->S;
+                m->length = 0;
+                res->is_committed = true;
+                Socket_print(m->socket,
+                             "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                             "Connection: close\r\n\r\n");
+                /* Run.mutex is not held, as with the other status pages, so a stalled client doesn't block the http actions */
+                *labels = 0;
+                metrics_label(labels, "version", VERSION);
+                metrics_label(labels, "id", Run.id);
+                metrics_family(m, "monit", "info", "Monit daemon");
+                metrics_sample(m, "monit_info", labels, 1);
+                metrics_family(m, "monit_cycle_overruns", "counter", "Checks skipped as the cycles overran");
+                metrics_sample(m, "monit_cycle_overruns_total", "", (double)Run.cycle.overruns);
+                metrics_family(m, "monit_cycle_jitter_seconds", "gauge", "Start delay of the last cycle checks");
+                metrics_sample(m, "monit_cycle_jitter_seconds", "", Run.cycle.jitter / 1000.);
+                metrics_family(m, "monit_stage_duration_seconds", "summary", "Duration of the cycle stages");
+                for (Profile_Stage stage = Profile_Cycle; stage < Profile_Stages; stage++) {
+                        *labels = 0;
+                        metrics_label(labels, "stage", Profile_name(stage));
+                        metrics_summary(m, "monit_stage_duration_seconds", labels, Profile_histogram(stage));
+                }
+                metrics_family(m, "monit_service_status", "gauge", "Service error bitmap, 0 if all tests succeeded");
+                for (Service_T s = servicelist_conf; s; s = s->next_conf) {
+                        metrics_service_labels(s, labels);
+                        metrics_sample(m, "monit_service_status", labels, s->error);
+                }
+                metrics_family(m, "monit_service_monitored", "gauge", "Service monitoring state (0 not monitored, 1 monitored, 2 initializing, 4 waiting)");
+                for (Service_T s = servicelist_conf; s; s = s->next_conf) {
+                        metrics_service_labels(s, labels);
+                        metrics_sample(m, "monit_service_monitored", labels, s->monitor);
+                }
+                metrics_family(m, "monit_service_check_duration_seconds", "summary", "Duration of the service checks");
+                for (Service_T s = servicelist_conf; s; s = s->next_conf) {
+                        metrics_service_labels(s, labels);
+                        metrics_summary(m, "monit_service_check_duration_seconds", labels, &s->latency);
+                }
+                /* Process */
+                static const struct {
+                        const char *name;
+                        const char *help;
+                } process[] = {
+                        {"monit_process_cpu_percent", "Process CPU usage"},
+                        {"monit_process_cpu_total_percent", "CPU usage of the process and its children"},
+                        {"monit_process_memory_bytes", "Process memory usage"},
+                        {"monit_process_memory_total_bytes", "Memory usage of the process and its children"},
+                        {"monit_process_children", "Number of child processes"},
+                        {"monit_process_uptime_seconds", "Process uptime"}
+                };
+                for (int i = 0; i < (int)(sizeof(process) / sizeof(process[0])); i++) {
+                        metrics_family(m, process[i].name, "gauge", process[i].help);
+                        for (Service_T s = servicelist_conf; s; s = s->next_conf) {
+                                if (s->type != Service_Process || ! Util_hasServiceStatus(s))
+                                        continue;
+                                double value = 0;
+                                switch (i) {
+                                        case 0: value = s->inf->priv.process.cpu_percent / 10.; break;
+                                        case 1: value = s->inf->priv.process.total_cpu_percent / 10.; break;
+                                        case 2: value = s->inf->priv.process.mem_kbyte * 1024.; break;
+                                        case 3: value = s->inf->priv.process.total_mem_kbyte * 1024.; break;
+                                        case 4: value = s->inf->priv.process.children; break;
+                                        case 5: value = (double)s->inf->priv.process.uptime; break;
+                                }
+                                metrics_service_labels(s, labels);
+                                metrics_sample(m, process[i].name, labels, value);
+                        }
+                }
+                /* Filesystem */
+                static const struct {
+                        const char *name;
+                        const char *help;
+                } filesystem[] = {
+                        {"monit_filesystem_space_used_percent", "Filesystem space usage"},
+                        {"monit_filesystem_space_total_bytes", "Filesystem size"},
+                        {"monit_filesystem_space_free_bytes", "Filesystem space available to non-superuser"},
+                        {"monit_filesystem_inodes_used_percent", "Filesystem inodes usage"}
+                };
+                for (int i = 0; i < (int)(sizeof(filesystem) / sizeof(filesystem[0])); i++) {
+                        metrics_family(m, filesystem[i].name, "gauge", filesystem[i].help);
+                        for (Service_T s = servicelist_conf; s; s = s->next_conf) {
+                                if (s->type != Service_Filesystem || ! Util_hasServiceStatus(s))
+                                        continue;
+                                if (i == 3 && s->inf->priv.filesystem.f_files <= 0)
+                                        continue;
+                                double value = 0;
+                                switch (i) {
+                                        case 0: value = s->inf->priv.filesystem.space_percent / 10.; break;
+                                        case 1: value = (double)s->inf->priv.filesystem.f_blocks * s->inf->priv.filesystem.f_bsize; break;
+                                        case 2: value = (double)s->inf->priv.filesystem.f_blocksfree * s->inf->priv.filesystem.f_bsize; break;
+                                        case 3: value = s->inf->priv.filesystem.inode_percent / 10.; break;
+                                }
+                                metrics_service_labels(s, labels);
+                                metrics_sample(m, filesystem[i].name, labels, value);
+                        }
+                }
+                /* Ports */
+                for (int i = 0; i < 2; i++) {
+                        const char *name = i ? "monit_port_response_seconds" : "monit_port_up";
+                        metrics_family(m, name, "gauge", i ? "Connection test response time" : "Connection test result");
+                        for (Service_T s = servicelist_conf; s; s = s->next_conf) {
+                                if (! s->monitor)
+                                        continue;
+                                for (int list = 0; list < 2; list++) {
+                                        int index = 0;
+                                        for (Port_T p = list ? s->socketlist : s->portlist; p; p = p->next, index++) {
+                                                char port[STRLEN];
+                                                if (i && ! p->is_available)
+                                                        continue;
+                                                metrics_service_labels(s, labels);
+                                                /* The same target may be tested more than once, for example with different requests */
+                                                snprintf(port, sizeof(port), "%d", index);
+                                                metrics_label(labels, "index", port);
+                                                if (p->family == Socket_Unix) {
+                                                        metrics_label(labels, "path", p->target.unix.pathname);
+                                                } else {
+                                                        snprintf(port, sizeof(port), "%d", p->target.net.port);
+                                                        metrics_label(labels, "host", p->hostname);
+                                                        metrics_label(labels, "port", port);
+                                                }
+                                                metrics_label(labels, "protocol", p->protocol->name);
+                                                metrics_sample(m, name, labels, i ? p->response : p->is_available);
+                                        }
+                                }
+                        }
+                }
+                metrics_family(m, "monit_icmp_response_seconds", "gauge", "Ping response time");
+                for (Service_T s = servicelist_conf; s; s = s->next_conf) {
+                        if (! s->monitor)
+                                continue;
+                        int index = 0;
+                        for (Icmp_T i = s->icmplist; i; i = i->next, index++) {
+                                if (! i->is_available)
+                                        continue;
+                                char icmp[16];
+                                snprintf(icmp, sizeof(icmp), "%d", index);
+                                metrics_service_labels(s, labels);
+                                metrics_label(labels, "index", icmp);
+                                metrics_sample(m, "monit_icmp_response_seconds", labels, i->response);
+                        }
+                }
+                /* System */
+                metrics_family(m, "monit_system_load", "gauge", "System load average");
+                for (int i = 0; i < 3; i++) {
+                        static const char *periods[] = {"1m", "5m", "15m"};
+                        *labels = 0;
+                        metrics_label(labels, "period", periods[i]);
+                        metrics_sample(m, "monit_system_load", labels, systeminfo.loadavg[i]);
+                }
+                metrics_family(m, "monit_system_cpu_percent", "gauge", "System CPU usage");
+                for (int i = 0; i < 3; i++) {
+                        static const char *modes[] = {"user", "system", "wait"};
+                        short values[] = {systeminfo.total_cpu_user_percent, systeminfo.total_cpu_syst_percent, systeminfo.total_cpu_wait_percent};
+                        *labels = 0;
+                        metrics_label(labels, "mode", modes[i]);
+                        metrics_sample(m, "monit_system_cpu_percent", labels, values[i] > 0 ? values[i] / 10. : 0);
+                }
+                metrics_family(m, "monit_system_memory_bytes", "gauge", "System memory usage");
+                metrics_sample(m, "monit_system_memory_bytes", "", systeminfo.total_mem_kbyte * 1024.);
+                metrics_family(m, "monit_system_swap_bytes", "gauge", "System swap usage");
+                metrics_sample(m, "monit_system_swap_bytes", "", systeminfo.total_swap_kbyte * 1024.);
+                if (m->length + 8 > METRICS_BUFFER)
+                        metrics_flush(m);
+                m->length += snprintf(m->buffer + m->length, METRICS_BUFFER - m->length, "# EOF\n");
+                metrics_flush(m);
+        }
+        END_LOCK;
+}
+
+
 static void do_runtime(HttpRequest req, HttpResponse res) {
         int pid =  exist_daemon();
 
@@ -522,8 +801,16 @@ static void do_runtime(HttpRequest req, HttpResponse res) {
                                     "<tr><td>Default mail message</td><td>%s</td></tr>",
                                     Run.MailFormat.message);
         StringBuffer_append(res->outputbuffer,
-                            "<tr><td>Poll time</td><td>%d seconds with start delay %d seconds</td></tr>",
-                            Run.polltime, Run.startdelay);
+                            "<tr><td>Poll time</td><td>%g seconds with start delay %d seconds</td></tr>",
+                            Run.polltime / 1000., Run.startdelay);
+        StringBuffer_append(res->outputbuffer,
+                            "<tr><td>Poll cycle</td><td>start delay %lld ms, %llu checks skipped due to overrun</td></tr>",
+                            Run.cycle.jitter, Run.cycle.overruns);
+        for (Profile_Stage stage = Profile_Cycle; stage < Profile_Stages; stage++) {
+                char name[STRLEN];
+                snprintf(name, sizeof(name), "%s time", Profile_name(stage));
+                print_histogram(res, name, Profile_histogram(stage));
+        }
         if (Run.httpd.flags & Httpd_Net) {
                 StringBuffer_append(res->outputbuffer,
                                     "<tr><td>httpd bind address</td><td>%s</td></tr>",
@@ -644,19 +931,29 @@ static void handle_action(HttpRequest req, HttpResponse res) {
                         send_error(req, res, SC_BAD_REQUEST, "Invalid action \"%s\"", action);
                         return;
                 }
-                if (s->doaction != Action_Ignored) {
+                /* The service mutex guards the action request against the validation */
+                boolean_t busy = false;
+                LOCK(s->mutex)
+                {
+                        if (s->doaction != Action_Ignored) {
+                                busy = true;
+                        } else {
+                                s->doaction = doaction;
+                                const char *token = get_parameter(req, "token");
+                                if (token) {
+                                        FREE(s->token);
+                                        s->token = Str_dup(token);
+                                }
+                        }
+                }
+                END_LOCK;
+                if (busy) {
                         send_error(req, res, SC_SERVICE_UNAVAILABLE, "Other action already in progress -- please try again later");
                         return;
                 }
-                s->doaction = doaction;
-                const char *token = get_parameter(req, "token");
-                if (token) {
-                        FREE(s->token);
-                        s->token = Str_dup(token);
-                }
                 LogInfo("'%s' %s on user request\n", s->name, action);
                 Run.flags |= Run_ActionPending; /* set the global flag */
-                do_wakeupcall();
+                Schedule_notify();
         }
         do_service(req, res, s);
 }
@@ -684,11 +981,19 @@ static void handle_do_action(HttpRequest req, HttpResponse res) {
                                         send_error(req, res, SC_BAD_REQUEST, "There is no service named \"%s\"", p->value ? p->value : "");
                                         return;
                                 }
-                                if (s->doaction != Action_Ignored) {
+                                boolean_t busy = false;
+                                LOCK(s->mutex)
+                                {
+                                        if (s->doaction != Action_Ignored)
+                                                busy = true;
+                                        else
+                                                s->doaction = doaction;
+                                }
+                                END_LOCK;
+                                if (busy) {
                                         send_error(req, res, SC_SERVICE_UNAVAILABLE, "Other action already in progress -- please try again later");
                                         return;
                                 }
-                                s->doaction = doaction;
                                 LogInfo("'%s' %s on user request\n", s->name, action);
                         }
                 }
@@ -699,12 +1004,19 @@ static void handle_do_action(HttpRequest req, HttpResponse res) {
                                 if (s->doaction == doaction)
                                         q = s;
                         if (q) {
-                                FREE(q->token);
-                                q->token = Str_dup(token);
+                                LOCK(q->mutex)
+                                {
+                                        /* Unless the action was done already */
+                                        if (q->doaction == doaction) {
+                                                FREE(q->token);
+                                                q->token = Str_dup(token);
+                                        }
+                                }
+                                END_LOCK;
                         }
                 }
                 Run.flags |= Run_ActionPending;
-                do_wakeupcall();
+                Schedule_notify();
         }
 }
 
@@ -737,7 +1049,7 @@ static void do_service(HttpRequest req, HttpResponse res, Service_T s) {
 
         ASSERT(s);
 
-        do_head(res, s->name, s->name, Run.polltime);
+        do_head(res, s->name, s->name, MAX(Run.polltime / 1000, 1));
         StringBuffer_append(res->outputbuffer,
                             "<h2>%s status</h2>"
                             "<table id='status-table'>"
@@ -832,8 +1144,14 @@ static void do_service(HttpRequest req, HttpResponse res, Service_T s) {
                         StringBuffer_append(res->outputbuffer, "every <code>\"%s\"</code>", s->every.spec.cron);
                 else if (s->every.type == Every_NotInCron)
                         StringBuffer_append(res->outputbuffer, "not every <code>\"%s\"</code>", s->every.spec.cron);
+                else if (s->every.type == Every_Interval)
+                        if (s->every.adaptive.maximum)
+                                StringBuffer_append(res->outputbuffer, "every %d ms, adaptive up to %d ms (now %d ms)", s->every.spec.interval, s->every.adaptive.maximum, s->every.adaptive.current ? s->every.adaptive.current : s->every.spec.interval);
+                        else
+                                StringBuffer_append(res->outputbuffer, "every %d ms", s->every.spec.interval);
                 StringBuffer_append(res->outputbuffer, "</td></tr>");
         }
+        print_histogram(res, "Check time", &s->latency);
         // Status
         switch (s->type) {
                 case Service_Filesystem:
@@ -1528,6 +1846,21 @@ static void print_alerts(HttpResponse res, Mail_T s) {
 }
 
 
+static void print_histogram(HttpResponse res, const char *name, Histogram_T *h) {
+        if (! h->count)
+                return;
+        StringBuffer_append(res->outputbuffer,
+                            "<tr><td>%s</td><td>p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms, last %.3f ms (%llu samples)</td></tr>",
+                            name,
+                            Profile_percentile(h, 50) / 1000.,
+                            Profile_percentile(h, 95) / 1000.,
+                            Profile_percentile(h, 99) / 1000.,
+                            h->max / 1000.,
+                            h->last / 1000.,
+                            h->count);
+}
+
+
 static void print_buttons(HttpRequest req, HttpResponse res, Service_T s) {
         if (is_readonly(req)) {
                  // A read-only REMOTE_USER does not get access to these buttons
@@ -2526,7 +2859,10 @@ static void print_status(HttpRequest req, HttpResponse res, int version) {
                 StringBuffer_free(&sb);
                 set_content_type(res, "text/xml");
         } else {
-                char *uptime = Util_getUptime(getProcessUptime(getpid(), ptree, ptreesize), " ");
+                pthread_rwlock_rdlock(&ptreelock);
+                time_t monituptime = getProcessUptime(getpid(), ptree, ptreesize);
+                pthread_rwlock_unlock(&ptreelock);
+                char *uptime = Util_getUptime(monituptime, " ");
                 StringBuffer_append(res->outputbuffer, "The Monit daemon %s uptime: %s\n\n", VERSION, uptime);
                 FREE(uptime);
 
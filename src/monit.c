@@ -70,10 +70,17 @@
 #include <sys/wait.h>
 #endif
 
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
 #include "monit.h"
 #include "net.h"
 #include "process.h"
 #include "state.h"
+#include "schedule.h"
+#include "profile.h"
+#include "dispatch.h"
 #include "event.h"
 #include "engine.h"
 
@@ -135,6 +142,8 @@ int ptreesize = 0;
 int oldptreesize = 0;
 ProcessTree_T *ptree = NULL;
 ProcessTree_T *oldptree = NULL;
+/* The trees are read under the read lock, initprocesstree() takes the write lock */
+pthread_rwlock_t ptreelock = PTHREAD_RWLOCK_INITIALIZER;
 
 char *actionnames[] = {"ignore", "alert", "restart", "stop", "exec", "unmonitor", "start", "monitor", ""};
 char *modenames[] = {"active", "passive", "manual"};
@@ -333,6 +342,9 @@ static void do_reinit() {
         if (Run.httpd.flags & Httpd_Net || Run.httpd.flags & Httpd_Unix)
                 monit_http(Httpd_Stop);
 
+        /* Stop the notification dispatcher, it uses the configuration */
+        Dispatch_stop();
+
         /* Save the current state (no changes are possible now since the http thread is stopped) */
         State_save();
         State_close();
@@ -371,10 +383,16 @@ static void do_reinit() {
                 exit(1);
         State_update();
 
+        /* Schedule the new service list */
+        Schedule_init();
+
         /* Start http interface */
         if (can_http())
                 monit_http(Httpd_Start);
 
+        /* Start the notification dispatcher */
+        Dispatch_start();
+
         /* send the monit startup notification */
         Event_post(Run.system, Event_Instance, State_Changed, Run.system->action_MONIT_RELOAD, "Monit reloaded");
 
@@ -474,6 +492,9 @@ static void do_exit() {
                         heartbeatRunning = false;
                 }
 
+                /* The stop notification is sent directly */
+                Dispatch_stop();
+
                 LogInfo("Monit daemon with pid [%d] stopped\n", (int)getpid());
 
                 /* send the monit stop notification */
@@ -542,6 +563,9 @@ static void do_default() {
                 if (can_http())
                         monit_http(Httpd_Start);
 
+                /* Start the notification dispatcher */
+                Dispatch_start();
+
                 /* send the monit startup notification */
                 Event_post(Run.system, Event_Instance, State_Changed, Run.system->action_MONIT_START, "Monit %s started", VERSION);
 
@@ -551,16 +575,22 @@ static void do_default() {
                 }
 
                 while (true) {
+                        long long start = Profile_now();
                         validate();
+                        long long saved = Profile_now();
                         State_save();
+                        Profile_stage(Profile_StateSave, saved);
+                        Profile_cycle(start);
 
-                        /* In the case that there is no pending action then sleep */
+                        /* In the case that there is no pending action then sleep until some service is due */
                         if (! (Run.flags & Run_ActionPending))
-                                sleep(Run.polltime);
+                                Schedule_wait();
 
                         if (Run.flags & Run_DoWakeup) {
                                 Run.flags &= ~Run_DoWakeup;
                                 LogInfo("Awakened by User defined signal 1\n");
+                                /* Check all services now */
+                                Schedule_now();
                         }
 
                         if (Run.flags & Run_Stopped)
@@ -627,10 +657,11 @@ static void handle_options(int argc, char **argv) {
                                 {
                                         Run.flags |= Run_Daemon;
                                         sscanf(optarg, "%d", &Run.polltime);
-                                        if (Run.polltime < 1) {
+                                        if (Run.polltime < 1 || Run.polltime > INT_MAX / 1000) {
                                                 LogError("Option -%c requires a natural number\n", opt);
                                                 exit(1);
                                         }
+                                        Run.polltime *= 1000;
                                         break;
                                 }
                                 case 'g':
@@ -824,7 +855,7 @@ static void *heartbeat(void *args) {
         {
                 while (! (Run.flags & Run_Stopped) && ! (Run.flags & Run_DoReload)) {
                         handle_mmonit(NULL);
-                        struct timespec wait = {.tv_sec = Time_now() + Run.polltime, .tv_nsec = 0};
+                        struct timespec wait = {.tv_sec = Time_now() + MAX(Run.polltime / 1000, 1), .tv_nsec = 0};
                         Sem_timeWait(heartbeatCond, heartbeatMutex, wait);
                 }
         }
@@ -842,6 +873,7 @@ static void *heartbeat(void *args) {
  */
 static RETSIGTYPE do_reload(int sig) {
         Run.flags |= Run_DoReload;
+        Schedule_notify();
 }
 
 
@@ -850,6 +882,7 @@ static RETSIGTYPE do_reload(int sig) {
  */
 static RETSIGTYPE do_destroy(int sig) {
         Run.flags |= Run_Stopped;
+        Schedule_notify();
 }
 
 
@@ -858,6 +891,7 @@ static RETSIGTYPE do_destroy(int sig) {
  */
 static RETSIGTYPE do_wakeup(int sig) {
         Run.flags |= Run_DoWakeup;
+        Schedule_notify();
 }
 
 
@@ -148,8 +148,15 @@ typedef enum {
 
 #define SSL_TIMEOUT        15000
 #define SMTP_TIMEOUT       30000
+#define SMTP_IDLE          30000
 
 #define START_DELAY        0
+
+#define RETRY_BACKOFF      1000
+#define RETRY_MAXIMUM      30000
+#define RETRY_JITTER       20
+
+#define ADAPTIVE_AFTER     3
 #define EXEC_TIMEOUT       30
 #define PROGRAM_TIMEOUT    300
 
@@ -167,10 +174,21 @@ typedef enum {
         Run_MmonitCredentials    = 0x200,      /**< Should set M/Monit credentials */
         Run_Stopped              = 0x400,                          /**< Stop Monit */
         Run_DoReload             = 0x800,                        /**< Reload Monit */
-        Run_DoWakeup             = 0x1000                        /**< Wakeup Monit */
+        Run_DoWakeup             = 0x1000,                       /**< Wakeup Monit */
+        Run_ProcessEvents        = 0x2000,     /**< Use kernel process events if available */
+        Run_SpreadChecks         = 0x4000           /**< Spread the checks over the interval */
 } __attribute__((__packed__)) Run_Flags;
 
 
+/** The per process information collected by the process engine */
+typedef enum {
+        ProcessField_Stat    = 0x1,    /**< State, parent, CPU and memory usage */
+        ProcessField_Status  = 0x2,                   /**< Real/effective uid, gid */
+        ProcessField_Cmdline = 0x4,        /**< Command line for the match test */
+        ProcessField_All     = 0x7
+} __attribute__((__packed__)) ProcessField_Type;
+
+
 typedef enum {
         Httpd_Start = 1,
         Httpd_Stop
@@ -181,7 +199,8 @@ typedef enum {
         Every_Cycle = 0,
         Every_SkipCycles,
         Every_Cron,
-        Every_NotInCron
+        Every_NotInCron,
+        Every_Interval
 } __attribute__((__packed__)) Every_Type;
 
 
@@ -324,6 +343,13 @@ typedef enum {
 } __attribute__((__packed__)) Handler_Type;
 
 
+typedef enum {
+        Sync_Never = 0,
+        Sync_Cycle,
+        Sync_Always
+} __attribute__((__packed__)) Sync_Type;
+
+
 /* Length of the longest message digest in bytes */
 #define MD_SIZE 65
 
@@ -414,6 +440,7 @@ typedef struct myaction {
 typedef struct myeventaction {
         Action_T  failed;                  /**< Action in the case of failure down */
         Action_T  succeeded;                    /**< Action in the case of failure up */
+        int       slot;        /**< Index of the rule in the service event table */
 } *EventAction_T;
 
 
@@ -577,6 +604,7 @@ typedef struct myport {
         Socket_Type type;           /**< Socket type used for connection (UDP/TCP) */
         Socket_Family family;    /**< Socket family used for connection (NET/UNIX) */
         boolean_t is_available;          /**< true if the server/port is available */
+        boolean_t async;            /**< true if tested by the asynchronous engine */
         EventAction_T action;  /**< Description of the action upon event occurence */
         /** Protocol specific parameters */
         union {
@@ -635,6 +663,14 @@ typedef struct myport {
         Request_T url_request;             /**< Optional url client request object */
 
         /** For internal use */
+        struct {
+                boolean_t done;       /**< true if tested by the asynchronous engine */
+                char *error;              /**< Failed test report or NULL on success */
+        } probe;
+        struct {
+                int attempt;   /**< Failed attempts while a retry is pending, or 0 */
+                long long due;                /**< Time of the next attempt (ms) */
+        } pending;
         struct myport *next;                               /**< next port in chain */
 } *Port_T;
 
@@ -701,7 +737,7 @@ typedef struct myactionrate {
 /** Defines when to run a check for a service. This type suports both the old
  cycle based every statement and the new cron-format version */
 typedef struct myevery {
-        Every_Type type; /**< 0 = not set, 1 = cycle, 2 = cron, 3 = negated cron */
+        Every_Type type; /**< 0 = not set, 1 = cycle, 2 = cron, 3 = negated cron, 4 = interval */
         time_t last_run;
         union {
                 struct {
@@ -709,10 +745,30 @@ typedef struct myevery {
                         int counter; /**< Counter for number. When counter == number, check */
                 } cycle; /**< Old cycle based every check */
                 char *cron; /* A crontab format string */
+                int interval; /**< Check interval in milliseconds */
         } spec;
+        struct {
+                int maximum; /**< Max adaptive interval in milliseconds, 0 if not adaptive */
+                int after;   /**< Successful checks before the interval is relaxed */
+                /** For internal use */
+                int current;          /**< The current interval in milliseconds */
+                int successes;               /**< Consecutive successful checks */
+        } adaptive;
 } Every_T;
 
 
+#define HISTOGRAM_BUCKETS 104
+
+/** Defines a latency histogram with 4 buckets per power of two microseconds */
+typedef struct myhistogram {
+        unsigned long long count;                     /**< Number of samples */
+        unsigned long long sum;           /**< Sum of the samples (microseconds) */
+        long long last;                       /**< The last sample (microseconds) */
+        long long max;                       /**< The largest sample (microseconds) */
+        unsigned int bucket[HISTOGRAM_BUCKETS];          /**< Samples per bucket */
+} Histogram_T;
+
+
 typedef struct mystatus {
         boolean_t initialized;                 /**< true if status was initialized */
         Operator_Type operator;                           /**< Comparison operator */
@@ -950,6 +1006,10 @@ typedef struct myinfo {
                         short cpu_percent;                                /**< percentage * 10 */
                         short total_cpu_percent;                          /**< percentage * 10 */
                         time_t uptime;                                     /**< Process uptime */
+                        int pidfd;          /**< Descriptor of the tracked process or -1 */
+                        pid_t pidfd_pid;                 /**< Process PID of the pidfd */
+                        unsigned long long cgroup_usage; /**< cgroup CPU usage [us] */
+                        long long cgroup_time;   /**< Time of the cgroup_usage sample [us] */
                 } process;
 
                 struct {
@@ -1049,15 +1109,29 @@ typedef struct myservice {
                 /** For internal use */
                 struct myevent   *next;                         /**< next event in chain */
         } *eventlist;                                     /**< Pending events list */
+        struct {
+                int count;                            /**< Number of event slots */
+                struct myevent **slot;  /**< Events indexed by event action slot */
+        } events;
 
         /** Context specific parameters */
         char *path;  /**< Path to the filesys, file, directory or process pid file */
+        char *cgroup;       /**< cgroup v2 directory for the process total usage */
 
         /** For internal use */
         Mutex_T mutex;                  /**< Mutex used for action synchronization */
         struct myservice *next;                         /**< next service in chain */
         struct myservice *next_conf;      /**< next service according to conf file */
         struct myservice *next_depend;           /**< next depend service in chain */
+        struct {
+                long long due;         /**< Next check time (monotonic, ms) */
+                int order;               /**< Position in the service list */
+                boolean_t ready;       /**< The check is due in this cycle */
+                boolean_t deferred;   /**< Some work of the service is deferred */
+                struct myservice *next;   /**< next service in schedule slot */
+                struct myservice *next_deferred;   /**< next deferred service */
+        } schedule;
+        Histogram_T latency;                 /**< Duration of the service check */
 } *Service_T;
 
 
@@ -1087,16 +1161,30 @@ struct myrun {
         } files;
         char *mygroup;                              /**< Group Name of the Service */
         MD_T id;                                              /**< Unique monit id */
-        int  polltime;        /**< In deamon mode, the sleeptime (sec) between run */
+        int  polltime;        /**< In deamon mode, the poll cycle (ms) between run */
         int  startdelay;                    /**< the sleeptime (sec) after startup */
         int  facility;              /** The facility to use when running openlog() */
         int  eventlist_slots;          /**< The event queue size - number of slots */
         int  expectbuffer; /**< Generic protocol expect buffer - STRLEN by default */
         int mailserver_timeout; /**< Connect and read timeout ms for a SMTP server */
+        int mailserver_idle;    /**< Time ms an idle SMTP session is kept open */
+        int  process_workers;   /**< Number of threads collecting process data */
+        int  process_fields;   /**< ProcessField_* needed by the process tests */
+        int  validate_workers;        /**< Number of threads validating services */
+        struct {
+                int backoff;          /**< Delay of the first connection retry (ms) */
+                int maximum;                     /**< Maximum delay of a retry (ms) */
+                int jitter;     /**< Random variation of the retry delay (percent) */
+        } retry;
+        struct {
+                long long jitter;  /**< Start delay of the last cycle checks (ms) */
+                unsigned long long overruns; /**< Checks skipped as cycles overran */
+        } cycle;
         time_t incarnation;              /**< Unique ID for running monit instance */
         int  handler_queue[Handler_Max + 1];       /**< The handlers queue counter */
         Service_T system;                          /**< The general system service */
         char *eventlist_dir;                   /**< The event queue base directory */
+        Sync_Type eventlist_sync;                /**< The event queue fsync policy */
 
         /** An object holding Monit HTTP interface setup */
         struct {
@@ -1154,6 +1242,7 @@ extern ProcessTree_T *ptree;
 extern int            ptreesize;
 extern ProcessTree_T *oldptree;
 extern int            oldptreesize;
+extern pthread_rwlock_t ptreelock;
 
 extern char *actionnames[];
 extern char *modenames[];
@@ -1202,6 +1291,7 @@ void vsyslog (int, const char *, va_list);
 #endif /* HAVE_SYSLOG */
 #endif /* HAVE_VSYSLOG */
 int   validate();
+boolean_t is_skipped(Service_T);
 void  daemonize();
 void  gc();
 void  gc_mail_list(Mail_T *);
@@ -1210,6 +1300,8 @@ void  gc_event(Event_T *e);
 boolean_t kill_daemon(int);
 int   exist_daemon();
 boolean_t sendmail(Mail_T);
+void  sendmail_idle();
+void  sendmail_close();
 void  init_env();
 void  monit_http(Httpd_Action);
 boolean_t can_http();
@@ -304,7 +304,7 @@ static int verifyMaxForward(int);
 %token PIDFILE START STOP PATHTOK
 %token HOST HOSTNAME PORT IPV4 IPV6 TYPE UDP TCP TCPSSL PROTOCOL CONNECTION
 %token ALERT NOALERT MAILFORMAT UNIXSOCKET SIGNATURE
-%token TIMEOUT RETRY RESTART CHECKSUM EVERY NOTEVERY
+%token TIMEOUT RETRY ASYNC RESTART CHECKSUM EVERY NOTEVERY
 %token DEFAULT HTTP HTTPS APACHESTATUS FTP SMTP SMTPS POP POPS IMAP IMAPS CLAMAV NNTP NTP3 MYSQL DNS WEBSOCKET
 %token SSH DWP LDAP2 LDAP3 RDATE RSYNC TNS PGSQL POSTFIXPOLICY SIP LMTP GPS RADIUS MEMCACHE REDIS MONGODB SIEVE
 %token <string> STRING PATH MAILADDR MAILFROM MAILREPLYTO MAILSUBJECT
@@ -319,7 +319,7 @@ static int verifyMaxForward(int);
 %token MODE ACTIVE PASSIVE MANUAL CPU TOTALCPU CPUUSER CPUSYSTEM CPUWAIT
 %token GROUP REQUEST DEPENDS BASEDIR SLOT EVENTQUEUE SECRET HOSTHEADER
 %token UID EUID GID MMONIT INSTANCE USERNAME PASSWORD
-%token TIMESTAMP CHANGED SECOND MINUTE HOUR DAY MONTH
+%token TIMESTAMP CHANGED MILLISECOND SECOND MINUTE HOUR DAY MONTH
 %token SSLAUTO SSLV2 SSLV3 TLSV1 TLSV11 TLSV12 CERTMD5
 %token BYTE KILOBYTE MEGABYTE GIGABYTE
 %token INODE SPACE TFREE PERMISSION SIZE MATCH NOT IGNORE ACTION UPTIME
@@ -330,6 +330,7 @@ static int verifyMaxForward(int);
 %token <string> TARGET TIMESPEC HTTPHEADER
 %token <number> MAXFORWARD
 %token FIPS
+%token PROCESSENGINE EVENTS WORKERS CGROUP VALIDATION BACKOFF MAXIMUM JITTER SCHEDULE SPREAD ADAPTIVE AFTER FSYNC ALWAYS NEVER IDLE
 
 %left GREATER LESS EQUAL NOTEQUAL
 
@@ -357,6 +358,10 @@ statement       : setalert
                 | setexpectbuffer
                 | setinit
                 | setfips
+                | setprocessengine
+                | setvalidation
+                | setretry
+                | setschedule
                 | checkproc optproclist
                 | checkfile optfilelist
                 | checkfilesys optfilesyslist
@@ -391,6 +396,7 @@ optproc         : start
                 | group
                 | depend
                 | resourceprocess
+                | cgroup
                 ;
 
 optfilelist      : /* EMPTY */
@@ -556,16 +562,23 @@ setalert        : SET alertmail formatlist reminder {
                   }
                 ;
 
-setdaemon       : SET DAEMON NUMBER startdelay {
+setdaemon       : SET DAEMON NUMBER polltime startdelay {
                     if (! (Run.flags & Run_Daemon) || ihp.daemon) {
+                      if ($3 < 1 || $3 > INT_MAX / $<number>4 || $3 * $<number>4 < 10)
+                        yyerror2("Invalid poll time -- the minimum is 10 milliseconds");
                       ihp.daemon     = true;
                       Run.flags      |= Run_Daemon;
-                      Run.polltime   = $3;
-                      Run.startdelay = $<number>4;
+                      Run.polltime   = $3 * $<number>4;
+                      Run.startdelay = $<number>5;
                     }
                   }
                 ;
 
+polltime        : /* EMPTY */ { $<number>$ = 1000; }
+                | MILLISECOND { $<number>$ = 1; }
+                | SECOND      { $<number>$ = 1000; }
+                ;
+
 startdelay      : /* EMPTY */        { $<number>$ = START_DELAY; }
                 | START DELAY NUMBER { $<number>$ = $3; }
                 ;
@@ -587,6 +600,62 @@ setfips         : SET FIPS {
                   }
                 ;
 
+setprocessengine: SET PROCESSENGINE processengineoptlist
+                ;
+
+processengineoptlist : processengineopt
+                | processengineoptlist processengineopt
+                ;
+
+processengineopt: EVENTS {
+                    Run.flags |= Run_ProcessEvents;
+                  }
+                | WORKERS NUMBER {
+                    if ($2 < 1 || $2 > 64)
+                        yyerror("The number of process engine workers must be between 1 and 64");
+                    Run.process_workers = $2;
+                  }
+                ;
+
+setvalidation   : SET VALIDATION WORKERS NUMBER {
+                    if ($4 < 1 || $4 > 256)
+                        yyerror("The number of validation workers must be between 1 and 256");
+                    Run.validate_workers = $4;
+                  }
+                ;
+
+setschedule     : SET SCHEDULE SPREAD {
+                    Run.flags |= Run_SpreadChecks;
+                  }
+                ;
+
+setretry        : SET RETRY BACKOFF NUMBER interval retrymaximum retryjitter {
+                    if ($4 < 0 || $4 > INT_MAX / $<number>5)
+                        yyerror("Invalid retry backoff");
+                    Run.retry.backoff = $4 * $<number>5;
+                    Run.retry.maximum = $<number>6 >= 0 ? $<number>6 : MAX(RETRY_MAXIMUM, Run.retry.backoff);
+                    Run.retry.jitter = $<number>7;
+                    if (Run.retry.maximum < Run.retry.backoff)
+                        yyerror("The maximum retry backoff must not be lower than the first retry backoff");
+                  }
+                ;
+
+retrymaximum    : /* EMPTY */ { $<number>$ = -1; }
+                | MAXIMUM NUMBER interval {
+                    if ($2 < 0 || $2 > INT_MAX / $<number>3)
+                        yyerror("Invalid maximum retry backoff");
+                    $<number>$ = $2 * $<number>3;
+                  }
+                ;
+
+retryjitter     : /* EMPTY */ { $<number>$ = RETRY_JITTER; }
+                | JITTER NUMBER PERCENT {
+                    if ($2 < 0 || $2 > 100)
+                        yyerror("The retry jitter must be between 0 and 100 percent");
+                    $<number>$ = $2;
+                  }
+                ;
+
 setlog          : SET LOGFILE PATH   {
                    if (! Run.files.log || ihp.logfile) {
                      ihp.logfile = true;
@@ -603,19 +672,31 @@ setlog          : SET LOGFILE PATH   {
                   }
                 ;
 
-seteventqueue   : SET EVENTQUEUE BASEDIR PATH {
+seteventqueue   : SET EVENTQUEUE BASEDIR PATH eventqueuesync {
                     Run.eventlist_dir = $4;
                   }
-                | SET EVENTQUEUE BASEDIR PATH SLOT NUMBER {
+                | SET EVENTQUEUE BASEDIR PATH SLOT NUMBER eventqueuesync {
                     Run.eventlist_dir = $4;
                     Run.eventlist_slots = $6;
                   }
-                | SET EVENTQUEUE SLOT NUMBER {
+                | SET EVENTQUEUE SLOT NUMBER eventqueuesync {
                     Run.eventlist_dir = Str_dup(MYEVENTLISTBASE);
                     Run.eventlist_slots = $4;
                   }
                 ;
 
+eventqueuesync  : /* EMPTY */
+                | FSYNC ALWAYS {
+                    Run.eventlist_sync = Sync_Always;
+                  }
+                | FSYNC CYCLE {
+                    Run.eventlist_sync = Sync_Cycle;
+                  }
+                | FSYNC NEVER {
+                    Run.eventlist_sync = Sync_Never;
+                  }
+                ;
+
 setidfile       : SET IDFILE PATH {
                     Run.files.id = $3;
                   }
@@ -666,10 +747,21 @@ credentials     : /* EMPTY */
                   }
                 ;
 
-setmailservers  : SET MAILSERVER mailserverlist nettimeout hostname {
+setmailservers  : SET MAILSERVER mailserverlist nettimeout mailidle hostname {
                    if (($<number>4) > SMTP_TIMEOUT)
                      Run.mailserver_timeout = $<number>4;
-                   Run.mail_hostname = $<string>5;
+                   Run.mailserver_idle = $<number>5;
+                   Run.mail_hostname = $<string>6;
+                  }
+                ;
+
+mailidle        : /* EMPTY */ {
+                   $<number>$ = SMTP_IDLE;
+                  }
+                | IDLE NUMBER SECOND {
+                   if ($2 < 0 || $2 > INT_MAX / 1000)
+                        yyerror2("Invalid mailserver idle time");
+                   $<number>$ = $2 * 1000; // idle time is in milliseconds internally
                   }
                 ;
 
@@ -1076,20 +1168,22 @@ hostname        : /* EMPTY */     {
                   }
                 ;
 
-connection      : IF FAILED host port ip type ssloptlist protocol urloption nettimeout retry rate1 THEN action1 recovery {
+connection      : IF FAILED host port ip type ssloptlist protocol urloption nettimeout retry async rate1 THEN action1 recovery {
                     portset.timeout = $<number>10;
                     portset.retry = $<number>11;
+                    portset.async = $<number>12;
                     /* This is a workaround to support content match without having to create an URL object. 'urloption' creates the Request_T object we need minus the URL object, but with enough information to perform content test.
                      TODO: Parser is in need of refactoring */
                     portset.url_request = urlrequest;
-                    addeventaction(&(portset).action, $<number>14, $<number>15);
+                    addeventaction(&(portset).action, $<number>15, $<number>16);
                     addport(&(current->portlist), &portset);
                   }
-                | IF FAILED URL URLOBJECT urloption ssloptlist nettimeout retry rate1 THEN action1 recovery {
+                | IF FAILED URL URLOBJECT urloption ssloptlist nettimeout retry async rate1 THEN action1 recovery {
                     prepare_urlrequest($<url>4);
                     portset.timeout = $<number>7;
                     portset.retry = $<number>8;
-                    addeventaction(&(portset).action, $<number>11, $<number>12);
+                    portset.async = $<number>9;
+                    addeventaction(&(portset).action, $<number>12, $<number>13);
                     addport(&(current->portlist), &portset);
                   }
                 ;
@@ -1540,6 +1634,15 @@ ppid            : IF CHANGED PPID rate1 THEN action1 {
                   }
                 ;
 
+cgroup          : CGROUP PATH {
+                    current->cgroup = $2;
+                  }
+                | CGROUP STRING {
+                    current->cgroup = Str_cat("/sys/fs/cgroup/%s", $2);
+                    FREE($2);
+                  }
+                ;
+
 uptime          : IF UPTIME operator NUMBER time rate1 THEN action1 recovery {
                     uptimeset.operator = $<number>3;
                     uptimeset.uptime = ((unsigned long long)$4 * $<number>5);
@@ -1587,6 +1690,14 @@ retry           : /* EMPTY */ {
                   }
                 ;
 
+async           : /* EMPTY */ {
+                   $<number>$ = false;
+                  }
+                | ASYNC {
+                   $<number>$ = true;
+                  }
+                ;
+
 actionrate      : IF NUMBER RESTART NUMBER CYCLE THEN action1 {
                    actionrateset.count = $2;
                    actionrateset.cycle = $4;
@@ -1687,6 +1798,22 @@ every           : EVERY NUMBER CYCLE {
                    current->every.type = Every_SkipCycles;
                    current->every.spec.cycle.number = $2;
                  }
+                | EVERY NUMBER interval {
+                   if ($2 < 1 || $2 > INT_MAX / $<number>3)
+                        yyerror2("Invalid every interval");
+                   current->every.type = Every_Interval;
+                   current->every.spec.interval = $2 * $<number>3;
+                 }
+                | EVERY NUMBER interval ADAPTIVE MAXIMUM NUMBER interval adaptiveafter {
+                   if ($2 < 1 || $2 > INT_MAX / $<number>3)
+                        yyerror2("Invalid every interval");
+                   if ($6 < 1 || $6 > INT_MAX / $<number>7 || $6 * $<number>7 < $2 * $<number>3)
+                        yyerror2("Invalid adaptive maximum interval -- must not be lower than the every interval");
+                   current->every.type = Every_Interval;
+                   current->every.spec.interval = $2 * $<number>3;
+                   current->every.adaptive.maximum = $6 * $<number>7;
+                   current->every.adaptive.after = $<number>8;
+                 }
                 | EVERY TIMESPEC {
                    current->every.type = Every_Cron;
                    current->every.spec.cron = $2;
@@ -1697,6 +1824,14 @@ every           : EVERY NUMBER CYCLE {
                  }
                 ;
 
+adaptiveafter   : /* EMPTY */ { $<number>$ = ADAPTIVE_AFTER; }
+                | AFTER NUMBER CYCLE {
+                   if ($2 < 1)
+                        yyerror2("The adaptive interval can be relaxed after 1 or more cycles");
+                   $<number>$ = $2;
+                 }
+                ;
+
 mode            : MODE ACTIVE  {
                     current->mode = Monitor_Active;
                   }
@@ -1889,6 +2024,12 @@ totaltime       : MINUTE      { $<number>$ = Time_Minute; }
                 | HOUR        { $<number>$ = Time_Hour; }
                 | DAY         { $<number>$ = Time_Day; }
 
+interval        : MILLISECOND { $<number>$ = 1; }
+                | SECOND      { $<number>$ = 1000; }
+                | MINUTE      { $<number>$ = 60000; }
+                | HOUR        { $<number>$ = 3600000; }
+                ;
+
 currenttime     : /* EMPTY */ { $<number>$ = Time_Second; }
                 | SECOND      { $<number>$ = Time_Second; }
 
@@ -2449,9 +2590,17 @@ static void preparse() {
         Run.httpd.credentials       = NULL;
         memset(&(Run.httpd.socket), 0, sizeof(Run.httpd.socket));
         Run.mailserver_timeout      = SMTP_TIMEOUT;
+        Run.mailserver_idle         = SMTP_IDLE;
+        Run.process_workers         = 1;
+        Run.process_fields          = ProcessField_All;
+        Run.validate_workers        = 1;
+        Run.retry.backoff           = RETRY_BACKOFF;
+        Run.retry.maximum           = RETRY_MAXIMUM;
+        Run.retry.jitter            = RETRY_JITTER;
         Run.eventlist               = NULL;
         Run.eventlist_dir           = NULL;
         Run.eventlist_slots         = -1;
+        Run.eventlist_sync          = Sync_Cycle;
         Run.system                  = NULL;
         Run.expectbuffer            = STRLEN;
         Run.mmonits                 = NULL;
@@ -2463,6 +2612,7 @@ static void preparse() {
         Run.MailFormat.message      = NULL;
         depend_list                 = NULL;
         Run.flags |= Run_HandlerInit | Run_MmonitCredentials;
+        Run.flags &= ~(Run_ProcessEvents | Run_SpreadChecks);
         for (i = 0; i <= Handler_Max; i++)
                 Run.handler_queue[i] = 0;
         /*
@@ -2547,6 +2697,17 @@ static void postparse() {
                 }
         }
 
+        /* Collect only the process information used by the tests. The credentials of the service processes are read in any case for the status report */
+        Run.process_fields = ProcessField_Stat;
+        for (Service_T s = servicelist; s; s = s->next) {
+                if (s->type == Service_Process) {
+                        if (s->matchlist)
+                                Run.process_fields |= ProcessField_Cmdline;
+                        if (s->uid || s->euid || s->gid)
+                                Run.process_fields |= ProcessField_Status;
+                }
+        }
+
         /* Check the sanity of any dependency graph */
         check_depend();
 
@@ -2570,10 +2731,13 @@ static Service_T createservice(Service_Type type, char *name, char *value, boole
                 addservice(current);
 
         NEW(current);
+        Mutex_init(current->mutex);
 
         current->type = type;
 
         NEW(current->inf);
+        if (type == Service_Process)
+                current->inf->priv.process.pidfd = -1;
         Util_resetInfo(current);
 
         if (type == Service_Program) {
@@ -2756,6 +2920,13 @@ static void addport(Port_T *list, Port_T port) {
         if (port->protocol->check == check_radius && port->type != Socket_Udp)
                 yyerror("Radius protocol test supports UDP only");
 
+        if (port->async) {
+                if (port->family == Socket_Unix || port->type != Socket_Tcp || port->target.net.SSL.use_ssl)
+                        yyerror("The async connection test supports plain TCP only");
+                else if (port->protocol->check != check_default && port->protocol->check != check_generic && port->protocol->check != check_http)
+                        yyerror2("The async connection test does not support the %s protocol", port->protocol->name);
+        }
+
         Port_T p;
         NEW(p);
         p->type               = port->type;
@@ -2764,6 +2935,7 @@ static void addport(Port_T *list, Port_T port) {
         p->action             = port->action;
         p->timeout            = port->timeout;
         p->retry              = port->retry;
+        p->async              = port->async;
         p->protocol           = port->protocol;
         p->hostname           = port->hostname;
         p->url_request        = port->url_request;
@@ -3395,6 +3567,8 @@ static void addeventaction(EventAction_T *_ea, Action_Type failed, Action_Type s
                 ea->succeeded->exec = command2;
                 command2 = NULL;
         }
+        /* Each rule gets a slot in the service event table for O(1) event lookup */
+        ea->slot = current ? current->events.count++ : -1;
         *_ea = ea;
         reset_rateset();
 }
@@ -4237,10 +4411,11 @@ static void check_depend() {
         ASSERT(depend_list);
         servicelist = depend_list;
 
-        for (s = depend_list; s; s = s->next_depend)
+        /* The sort used the visited flags, reset_depend() resets only the flags set by the actions */
+        for (s = depend_list; s; s = s->next_depend) {
                 s->next = s->next_depend;
-
-        reset_depend();
+                s->visited = false;
+        }
 }
 
 
@@ -0,0 +1,581 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STDARG_H
+#include <stdarg.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "monit.h"
+#include "net.h"
+#include "protocol.h"
+#include "probe.h"
+#include "schedule.h"
+
+// libmonit
+#include "system/Time.h"
+#include "util/Str.h"
+#include "util/StringBuffer.h"
+#include "exceptions/IOException.h"
+
+
+/**
+ * Implementation of the asynchronous connection tests. Each port is tested by
+ * a probe, which moves through the Connect -> Send -> Receive states. The
+ * generic protocol repeats the Send/Receive states for each send/expect step,
+ * the http protocol sends the request and receives the response once. The
+ * probe waits for the socket in the epoll set and for its deadline, which is
+ * the port timeout or the short idle timeout of the generic expect.
+ *
+ * The addresses are resolved before the event loop starts, so the blocking
+ * name lookup doesn't hold up the probes in flight. The epoll event carries
+ * the probe index and the serial number of its connection: a probe restarted
+ * in place gets a new socket, usually with the same descriptor number, and
+ * the events left from the old connection in the same batch are dropped.
+ *
+ *  @file
+ */
+
+
+/* ------------------------------------------------------------- Definitions */
+
+
+#define PROBE_MAX 1024                        /* Max number of concurrent connections */
+#define PROBE_EVENTS 64                  /* Max number of events read per epoll_wait() */
+#define PROBE_IDLE 200      /* Generic expect: ms to wait for more data after first read */
+#define PROBE_RESPONSE_MAX 1064960  /* Http: max response size (1MB content + headers) */
+#define PROBE_RESPONSE_INITIAL 8192 /* Http: initial response buffer, grows up to the max */
+
+
+typedef enum {
+        Probe_Connect = 0,
+        Probe_Send,
+        Probe_Receive
+} Probe_State;
+
+
+typedef struct Probe_T {
+        Service_T service;
+        Port_T port;
+        struct addrinfo *addresses;
+        struct addrinfo *address;
+        int socket;
+        unsigned connection;               /* Serial number of the current socket */
+        int attempt;
+        Probe_State state;
+        boolean_t finished;
+        boolean_t idle;
+        long long started;
+        long long deadline;
+        Generic_T step;
+        char *out;
+        int outLength;
+        int outOffset;
+        char *in;
+        int inLength;
+        int inSize;
+        char error[STRLEN];
+} *Probe_T;
+
+
+#ifdef HAVE_SYS_EPOLL_H
+static struct {
+        int epoll;
+        int active;
+        Probe_T probes;
+} engine = {
+        .epoll = -1
+};
+#endif
+
+
+/* ----------------------------------------------------------------- Private */
+
+
+#ifdef HAVE_SYS_EPOLL_H
+
+
+static void _connect(Probe_T probe);
+static void _next(Probe_T probe);
+
+
+static void _watch(Probe_T probe, unsigned events) {
+        struct epoll_event e = {.events = events, .data.u64 = (uint64_t)probe->connection << 32 | (uint32_t)(probe - engine.probes)};
+        if (epoll_ctl(engine.epoll, EPOLL_CTL_MOD, probe->socket, &e) < 0)
+                epoll_ctl(engine.epoll, EPOLL_CTL_ADD, probe->socket, &e);
+}
+
+
+static void _close(Probe_T probe) {
+        if (probe->socket >= 0) {
+                epoll_ctl(engine.epoll, EPOLL_CTL_DEL, probe->socket, NULL);
+                close(probe->socket);
+                probe->socket = -1;
+        }
+        FREE(probe->out);
+        FREE(probe->in);
+        probe->outLength = probe->outOffset = probe->inLength = probe->inSize = 0;
+}
+
+
+static void _finish(Probe_T probe) {
+        _close(probe);
+        if (probe->addresses) {
+                freeaddrinfo(probe->addresses);
+                probe->addresses = probe->address = NULL;
+        }
+        probe->finished = true;
+        probe->port->probe.done = true;
+        engine.active--;
+}
+
+
+/**
+ * Store the failed test result in the port
+ */
+static void _report(Probe_T probe, const char *error) {
+        char buf[STRLEN];
+        char report[STRLEN];
+        snprintf(report, sizeof(report), "failed protocol test [%s] at %s -- %s", probe->port->protocol->name, Util_portDescription(probe->port, buf, sizeof(buf)), error);
+        probe->port->is_available = false;
+        probe->port->response = -1;
+        probe->port->probe.error = Str_dup(report);
+        probe->port->probe.done = true;
+}
+
+
+static void _succeed(Probe_T probe) {
+        char buf[STRLEN];
+        probe->port->is_available = true;
+        probe->port->response = (Time_milli() - probe->started) / 1000.;
+        DEBUG("'%s' succeeded testing protocol [%s] at %s\n", probe->service->name, probe->port->protocol->name, Util_portDescription(probe->port, buf, sizeof(buf)));
+        _finish(probe);
+}
+
+
+/**
+ * Resolve the addresses of the probe. If the name cannot be resolved, the
+ * test fails at once, a retry within the cycle wouldn't get another answer
+ */
+static boolean_t _resolve(Probe_T probe) {
+        char port[11];
+        struct addrinfo hints = {
+                .ai_socktype = SOCK_STREAM,
+                .ai_protocol = IPPROTO_TCP,
+                .ai_family = probe->port->family == Socket_Ip4 ? AF_INET : probe->port->family == Socket_Ip6 ? AF_INET6 : AF_UNSPEC
+        };
+        snprintf(port, sizeof(port), "%d", probe->port->target.net.port);
+        int status = getaddrinfo(probe->port->hostname, port, &hints, &probe->addresses);
+        if (status) {
+                char error[STRLEN];
+                probe->addresses = NULL;
+                snprintf(error, sizeof(error), "Cannot translate '%s' to IP address -- %s", probe->port->hostname, status == EAI_SYSTEM ? STRERROR : gai_strerror(status));
+                _report(probe, error);
+                return false;
+        }
+        return true;
+}
+
+
+static void _start(Probe_T probe) {
+        probe->started = Time_milli();
+        probe->state = Probe_Connect;
+        probe->step = probe->port->protocol->check == check_generic ? probe->port->parameters.generic.sendexpect : NULL;
+        probe->address = probe->addresses;
+        _connect(probe);
+}
+
+
+static void _fail(Probe_T probe, const char *s, ...) __attribute__((format (printf, 2, 3)));
+static void _fail(Probe_T probe, const char *s, ...) {
+        char error[STRLEN];
+        va_list ap;
+        va_start(ap, s);
+        vsnprintf(error, sizeof(error), s, ap);
+        va_end(ap);
+        _close(probe);
+        *probe->error = 0;
+        if (++probe->attempt < probe->port->retry) {
+                char buf[STRLEN];
+                DEBUG("'%s' failed protocol test [%s] at %s -- %s (attempt %d/%d)\n", probe->service->name, probe->port->protocol->name, Util_portDescription(probe->port, buf, sizeof(buf)), error, probe->attempt, probe->port->retry);
+                _start(probe);
+        } else {
+                _report(probe, error);
+                _finish(probe);
+        }
+}
+
+
+/**
+ * Connect to the current address, move to the next address if the connection cannot be established
+ */
+static void _connect(Probe_T probe) {
+        for (; probe->address; probe->address = probe->address->ai_next) {
+                if ((probe->socket = socket(probe->address->ai_family, probe->address->ai_socktype, probe->address->ai_protocol)) < 0) {
+                        snprintf(probe->error, sizeof(probe->error), "Cannot create socket -- %s", STRERROR);
+                        continue;
+                }
+                probe->connection++;
+                if (! Net_setNonBlocking(probe->socket) || fcntl(probe->socket, F_SETFD, FD_CLOEXEC) == -1) {
+                        snprintf(probe->error, sizeof(probe->error), "Cannot set socket options -- %s", STRERROR);
+                        _close(probe);
+                        continue;
+                }
+                probe->deadline = Time_milli() + probe->port->timeout;
+                if (connect(probe->socket, probe->address->ai_addr, probe->address->ai_addrlen) == 0) {
+                        _next(probe);
+                        return;
+                } else if (errno == EINPROGRESS) {
+                        _watch(probe, EPOLLOUT);
+                        return;
+                }
+                snprintf(probe->error, sizeof(probe->error), "Connection failed -- %s", STRERROR);
+                _close(probe);
+        }
+        _fail(probe, "%s", *probe->error ? probe->error : "No address to connect to");
+}
+
+
+/**
+ * Set up the next protocol step. The steps follow the blocking check_default(),
+ * check_generic() and check_http() tests
+ */
+static void _next(Probe_T probe) {
+        Port_T p = probe->port;
+        probe->deadline = Time_milli() + p->timeout;
+        probe->idle = false;
+        FREE(probe->out);
+        probe->outLength = probe->outOffset = 0;
+        if (p->protocol->check == check_http) {
+                if (probe->state == Probe_Connect) {
+                        StringBuffer_T sb = StringBuffer_create(168);
+                        check_http_request(p, sb);
+                        probe->out = Str_dup(StringBuffer_toString(sb));
+                        probe->outLength = StringBuffer_length(sb);
+                        StringBuffer_free(&sb);
+                        probe->state = Probe_Send;
+                        _watch(probe, EPOLLOUT);
+                } else {
+                        probe->inSize = PROBE_RESPONSE_INITIAL;
+                        probe->in = CALLOC(sizeof(char), probe->inSize);
+                        probe->inLength = 0;
+                        probe->state = Probe_Receive;
+                        _watch(probe, EPOLLIN);
+                }
+        } else if (p->protocol->check == check_generic) {
+                if (probe->state != Probe_Connect && probe->step)
+                        probe->step = probe->step->next;
+                if (! probe->step) {
+                        _succeed(probe);
+                } else if (probe->step->send) {
+                        probe->out = Str_dup(probe->step->send);
+                        probe->outLength = Util_handle0Escapes(probe->out);
+                        probe->state = Probe_Send;
+                        _watch(probe, EPOLLOUT);
+                } else {
+                        FREE(probe->in);
+                        probe->inSize = Run.expectbuffer + 1;
+                        probe->in = CALLOC(sizeof(char), probe->inSize);
+                        probe->inLength = 0;
+                        probe->state = Probe_Receive;
+                        _watch(probe, EPOLLIN);
+                }
+        } else {
+                _succeed(probe);
+        }
+}
+
+
+/**
+ * Verify the data received so far. Returns true if the probe moved on
+ */
+static boolean_t _verify(Probe_T probe, boolean_t eof) {
+        volatile boolean_t done = false;
+        TRY
+        {
+                if (probe->port->protocol->check == check_http) {
+                        if (check_http_response(probe->port, probe->in, probe->inLength, eof)) {
+                                _succeed(probe);
+                                done = true;
+                        }
+                } else if (eof) {
+                        check_generic_expect(probe->step, probe->in, probe->inLength);
+                        DEBUG("GENERIC: successfully received: '%s'\n", probe->in);
+                        _next(probe);
+                        done = true;
+                }
+        }
+        ELSE
+        {
+                _fail(probe, "%s", Exception_frame.message);
+                done = true;
+        }
+        END_TRY;
+        return done;
+}
+
+
+static void _send(Probe_T probe) {
+        while (probe->outOffset < probe->outLength) {
+                ssize_t n = send(probe->socket, probe->out + probe->outOffset, probe->outLength - probe->outOffset, MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                                return;
+                        _fail(probe, "%s: error sending data -- %s", probe->port->protocol->name, STRERROR);
+                        return;
+                }
+                probe->outOffset += n;
+        }
+        if (probe->step && probe->port->protocol->check == check_generic)
+                DEBUG("GENERIC: successfully sent: '%s'\n", probe->step->send);
+        _next(probe);
+}
+
+
+static void _receive(Probe_T probe) {
+        while (true) {
+                if (probe->inLength >= probe->inSize - 1) {
+                        /* The http response buffer grows on demand, up to the max response size */
+                        if (probe->port->protocol->check != check_http || probe->inSize > PROBE_RESPONSE_MAX) {
+                                /* The buffer is full */
+                                _verify(probe, true);
+                                return;
+                        }
+                        probe->inSize = MIN(probe->inSize * 2, PROBE_RESPONSE_MAX + 1);
+                        RESIZE(probe->in, probe->inSize);
+                }
+                ssize_t n = recv(probe->socket, probe->in + probe->inLength, probe->inSize - 1 - probe->inLength, 0);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return;
+                        _fail(probe, "%s: error receiving data -- %s", probe->port->protocol->name, STRERROR);
+                        return;
+                } else if (n == 0) {
+                        _verify(probe, true);
+                        return;
+                }
+                probe->inLength += n;
+                probe->in[probe->inLength] = 0;
+                if (! probe->idle && probe->port->protocol->check == check_generic) {
+                        /* Like the blocking test, wait only a short time for the rest of the data after the first read */
+                        probe->idle = true;
+                        probe->deadline = Time_milli() + PROBE_IDLE;
+                }
+                if (probe->port->protocol->check == check_http && _verify(probe, false))
+                        return;
+        }
+}
+
+
+static void _handle(Probe_T probe) {
+        if (probe->finished)
+                return;
+        switch (probe->state) {
+                case Probe_Connect:
+                {
+                        int error = 0;
+                        socklen_t length = sizeof(error);
+                        if (getsockopt(probe->socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+                                error = errno;
+                        if (error) {
+                                snprintf(probe->error, sizeof(probe->error), "Connection failed -- %s", strerror(error));
+                                _close(probe);
+                                probe->address = probe->address->ai_next;
+                                _connect(probe);
+                        } else {
+                                _next(probe);
+                        }
+                        break;
+                }
+                case Probe_Send:
+                        _send(probe);
+                        break;
+                case Probe_Receive:
+                        _receive(probe);
+                        break;
+        }
+}
+
+
+static void _timeout(Probe_T probe) {
+        switch (probe->state) {
+                case Probe_Connect:
+                        snprintf(probe->error, sizeof(probe->error), "Connection timed out");
+                        _close(probe);
+                        probe->address = probe->address->ai_next;
+                        _connect(probe);
+                        break;
+                case Probe_Send:
+                        _fail(probe, "%s: error sending data -- timed out", probe->port->protocol->name);
+                        break;
+                case Probe_Receive:
+                        if (probe->inLength > 0)
+                                _verify(probe, true);
+                        else
+                                _fail(probe, "%s: error receiving data -- timed out", probe->port->protocol->name);
+                        break;
+        }
+}
+
+
+static void _run(Probe_T probes, int count) {
+        int next = 0;
+        struct epoll_event events[PROBE_EVENTS];
+        while (next < count || engine.active > 0) {
+                while (next < count && engine.active < PROBE_MAX) {
+                        engine.active++;
+                        _start(&probes[next++]);
+                }
+                long long now = Time_milli();
+                for (int i = 0; i < next; i++)
+                        if (! probes[i].finished && probes[i].deadline <= now)
+                                _timeout(&probes[i]);
+                long long deadline = -1;
+                for (int i = 0; i < next; i++)
+                        if (! probes[i].finished && (deadline < 0 || probes[i].deadline < deadline))
+                                deadline = probes[i].deadline;
+                if (deadline < 0)
+                        continue;
+                now = Time_milli();
+                int n = epoll_wait(engine.epoll, events, PROBE_EVENTS, deadline > now ? (int)(deadline - now) : 0);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        LogError("Connection test engine -- epoll_wait failed: %s\n", STRERROR);
+                        for (int i = 0; i < next; i++)
+                                if (! probes[i].finished)
+                                        _fail(&probes[i], "Connection test engine failure");
+                        break;
+                }
+                for (int i = 0; i < n; i++) {
+                        Probe_T probe = &probes[(uint32_t)events[i].data.u64];
+                        /* Drop the events of a closed connection, the probe may have been restarted in this batch */
+                        if ((unsigned)(events[i].data.u64 >> 32) == probe->connection)
+                                _handle(probe);
+                }
+        }
+}
+
+
+#endif
+
+
+/* ------------------------------------------------------------------ Public */
+
+
+void Probe_run() {
+#ifdef HAVE_SYS_EPOLL_H
+        int count = 0;
+        for (Service_T s = Schedule_ready(); s; s = s->schedule.next) {
+                for (Port_T p = s->portlist; p; p = p->next) {
+                        p->probe.done = false;
+                        FREE(p->probe.error);
+                        if (p->async && s->monitor)
+                                count++;
+                }
+        }
+        if (! count)
+                return;
+        if ((engine.epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+                LogError("Connection test engine not available, using blocking tests -- epoll_create1 failed: %s\n", STRERROR);
+                return;
+        }
+        Probe_T probes = CALLOC(count, sizeof(struct Probe_T));
+        /* The names are resolved before the event loop, the ports which cannot be resolved are failed at once */
+        int i = 0;
+        for (Service_T s = Schedule_ready(); s; s = s->schedule.next) {
+                /* The services skipped by the every statement or handled in a dependency chain are not tested */
+                if (! s->monitor || is_skipped(s))
+                        continue;
+                /* Like the blocking test, skip the ports of a process in its start timeout timeframe */
+                if (s->type == Service_Process && s->start && s->inf->priv.process.uptime <= s->start->timeout)
+                        continue;
+                for (Port_T p = s->portlist; p && i < count; p = p->next) {
+                        if (p->async) {
+                                probes[i].service = s;
+                                probes[i].port = p;
+                                probes[i].socket = -1;
+                                if (_resolve(&probes[i]))
+                                        i++;
+                        }
+                }
+        }
+        engine.active = 0;
+        engine.probes = probes;
+        _run(probes, i);
+        engine.probes = NULL;
+        FREE(probes);
+        close(engine.epoll);
+        engine.epoll = -1;
+#endif
+}
+
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+
+
+#ifndef MONIT_PROBE_H
+#define MONIT_PROBE_H
+
+
+/**
+ * Asynchronous connection tests.
+ *
+ * The ports with the "async" option are tested by a single threaded event
+ * loop before the services are checked: the connections to all due ports
+ * are opened concurrently with non-blocking sockets and each protocol is
+ * driven as a resumable state machine on one epoll instance. The results
+ * are stored in the port and reported by the regular connection test, so
+ * the events, retries and actions work the same way as with the blocking
+ * test. The engine supports the default, generic send/expect and http
+ * protocols over plain TCP.
+ *
+ *  @file
+ */
+
+
+/**
+ * Test the async ports of the services which are due in this cycle. If the
+ * engine is not available, the ports are left for the blocking test
+ */
+void Probe_run();
+
+
+#endif
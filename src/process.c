@@ -52,6 +52,26 @@
 #include <string.h>
 #endif
 
+#ifdef HAVE_CTYPE_H
+#include <ctype.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
 #include <stdio.h>
 
 #include "monit.h"
@@ -68,6 +88,579 @@
  */
 
 
+/* ----------------------------------------------------------------- Private */
+
+
+/**
+ * Open addressing pid -> index hash table. One table is kept for the actual
+ * process tree and one for the previous tree, so lookups done by the parent
+ * linking, CPU delta computation and service checks don't scan the tree.
+ */
+typedef struct ProcessIndex_T {
+        ProcessTree_T *tree;              /**< The process tree this index maps */
+        int            treesize;                /**< Number of indexed entries */
+        unsigned int   mask;                     /**< Table capacity minus one */
+        int           *slot;         /**< Tree index or -1 if the slot is empty */
+} ProcessIndex_T;
+
+
+static ProcessIndex_T ptreeindex;
+static ProcessIndex_T oldptreeindex;
+
+
+static inline unsigned int _hashPid(pid_t pid, unsigned int mask) {
+        return ((unsigned int)pid * 2654435761U) & mask;
+}
+
+
+static void _indexInsert(ProcessIndex_T *I, int index) {
+        pid_t pid = I->tree[index].pid;
+        for (unsigned int h = _hashPid(pid, I->mask); ; h = (h + 1) & I->mask) {
+                if (I->slot[h] == -1) {
+                        I->slot[h] = index;
+                        return;
+                }
+                if (I->tree[I->slot[h]].pid == pid)
+                        return; // Keep the first occurrence, as the linear scan did
+        }
+}
+
+
+static void _indexRebuild(ProcessIndex_T *I, ProcessTree_T *pt, int treesize, int capacity) {
+        unsigned int size = 16;
+        while (size < (unsigned int)capacity * 2)
+                size <<= 1;
+        if (! I->slot || I->mask + 1 != size) {
+                FREE(I->slot);
+                I->slot = ALLOC(size * sizeof(int));
+                I->mask = size - 1;
+        }
+        memset(I->slot, 0xff, size * sizeof(int));
+        I->tree = pt;
+        I->treesize = treesize;
+        for (int i = 0; i < treesize; i++)
+                _indexInsert(I, i);
+}
+
+
+/**
+ * Add the entry which was appended to the (possibly reallocated) tree
+ */
+static void _indexAppend(ProcessIndex_T *I, ProcessTree_T *pt, int index) {
+        I->tree = pt;
+        I->treesize = index + 1;
+        if ((unsigned int)I->treesize * 2 > I->mask + 1)
+                _indexRebuild(I, pt, I->treesize, I->treesize * 2);
+        else
+                _indexInsert(I, index);
+}
+
+
+/**
+ * Detach the index from a deleted tree, the table is kept for reuse
+ */
+static void _indexDetach(ProcessIndex_T *I) {
+        I->tree = NULL;
+        I->treesize = 0;
+}
+
+
+static int _indexFind(ProcessIndex_T *I, pid_t pid, int treesize) {
+        for (unsigned int h = _hashPid(pid, I->mask); I->slot[h] != -1; h = (h + 1) & I->mask) {
+                int index = I->slot[h];
+                if (I->tree[index].pid == pid)
+                        return index < treesize ? index : -1;
+        }
+        return -1;
+}
+
+
+/**
+ * Process tree storage. The actual and the previous tree live in two arenas
+ * which are swapped on each cycle, so in steady state the table, command
+ * lines and children lists reuse the memory of the tree from two cycles ago
+ * instead of being allocated and freed again. The command lines are bump
+ * allocated, the children of all entries are stored in one flat array.
+ */
+#define ARENA_CHUNK 65536
+
+
+typedef struct ProcessChunk_T {
+        struct ProcessChunk_T *next;
+        size_t                 size;                           /**< Data size */
+        size_t                 used;                      /**< Allocated bytes */
+        char                   data[];
+} *ProcessChunk_T;
+
+
+typedef struct ProcessArena_T {
+        ProcessTree_T  *table;                         /**< The tree entries */
+        int             capacity;                /**< Table capacity in entries */
+        int            *children;           /**< Children lists of all entries */
+        int             children_capacity;
+        ProcessChunk_T  strings;                  /**< Command lines chunk list */
+        ProcessChunk_T  current;                  /**< The chunk in allocation */
+} ProcessArena_T;
+
+
+static ProcessArena_T ptreearena;
+static ProcessArena_T oldptreearena;
+static Mutex_T arenamutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static ProcessChunk_T _chunkNew(size_t size) {
+        ProcessChunk_T chunk = ALLOC(sizeof(struct ProcessChunk_T) + size);
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+        return chunk;
+}
+
+
+/**
+ * Release the arena content, the memory is kept for the next tree. If the
+ * strings overflowed to more chunks, they are merged to one chunk of the
+ * total size, so the next tree of similar size needs no allocation.
+ */
+static void _arenaReset(ProcessArena_T *A) {
+        if (A->strings && A->strings->next) {
+                size_t size = 0;
+                for (ProcessChunk_T next, chunk = A->strings; chunk; chunk = next) {
+                        next = chunk->next;
+                        size += chunk->size;
+                        FREE(chunk);
+                }
+                A->strings = _chunkNew(size);
+        } else if (A->strings) {
+                A->strings->used = 0;
+        }
+        A->current = A->strings;
+}
+
+
+static ProcessTree_T *_arenaResize(ProcessArena_T *A, int treesize) {
+        if (treesize > A->capacity) {
+                A->capacity = treesize * 2;
+                RESIZE(A->table, A->capacity * sizeof(ProcessTree_T));
+        }
+        return A->table;
+}
+
+
+/**
+ * Store the children lists in the arena flat array (the entries which have
+ * the same pid as their parent can't be connected and are disabled)
+ */
+static void _arenaLinkChildren(ProcessArena_T *A, ProcessTree_T *pt, int treesize) {
+        int count = 0;
+        for (int i = 0; i < treesize; i++) {
+                pt[i].children = NULL;
+                pt[i].children_num = 0;
+        }
+        for (int i = 0; i < treesize; i++) {
+                int parent = pt[i].parent;
+                if (! pt[i].pid || parent < 0 || parent == i)
+                        continue;
+                if (pt[parent].pid == pt[i].pid) {
+                        DEBUG("System statistic error -- cannot connect process id %d to its parent %d\n", pt[i].pid, pt[i].ppid);
+                        pt[i].pid = 0;
+                        continue;
+                }
+                pt[parent].children_num++;
+                count++;
+        }
+        if (count > A->children_capacity) {
+                A->children_capacity = count * 2;
+                RESIZE(A->children, A->children_capacity * sizeof(int));
+        }
+        for (int i = 0, offset = 0; i < treesize; i++) {
+                if (pt[i].children_num) {
+                        pt[i].children = A->children + offset;
+                        offset += pt[i].children_num;
+                        pt[i].children_num = 0;
+                }
+        }
+        for (int i = 0; i < treesize; i++) {
+                int parent = pt[i].parent;
+                if (pt[i].pid && parent >= 0 && parent != i)
+                        pt[parent].children[pt[parent].children_num++] = i;
+        }
+}
+
+
+/**
+ * Process match engine. The "matching" patterns of all process services are
+ * evaluated in one pass over the process tree command lines: each pattern is
+ * reduced to the longest literal which every match must contain, the literals
+ * are hashed by their first MATCH_GRAM bytes and the command lines are scanned
+ * once for them. The regular expression is only executed for the candidates
+ * whose literal was found, patterns without usable literal are executed for
+ * each process as before. The first matching pid of each service is cached
+ * until the process tree is reloaded.
+ */
+#define MATCH_GRAM    3
+#define MATCH_BUCKETS 4096
+
+
+typedef struct ProcessPattern_T {
+        Service_T   service;              /**< The owner service, NULL for procmatch */
+        Match_T     match;                                   /**< The match rule */
+        char       *literal;      /**< Literal which each match contains or NULL */
+        int         length;                             /**< The literal length */
+        int         next;                  /**< Next pattern in the same bucket */
+        int         seen;     /**< Last tree entry where the literal was found */
+        pid_t       pid;                  /**< The first matching pid or 0 */
+        int         matches;        /**< Number of matching processes (procmatch) */
+} *ProcessPattern_T;
+
+
+typedef struct ProcessMatch_T {
+        ProcessTree_T   *tree;                     /**< The matched process tree */
+        int              treesize;
+        unsigned long    generation;        /**< The process tree generation */
+        int              count;                          /**< Number of patterns */
+        struct ProcessPattern_T *patterns;       /**< Patterns sorted by service */
+        int             *candidate;      /**< Candidate patterns of one process */
+        int              bucket[MATCH_BUCKETS];  /**< First pattern or -1 */
+} ProcessMatch_T;
+
+
+static ProcessMatch_T processmatch;
+static unsigned long ptreegeneration = 0;
+static Mutex_T matchmutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static inline unsigned int _hashGram(const unsigned char *s) {
+        return ((s[0] << 7) ^ (s[1] << 3) ^ s[2]) & (MATCH_BUCKETS - 1);
+}
+
+
+static const char *_skipBracket(const char *p) {
+        // The ']' may be the first member of the bracket expression
+        if (*++p == '^')
+                p++;
+        if (*p == ']')
+                p++;
+        while (*p && *p != ']') {
+                if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+                        char delimiter = p[1];
+                        for (p += 2; *p && ! (*p == delimiter && p[1] == ']'); p++)
+                                ;
+                        if (*p)
+                                p++;
+                }
+                if (*p)
+                        p++;
+        }
+        return *p ? p : p - 1;
+}
+
+
+/**
+ * Extract the longest literal which any string matching the given POSIX
+ * extended regular expression must contain. The analysis is conservative:
+ * alternations give up, groups, bracket expressions and anchors terminate
+ * the literal run and a quantifier allowing zero occurrences drops the
+ * preceding character.
+ * @return The literal (the caller must free it) or NULL
+ */
+static char *_extractLiteral(const char *pattern) {
+#ifdef HAVE_REGEX_H
+        int best = 0, length = 0, depth = 0;
+        char *literal = CALLOC(1, strlen(pattern) + 1);
+        char *run = CALLOC(1, strlen(pattern) + 1);
+        for (const char *p = pattern; *p; p++) {
+                boolean_t end = true;
+                if (*p == '|') {
+                        if (depth)
+                                continue; // Inside a group which is skipped anyway
+                        FREE(run);
+                        FREE(literal);
+                        return NULL;
+                } else if (*p == '[') {
+                        p = _skipBracket(p);
+                } else if (*p == '\\' && p[1]) {
+                        if (! depth && ! isalnum((unsigned char)p[1])) {
+                                run[length++] = p[1];
+                                end = false;
+                        }
+                        p++;
+                } else if (*p == '(') {
+                        depth++;
+                } else if (*p == ')') {
+                        if (depth)
+                                depth--;
+                } else if (depth) {
+                        continue;
+                } else if (*p == '*' || *p == '?' || *p == '{') {
+                        // The preceding character is optional, drop it from the run
+                        if (length)
+                                length--;
+                        if (*p == '{' && ! (p = strchr(p, '}'))) {
+                                FREE(run);
+                                FREE(literal);
+                                return NULL;
+                        }
+                } else if (! strchr("+.^$", *p)) {
+                        run[length++] = *p;
+                        end = false;
+                }
+                if (! end && (p[1] == '*' || p[1] == '?' || p[1] == '{'))
+                        continue; // Let the quantifier drop the character first
+                if (length > best) {
+                        best = length;
+                        memcpy(literal, run, length);
+                        literal[length] = 0;
+                }
+                if (end)
+                        length = 0;
+        }
+        FREE(run);
+        if (! best)
+                FREE(literal);
+        return literal;
+#else
+        return Str_dup(pattern);
+#endif
+}
+
+
+static void _matchFree(ProcessMatch_T *M) {
+        for (int i = 0; i < M->count; i++)
+                FREE(M->patterns[i].literal);
+        FREE(M->patterns);
+        FREE(M->candidate);
+        M->count = 0;
+        M->tree = NULL;
+        M->treesize = 0;
+}
+
+
+static void _matchAdd(ProcessMatch_T *M, Service_T s, Match_T m) {
+        ProcessPattern_T p = &M->patterns[M->count++];
+        p->service = s;
+        p->match = m;
+        p->literal = _extractLiteral(m->match_string);
+        p->length = p->literal ? strlen(p->literal) : 0;
+        p->seen = -1;
+        p->pid = 0;
+}
+
+
+/**
+ * Hash the patterns by the first bytes of their literal. Patterns with literal
+ * shorter than MATCH_GRAM can't be prefiltered and are linked to a separate list
+ * @return The head of the list of patterns which must be tested for each process
+ */
+static int _matchCompile(ProcessMatch_T *M) {
+        int unfiltered = -1;
+        memset(M->bucket, 0xff, sizeof(M->bucket));
+        for (int i = M->count - 1; i >= 0; i--) {
+                ProcessPattern_T p = &M->patterns[i];
+                if (p->length >= MATCH_GRAM) {
+                        unsigned int h = _hashGram((unsigned char *)p->literal);
+                        p->next = M->bucket[h];
+                        M->bucket[h] = i;
+                } else {
+                        p->next = unfiltered;
+                        unfiltered = i;
+                }
+        }
+        return unfiltered;
+}
+
+
+static inline boolean_t _matchTest(ProcessPattern_T p, const char *cmdline) {
+#ifdef HAVE_REGEX_H
+        return regexec(p->match->regex_comp, cmdline, 0, NULL, 0) ? false : true;
+#else
+        return strstr(cmdline, p->match->match_string) ? true : false;
+#endif
+}
+
+
+/**
+ * Evaluate all patterns in one pass over the process tree. If the callback is
+ * NULL, each pattern is resolved to the first matching process (the checks are
+ * FIRST-MATCH based) and the pass stops as soon as all patterns are resolved,
+ * otherwise the callback is called for each matching process.
+ */
+static void _matchTree(ProcessMatch_T *M, ProcessTree_T *pt, int treesize, void (*callback)(ProcessPattern_T p, ProcessTree_T *entry)) {
+        int pending = M->count;
+        int unfiltered = _matchCompile(M);
+        int *candidate = M->candidate ? M->candidate : (M->candidate = CALLOC(M->count ? M->count : 1, sizeof(int)));
+        for (int i = 0; i < M->count; i++) {
+                M->patterns[i].seen = -1;
+                M->patterns[i].pid = 0;
+                M->patterns[i].matches = 0;
+        }
+        for (int i = 0; i < treesize && pending; i++) {
+                if (! pt[i].cmdline)
+                        continue;
+                int candidates = 0;
+                for (int j = unfiltered; j != -1; j = M->patterns[j].next)
+                        candidate[candidates++] = j;
+                for (const unsigned char *s = (unsigned char *)pt[i].cmdline; s[0] && s[1] && s[2]; s++) {
+                        for (int j = M->bucket[_hashGram(s)]; j != -1; j = M->patterns[j].next) {
+                                ProcessPattern_T p = &M->patterns[j];
+                                if (p->seen != i && (callback || ! p->pid) && strncmp((const char *)s, p->literal, p->length) == 0) {
+                                        p->seen = i;
+                                        candidate[candidates++] = j;
+                                }
+                        }
+                }
+                for (int k = 0; k < candidates; k++) {
+                        ProcessPattern_T p = &M->patterns[candidate[k]];
+                        if ((callback || ! p->pid) && _matchTest(p, pt[i].cmdline)) {
+                                if (callback) {
+                                        callback(p, &pt[i]);
+                                } else {
+                                        p->pid = pt[i].pid;
+                                        pending--;
+                                }
+                        }
+                }
+        }
+}
+
+
+static int _compareService(const void *a, const void *b) {
+        const struct ProcessPattern_T *x = a, *y = b;
+        return x->service < y->service ? -1 : x->service > y->service ? 1 : 0;
+}
+
+
+static ProcessPattern_T _matchFind(ProcessMatch_T *M, Service_T s) {
+        struct ProcessPattern_T key = {.service = s};
+        ProcessPattern_T p = bsearch(&key, M->patterns, M->count, sizeof(struct ProcessPattern_T), _compareService);
+        return p && p->match == s->matchlist ? p : NULL;
+}
+
+
+/**
+ * Match all process services in the given tree. The patterns are kept as long
+ * as the service list has the same match rules, so steady state cycles only
+ * run the matching pass.
+ */
+static void _matchBuild(ProcessMatch_T *M, ProcessTree_T *pt, int treesize) {
+        int count = 0;
+        boolean_t current = M->patterns != NULL;
+        for (Service_T s = servicelist; s; s = s->next) {
+                if (s->type == Service_Process && s->matchlist) {
+                        count++;
+                        if (current && ! _matchFind(M, s))
+                                current = false;
+                }
+        }
+        if (! current || count != M->count) {
+                _matchFree(M);
+                M->patterns = CALLOC(count ? count : 1, sizeof(struct ProcessPattern_T));
+                for (Service_T s = servicelist; s; s = s->next)
+                        if (s->type == Service_Process && s->matchlist)
+                                _matchAdd(M, s, s->matchlist);
+                qsort(M->patterns, M->count, sizeof(struct ProcessPattern_T), _compareService);
+        }
+        _matchTree(M, pt, treesize, NULL);
+        M->tree = pt;
+        M->treesize = treesize;
+        M->generation = ptreegeneration;
+}
+
+
+static void _printMatch(ProcessPattern_T p, ProcessTree_T *entry) {
+        if (! strstr(entry->cmdline, "procmatch")) {
+                printf("\t%s\n", entry->cmdline);
+                p->matches++;
+        }
+}
+
+
+/* ------------------------------------------------------- cgroup accounting */
+
+
+static int _readCgroupFile(const char *cgroup, const char *name, char *buf, int size) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", cgroup, name);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        int n = (int)read(fd, buf, size - 1);
+        close(fd);
+        if (n >= 0)
+                buf[n] = 0;
+        return n;
+}
+
+
+static int _countCgroupProcesses(const char *cgroup) {
+        char path[PATH_MAX];
+        char buf[4096];
+        snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+                return -1;
+        int n, count = 0;
+        while ((n = (int)read(fd, buf, sizeof(buf))) > 0)
+                for (int i = 0; i < n; i++)
+                        if (buf[i] == '\n')
+                                count++;
+        close(fd);
+        return n < 0 ? -1 : count;
+}
+
+
+/**
+ * Set the total usage of the process service from its cgroup v2 accounting
+ * instead of the process subtree sums: the CPU usage from the cpu.stat
+ * usage_usec delta, the memory from memory.current and the children from
+ * the number of processes in the cgroup (except the main process)
+ * @return true if succeeded, otherwise false (the tree values are kept)
+ */
+static boolean_t _updateCgroupUsage(Service_T s) {
+        char buf[1024];
+        if (_readCgroupFile(s->cgroup, "cpu.stat", buf, sizeof(buf)) <= 0) {
+                DEBUG("'%s' cannot read %s/cpu.stat -- %s\n", s->name, s->cgroup, STRERROR);
+                return false;
+        }
+        char *usage = NULL;
+        if (strncmp(buf, "usage_usec ", 11) == 0)
+                usage = buf + 11;
+        else if ((usage = strstr(buf, "\nusage_usec ")))
+                usage += 12;
+        if (! usage) {
+                DEBUG("'%s' cannot find usage_usec in %s/cpu.stat\n", s->name, s->cgroup);
+                return false;
+        }
+        unsigned long long usec = strtoull(usage, NULL, 10);
+        long long now = Time_micro();
+
+        unsigned long long bytes;
+        if (_readCgroupFile(s->cgroup, "memory.current", buf, sizeof(buf)) <= 0 || sscanf(buf, "%llu", &bytes) != 1) {
+                DEBUG("'%s' cannot read %s/memory.current -- %s\n", s->name, s->cgroup, STRERROR);
+                return false;
+        }
+
+        int processes = _countCgroupProcesses(s->cgroup);
+        if (processes < 0) {
+                DEBUG("'%s' cannot read %s/cgroup.procs -- %s\n", s->name, s->cgroup, STRERROR);
+                return false;
+        }
+
+        if (s->inf->priv.process.cgroup_time > 0 && now > s->inf->priv.process.cgroup_time && usec >= s->inf->priv.process.cgroup_usage) {
+                double percent = 1000. * (usec - s->inf->priv.process.cgroup_usage) / (now - s->inf->priv.process.cgroup_time) / systeminfo.cpus;
+                s->inf->priv.process.total_cpu_percent = percent > 1000. ? 1000 : (short)percent;
+        } else {
+                s->inf->priv.process.total_cpu_percent = 0;
+        }
+        s->inf->priv.process.cgroup_usage = usec;
+        s->inf->priv.process.cgroup_time = now;
+        s->inf->priv.process.total_mem_kbyte = (long)(bytes / 1024);
+        s->inf->priv.process.total_mem_percent = systeminfo.mem_kbyte_max ? (short)((double)s->inf->priv.process.total_mem_kbyte * 1000.0 / systeminfo.mem_kbyte_max) : 0;
+        s->inf->priv.process.children = processes > 0 ? processes - 1 : 0;
+        return true;
+}
+
+
 /* ------------------------------------------------------------------ Public */
 
 
@@ -128,6 +721,8 @@ boolean_t update_process_data(Service_T s, ProcessTree_T *pt, int treesize, pid_
                         s->inf->priv.process.total_mem_percent = (int)((double)pt[leaf].mem_kbyte_sum * 1000.0 / systeminfo.mem_kbyte_max);
                         s->inf->priv.process.mem_percent       = (int)((double)pt[leaf].mem_kbyte * 1000.0 / systeminfo.mem_kbyte_max);
                 }
+                if (s->cgroup)
+                        _updateCgroupUsage(s);
         } else {
                 s->inf->priv.process.ppid              = -1;
                 s->inf->priv.process.uid               = -1;
@@ -193,16 +788,13 @@ error3:
 }
 
 
-/**
- * Initialize the process tree
- * @return treesize >= 0 if succeeded otherwise < 0
- */
-int initprocesstree(ProcessTree_T **pt_r, int *size_r, ProcessTree_T **oldpt_r, int *oldsize_r) {
+static int _initprocesstree(ProcessTree_T **pt_r, int *size_r, ProcessTree_T **oldpt_r, int *oldsize_r) {
         ASSERT(pt_r);
         ASSERT(size_r);
         ASSERT(oldpt_r);
         ASSERT(oldsize_r);
 
+        ptreegeneration++;
         if (*pt_r) {
                 if (*oldpt_r)
                         delprocesstree(oldpt_r, oldsize_r);
@@ -210,6 +802,13 @@ int initprocesstree(ProcessTree_T **pt_r, int *size_r, ProcessTree_T **oldpt_r,
                 *oldsize_r = *size_r;
                 *pt_r = NULL;
                 *size_r = 0;
+                /* Keep the index and storage of the actual tree for the previous tree and reuse the old ones for the new tree */
+                ProcessIndex_T swap = oldptreeindex;
+                oldptreeindex = ptreeindex;
+                ptreeindex = swap;
+                ProcessArena_T arena = oldptreearena;
+                oldptreearena = ptreearena;
+                ptreearena = arena;
         }
 
         if ((*size_r = initprocesstree_sysdep(pt_r)) <= 0 || ! *pt_r) {
@@ -226,6 +825,7 @@ int initprocesstree(ProcessTree_T **pt_r, int *size_r, ProcessTree_T **oldpt_r,
         int oldentry;
         ProcessTree_T *pt = *pt_r;
         ProcessTree_T *oldpt = *oldpt_r;
+        _indexRebuild(&ptreeindex, pt, *size_r, *size_r);
         for (int i = 0; i < (volatile int)*size_r; i ++) {
                 if (oldpt && ((oldentry = findprocess(pt[i].pid, oldpt, *oldsize_r)) != -1)) {
                         pt[i].cputime_prev = oldpt[oldentry].cputime;
@@ -248,24 +848,19 @@ int initprocesstree(ProcessTree_T **pt_r, int *size_r, ProcessTree_T **oldpt_r,
                         continue;
                 }
 
-                if ((pt[i].parent = findprocess(pt[i].ppid, pt, *size_r)) == -1) {
+                if ((pt[i].parent = _indexFind(&ptreeindex, pt[i].ppid, *size_r)) == -1) {
                         /* Parent process wasn't found - on Linux this is normal: main process with PID 0 is not listed, similarly in FreeBSD jail.
                          * We create virtual process entry for missing parent so we can have full tree-like structure with root. */
                         int j = (*size_r)++;
 
-                        pt = RESIZE(*pt_r, *size_r * sizeof(ProcessTree_T));
+                        pt = *pt_r = _arenaResize(&ptreearena, *size_r);
                         memset(&pt[j], 0, sizeof(ProcessTree_T));
                         pt[j].ppid = pt[j].pid  = pt[i].ppid;
                         pt[i].parent = j;
-                }
-
-                if (! connectchild(pt, pt[i].parent, i)) {
-                        /* connection to parent process has failed, this is usually caused in the part above */
-                        DEBUG("System statistic error -- cannot connect process id %d to its parent %d\n", pt[i].pid, pt[i].ppid);
-                        pt[i].pid = 0;
-                        continue;
+                        _indexAppend(&ptreeindex, pt, j);
                 }
         }
+        _arenaLinkChildren(&ptreearena, pt, *size_r);
 
         /* The main process in Solaris zones and FreeBSD host doesn't have pid 1, so try to find process which is parent of itself */
         int root = -1;
@@ -285,14 +880,29 @@ int initprocesstree(ProcessTree_T **pt_r, int *size_r, ProcessTree_T **oldpt_r,
                 return -1;
         }
 
-        fillprocesstree(pt, root);
+        fillprocesstree(pt, *size_r, root);
 
         return *size_r;
 }
 
 
 /**
- * Search a leaf in the processtree
+ * Initialize the process tree. The validation workers may read the trees or
+ * refresh them for a service action in parallel, the trees are replaced under
+ * the ptreelock write lock
+ * @return treesize >= 0 if succeeded otherwise < 0
+ */
+int initprocesstree(ProcessTree_T **pt_r, int *size_r, ProcessTree_T **oldpt_r, int *oldsize_r) {
+        pthread_rwlock_wrlock(&ptreelock);
+        int rv = _initprocesstree(pt_r, size_r, oldpt_r, oldsize_r);
+        pthread_rwlock_unlock(&ptreelock);
+        return rv;
+}
+
+
+/**
+ * Search a leaf in the processtree. The actual and previous trees are hash
+ * indexed, other trees are scanned linearly.
  * @param pid  pid of the process
  * @param pt  processtree
  * @param treesize  size of the processtree
@@ -304,6 +914,11 @@ int findprocess(int pid, ProcessTree_T *pt, int treesize) {
         if (treesize <= 0)
                 return -1;
 
+        if (pt == ptreeindex.tree && treesize <= ptreeindex.treesize)
+                return _indexFind(&ptreeindex, pid, treesize);
+        if (pt == oldptreeindex.tree && treesize <= oldptreeindex.treesize)
+                return _indexFind(&oldptreeindex, pid, treesize);
+
         for (int i = 0; i < treesize; i++)
                 if (pid == pt[i].pid)
                         return i;
@@ -322,61 +937,204 @@ time_t getProcessUptime(pid_t pid, ProcessTree_T *pt, int treesize) {
 }
 
 
+/**
+ * Find the first process whose command line matches the service pattern.
+ * The patterns of all process services are evaluated together on the first
+ * lookup in the given process tree and the results are cached until the
+ * tree is reloaded by initprocesstree().
+ * @param s A process service with the match rule
+ * @param pt The process tree
+ * @param treesize The process tree size
+ * @return The pid of the first matching process or 0 if not found
+ */
+pid_t matchprocess(Service_T s, ProcessTree_T *pt, int treesize) {
+        ASSERT(s);
+        ASSERT(s->matchlist);
+        pid_t pid = 0;
+        /* The services may be validated in parallel, the index is shared */
+        LOCK(matchmutex)
+        {
+                if (processmatch.tree != pt || processmatch.treesize != treesize || processmatch.generation != ptreegeneration)
+                        _matchBuild(&processmatch, pt, treesize);
+                ProcessPattern_T p = _matchFind(&processmatch, s);
+                if (p) {
+                        pid = p->pid;
+                } else {
+                        // Service which is not in the indexed service list, match it alone
+                        ProcessMatch_T M;
+                        memset(&M, 0, sizeof(M));
+                        M.patterns = CALLOC(1, sizeof(struct ProcessPattern_T));
+                        _matchAdd(&M, s, s->matchlist);
+                        _matchTree(&M, pt, treesize, NULL);
+                        pid = M.patterns[0].pid;
+                        _matchFree(&M);
+                }
+        }
+        END_LOCK;
+        return pid;
+}
+
+
 /**
  * Delete the process tree
  */
 void delprocesstree(ProcessTree_T **reference, int *size) {
         ProcessTree_T *pt = *reference;
         if (pt) {
-                for (int i = 0; i < *size; i++) {
-                        FREE(pt[i].cmdline);
-                        FREE(pt[i].children);
-                }
-                FREE(pt);
+                if (pt == ptreeindex.tree)
+                        _indexDetach(&ptreeindex);
+                else if (pt == oldptreeindex.tree)
+                        _indexDetach(&oldptreeindex);
+                if (pt == ptreearena.table) {
+                        /* The actual tree is deleted on reload, the match rules may change */
+                        _arenaReset(&ptreearena);
+                        _matchFree(&processmatch);
+                } else if (pt == oldptreearena.table)
+                        _arenaReset(&oldptreearena);
                 *reference = NULL;
                 *size = 0;
         }
 }
 
 
+/**
+ * Allocate the table for a new process tree in the actual tree storage. The
+ * storage is reset, so the sysdep code must call it first for each new tree.
+ * @param treesize Number of entries
+ * @return The zeroed table
+ */
+ProcessTree_T *allocprocesstree(int treesize) {
+        _arenaReset(&ptreearena);
+        ProcessTree_T *pt = _arenaResize(&ptreearena, MAX(treesize, 1));
+        memset(pt, 0, MAX(treesize, 1) * sizeof(ProcessTree_T));
+        return pt;
+}
+
+
+/**
+ * Copy the string to the actual tree storage. It can be called from more
+ * threads collecting the process data.
+ * @param s The string
+ * @return The copy, which is valid until the process tree is deleted
+ */
+char *allocprocessstring(const char *s) {
+        char *copy = NULL;
+        if (s) {
+                size_t length = strlen(s) + 1;
+                LOCK(arenamutex)
+                {
+                        ProcessArena_T *A = &ptreearena;
+                        if (! A->current || A->current->used + length > A->current->size) {
+                                ProcessChunk_T chunk = _chunkNew(MAX(length, A->current ? A->current->size * 2 : ARENA_CHUNK));
+                                if (A->current)
+                                        A->current->next = chunk;
+                                else
+                                        A->strings = chunk;
+                                A->current = chunk;
+                        }
+                        copy = A->current->data + A->current->used;
+                        A->current->used += length;
+                }
+                END_LOCK;
+                memcpy(copy, s, length);
+        }
+        return copy;
+}
+
+
+/**
+ * Open a process file descriptor which refers to the process, so its exit
+ * can be waited for and the pid can't be confused with a new process after
+ * the pid is reused. Available on Linux 5.3 and newer.
+ * @param pid The process id
+ * @return The descriptor or -1 if not supported or the process doesn't exist
+ */
+int openprocessfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+        static boolean_t supported = true;
+        if (supported && pid > 0) {
+                int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+                if (fd >= 0)
+                        return fd;
+                if (errno == ENOSYS) {
+                        DEBUG("Process engine -- pidfd is not supported, using the process id polling\n");
+                        supported = false;
+                }
+        }
+#endif
+        return -1;
+}
+
+
+/*
+ * Test if the exited process referred by the descriptor was reaped. The
+ * process exists as a zombie until then and can still be signalled.
+ */
+static boolean_t _isProcessReaped(int fd) {
+#ifdef SYS_pidfd_send_signal
+        return syscall(SYS_pidfd_send_signal, fd, 0, NULL, 0) != 0 && errno == ESRCH;
+#else
+        return true;
+#endif
+}
+
+
+/**
+ * Wait for the exit of the process referred by the process file descriptor.
+ * The descriptor becomes readable when the process exits, but as with the
+ * process id test, a zombie process is gone only after it was reaped.
+ * @param fd The descriptor returned by openprocessfd()
+ * @param timeout The maximum time to wait in microseconds, 0 to test only
+ * @return true if the process exited and was reaped, otherwise false
+ */
+boolean_t waitprocessfd(int fd, long timeout) {
+        ASSERT(fd >= 0);
+        long long deadline = Time_micro() + timeout;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, (int)(timeout / 1000)) <= 0 || ! (pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+                return false;
+        while (! _isProcessReaped(fd)) {
+                long long left = deadline - Time_micro();
+                if (left <= 0)
+                        return false;
+                Time_usleep(MIN(left, 100000));
+        }
+        return true;
+}
+
+
 void process_testmatch(char *pattern) {
+        struct mymatch match;
+        memset(&match, 0, sizeof(match));
+        match.match_string = pattern;
 #ifdef HAVE_REGEX_H
-        regex_t *regex_comp;
         int reg_return;
 
-        NEW(regex_comp);
-        if ((reg_return = regcomp(regex_comp, pattern, REG_NOSUB|REG_EXTENDED))) {
+        NEW(match.regex_comp);
+        if ((reg_return = regcomp(match.regex_comp, pattern, REG_NOSUB|REG_EXTENDED))) {
                 char errbuf[STRLEN];
-                regerror(reg_return, regex_comp, errbuf, STRLEN);
-                regfree(regex_comp);
-                FREE(regex_comp);
+                regerror(reg_return, match.regex_comp, errbuf, STRLEN);
+                regfree(match.regex_comp);
+                FREE(match.regex_comp);
                 printf("Regex %s parsing error: %s\n", pattern, errbuf);
                 exit(1);
         }
 #endif
+        Run.process_fields |= ProcessField_Cmdline;
         initprocesstree(&ptree, &ptreesize, &oldptree, &oldptreesize);
         if (Run.flags & Run_ProcessEngineEnabled) {
-                int count = 0;
+                ProcessMatch_T M;
+                memset(&M, 0, sizeof(M));
+                M.patterns = CALLOC(1, sizeof(struct ProcessPattern_T));
+                _matchAdd(&M, NULL, &match);
                 printf("List of processes matching pattern \"%s\":\n", pattern);
                 printf("------------------------------------------\n");
-                for (int i = 0; i < ptreesize; i++) {
-                        boolean_t match = false;
-                        if (ptree[i].cmdline && ! strstr(ptree[i].cmdline, "procmatch")) {
-#ifdef HAVE_REGEX_H
-                                match = regexec(regex_comp, ptree[i].cmdline, 0, NULL, 0) ? false : true;
-#else
-                                match = strstr(ptree[i].cmdline, pattern) ? true : false;
-#endif
-                                if (match) {
-                                        printf("\t%s\n", ptree[i].cmdline);
-                                        count++;
-                                }
-                        }
-                }
+                _matchTree(&M, ptree, ptreesize, _printMatch);
                 printf("------------------------------------------\n");
-                printf("Total matches: %d\n", count);
-                if (count > 1)
+                printf("Total matches: %d\n", M.patterns[0].matches);
+                if (M.patterns[0].matches > 1)
                         printf("WARNING: multiple processes matched the pattern. The check is FIRST-MATCH based, please refine the pattern\n");
+                _matchFree(&M);
         }
 }
 
@@ -35,10 +35,13 @@ boolean_t update_process_data(Service_T s, ProcessTree_T *, int treesize, pid_t
 boolean_t init_process_info(void);
 boolean_t update_system_load();
 int  findprocess(int, ProcessTree_T *, int);
+pid_t matchprocess(Service_T s, ProcessTree_T *, int treesize);
 time_t getProcessUptime(pid_t pid, ProcessTree_T *pt, int treesize);
 int  initprocesstree(ProcessTree_T **, int *, ProcessTree_T **, int *);
 void delprocesstree(ProcessTree_T **, int *);
 void process_testmatch(char *);
+int  openprocessfd(pid_t pid);
+boolean_t waitprocessfd(int fd, long timeout);
 
 #endif
 
@@ -130,53 +130,87 @@ double get_float_time(void) {
 
 
 /**
- * Connects child and parent in a process tree
- * @param pt process tree
- * @param parent index
- * @param child index
- * @return true if succeeded otherwise false.
+ * Columns of the hot fields used by the aggregation, in breadth-first order
+ * of the tree. The buffers are kept for the next cycle.
  */
-boolean_t connectchild(ProcessTree_T *pt, int parent, int child) {
-
-        ASSERT(pt);
-
-        if (pt[parent].pid == pt[child].pid)
-                return false;
-        RESIZE(pt[parent].children, sizeof(ProcessTree_T *) * (pt[parent].children_num + 1));
-        pt[parent].children[pt[parent].children_num] = child;
-        pt[parent].children_num++;
-
-        return true;
+static struct {
+        int            capacity;
+        int           *order;                 /**< Tree index of each position */
+        int           *up;                      /**< Position of the parent */
+        int           *children_sum;
+        int           *cpu_percent_sum;
+        unsigned long *mem_kbyte_sum;
+} aggregate;
+
+
+static void _reserveAggregate(int treesize) {
+        if (treesize > aggregate.capacity) {
+                aggregate.capacity = treesize * 2;
+                RESIZE(aggregate.order, aggregate.capacity * sizeof(int));
+                RESIZE(aggregate.up, aggregate.capacity * sizeof(int));
+                RESIZE(aggregate.children_sum, aggregate.capacity * sizeof(int));
+                RESIZE(aggregate.cpu_percent_sum, aggregate.capacity * sizeof(int));
+                RESIZE(aggregate.mem_kbyte_sum, aggregate.capacity * sizeof(unsigned long));
+        }
 }
 
 
 /**
- * Fill data in the process tree by recusively walking through it
+ * Fill the children count, memory and CPU usage sums in the process tree.
+ * The tree is walked iteratively in breadth-first order, the sums are then
+ * accumulated to the parents in reverse order, so each node is complete
+ * before it is added to its parent. The children of each node are queued
+ * in reverse, so they are added to the parent in the children list order.
  * @param pt process tree
- * @param i process index
+ * @param treesize process tree size
+ * @param root index of the root process
  */
-void fillprocesstree(ProcessTree_T *pt, int index) {
-        ProcessTree_T *parent_pt;
-
+void fillprocesstree(ProcessTree_T *pt, int treesize, int root) {
         ASSERT(pt);
 
-        if (pt[index].visited == true)
+        if (root < 0 || root >= treesize || pt[root].visited)
                 return;
 
-        pt[index].visited         = true;
-        pt[index].children_sum    = pt[index].children_num;
-        pt[index].mem_kbyte_sum   = pt[index].mem_kbyte;
-        pt[index].cpu_percent_sum = pt[index].cpu_percent;
-
-        for (int i = 0; i < pt[index].children_num; i++)
-                fillprocesstree(pt, pt[index].children[i]);
+        _reserveAggregate(treesize);
+        int *order = aggregate.order;
+        int *up = aggregate.up;
+        int *children_sum = aggregate.children_sum;
+        int *cpu_percent_sum = aggregate.cpu_percent_sum;
+        unsigned long *mem_kbyte_sum = aggregate.mem_kbyte_sum;
+
+        int count = 0;
+        pt[root].visited = true;
+        order[count] = root;
+        up[count++] = -1;
+        for (int k = 0; k < count; k++) {
+                ProcessTree_T *p = &pt[order[k]];
+                for (int i = p->children_num - 1; i >= 0; i--) {
+                        int child = p->children[i];
+                        if (! pt[child].visited) {
+                                pt[child].visited = true;
+                                order[count] = child;
+                                up[count++] = k;
+                        }
+                }
+        }
 
-        if (pt[index].parent != -1 && pt[index].parent != index) {
-                parent_pt                   = &pt[pt[index].parent];
-                parent_pt->children_sum    += pt[index].children_sum;
-                parent_pt->mem_kbyte_sum   += pt[index].mem_kbyte_sum;
-                parent_pt->cpu_percent_sum += pt[index].cpu_percent_sum;
-                parent_pt->cpu_percent_sum  = (pt[index].cpu_percent_sum > 1000) ? 1000 : parent_pt->cpu_percent_sum;
+        for (int k = 0; k < count; k++) {
+                ProcessTree_T *p = &pt[order[k]];
+                children_sum[k] = p->children_num;
+                mem_kbyte_sum[k] = p->mem_kbyte;
+                cpu_percent_sum[k] = p->cpu_percent;
+        }
+        for (int k = count - 1; k > 0; k--) {
+                int parent = up[k];
+                children_sum[parent] += children_sum[k];
+                mem_kbyte_sum[parent] += mem_kbyte_sum[k];
+                cpu_percent_sum[parent] = cpu_percent_sum[k] > 1000 ? 1000 : cpu_percent_sum[parent] + cpu_percent_sum[k];
+        }
+        for (int k = 0; k < count; k++) {
+                ProcessTree_T *p = &pt[order[k]];
+                p->children_sum = children_sum[k];
+                p->mem_kbyte_sum = mem_kbyte_sum[k];
+                p->cpu_percent_sum = cpu_percent_sum[k];
         }
 }
 
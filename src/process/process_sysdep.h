@@ -36,9 +36,10 @@ boolean_t used_system_cpu_sysdep(SystemInfo_T *);
 double get_float_time(void);
 
 int    initprocesstree_sysdep(ProcessTree_T **);
-void   fillprocesstree(ProcessTree_T *, int);
+void   fillprocesstree(ProcessTree_T *, int, int);
 
-boolean_t connectchild(ProcessTree_T *, int, int);
+ProcessTree_T *allocprocesstree(int);
+char  *allocprocessstring(const char *);
 
 
 #endif
@@ -195,7 +195,7 @@ int initprocesstree_sysdep(ProcessTree_T ** reference) {
                 return 0;
         }
 
-        pt = CALLOC(sizeof(ProcessTree_T), treesize);
+        pt = allocprocesstree(treesize);
 
         for (int i = 0; i < treesize; i++) {
                 int fd;
@@ -232,7 +232,7 @@ int initprocesstree_sysdep(ProcessTree_T ** reference) {
                 pt[i].uid     = ps.pr_uid;
                 pt[i].euid    = ps.pr_euid;
                 pt[i].gid     = ps.pr_gid;
-                pt[i].cmdline = (ps.pr_psargs && *ps.pr_psargs) ? Str_dup(ps.pr_psargs) : Str_dup(procs[i].pi_comm);
+                pt[i].cmdline = (ps.pr_psargs && *ps.pr_psargs) ? allocprocessstring(ps.pr_psargs) : allocprocessstring(procs[i].pi_comm);
         }
 
         FREE(procs);
@@ -165,14 +165,13 @@ int initprocesstree_sysdep(ProcessTree_T **reference) {
                 return 0;
         }
         treesize = pinfo_size / sizeof(struct kinfo_proc);
-        pt = CALLOC(sizeof(ProcessTree_T), treesize);
+        pt = allocprocesstree(treesize);
 
         mib[0] = CTL_KERN;
         mib[1] = KERN_ARGMAX;
         size = sizeof(args_size);
         if (sysctl(mib, 2, &args_size, &size, NULL, 0) == -1) {
                 FREE(pinfo);
-                FREE(pt);
                 LogError("system statistic error -- sysctl failed: %s\n", STRERROR);
                 return 0;
         }
@@ -216,12 +215,11 @@ int initprocesstree_sysdep(ProcessTree_T **reference) {
                                 p += strlen(p);
                         }
                         if (StringBuffer_length(cmdline))
-                                pt[i].cmdline = Str_dup(StringBuffer_toString(StringBuffer_trim(cmdline)));
+                                pt[i].cmdline = allocprocessstring(StringBuffer_toString(StringBuffer_trim(cmdline)));
                         StringBuffer_free(&cmdline);
                 }
                 if (! pt[i].cmdline || ! *pt[i].cmdline) {
-                        FREE(pt[i].cmdline);
-                        pt[i].cmdline = Str_dup(pinfo[i].kp_proc.p_comm);
+                        pt[i].cmdline = allocprocessstring(pinfo[i].kp_proc.p_comm);
                 }
 
                 if (pinfo[i].kp_proc.p_stat == SZOMB)
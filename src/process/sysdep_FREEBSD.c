@@ -159,7 +159,7 @@ int initprocesstree_sysdep(ProcessTree_T **reference) {
                 return 0;
         }
 
-        pt = CALLOC(sizeof(ProcessTree_T), treesize);
+        pt = allocprocesstree(treesize);
 
         for (int i = 0; i < treesize; i++) {
                 StringBuffer_T cmdline = StringBuffer_create(64);
@@ -181,12 +181,11 @@ int initprocesstree_sysdep(ProcessTree_T **reference) {
                 if ((args = kvm_getargv(kvm_handle, &pinfo[i], 0))) {
                         for (int j = 0; args[j]; j++)
                                 StringBuffer_append(cmdline, args[j + 1] ? "%s " : "%s", args[j]);
-                        pt[i].cmdline = Str_dup(StringBuffer_toString(StringBuffer_trim(cmdline)));
+                        pt[i].cmdline = allocprocessstring(StringBuffer_toString(StringBuffer_trim(cmdline)));
                 }
                 StringBuffer_free(&cmdline);
                 if (! pt[i].cmdline || ! *pt[i].cmdline) {
-                        FREE(pt[i].cmdline);
-                        pt[i].cmdline = Str_dup(procname);
+                        pt[i].cmdline = allocprocessstring(procname);
                 }
         }
 
@@ -182,7 +182,7 @@ int initprocesstree_sysdep(ProcessTree_T ** reference) {
                 return 0;
         }
 
-        pt = CALLOC(sizeof(ProcessTree_T), treesize);
+        pt = allocprocesstree(treesize);
 
         for (int i = 0; i < treesize; i++) {
                 pt[i].pid         = psall[i].pst_pid;
@@ -195,7 +195,7 @@ int initprocesstree_sysdep(ProcessTree_T ** reference) {
                 pt[i].cputime     =  psall[i].pst_utime + psall[i].pst_stime * 10;
                 pt[i].cpu_percent = (int)(1000. * psall[i].pst_pctcpu / (float)systeminfo.cpus);
                 pt[i].mem_kbyte   = (unsigned long)(psall[i].pst_rssize * (page_size / 1024.0));
-                pt[i].cmdline     = (psall[i].pst_cmd && *psall[i].pst_cmd) ? Str_dup(psall[i].pst_cmd) : Str_dup(psall[i].pst_ucomm);
+                pt[i].cmdline     = (psall[i].pst_cmd && *psall[i].pst_cmd) ? allocprocessstring(psall[i].pst_cmd) : allocprocessstring(psall[i].pst_ucomm);
 
                 if (psall[i].pst_stat == PS_ZOMBIE)
                         pt[i].zombie = true;
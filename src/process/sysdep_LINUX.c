@@ -65,8 +65,28 @@
 #include <asm/param.h>
 #endif
 
-#ifdef HAVE_GLOB_H
-#include <glob.h>
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_LINUX_NETLINK_H
+#include <linux/netlink.h>
+#endif
+
+#ifdef HAVE_LINUX_CONNECTOR_H
+#include <linux/connector.h>
+#endif
+
+#ifdef HAVE_LINUX_CN_PROC_H
+#include <linux/cn_proc.h>
 #endif
 
 #ifndef HZ
@@ -77,7 +97,8 @@
 #include "process.h"
 #include "process_sysdep.h"
 
-// libmonit
+#include "system/Time.h"
+#include "exceptions/AssertException.h"
 #include "system/Time.h"
 
 /**
@@ -102,11 +123,58 @@
 
 #define NSEC_PER_SEC    1000000000L
 
+#define DIRENT_BUFFER   32768
+#define CMDLINE_MAX     4096
+#define SHARD_MIN       512            /**< Minimum number of pids per worker */
+#define WORKERS_MAX     64
+
+
+/* The getdents64 record, glibc doesn't export it */
+struct linux_dirent64 {
+        uint64_t       d_ino;
+        int64_t        d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[];
+};
+
+
+/* Values parsed from /proc/PID/stat and /proc/PID/status */
+typedef struct ProcessStat_T {
+        char               state;
+        int                ppid;
+        int                uid;
+        int                euid;
+        int                gid;
+        long               rss;
+        unsigned long      utime;
+        unsigned long      stime;
+        unsigned long long starttime;
+        char               name[STRLEN];
+} ProcessStat_T;
+
+
+/* Slice of the pid list read by one worker */
+typedef struct ProcessShard_T {
+        int            procfd;
+        int           *pids;
+        ProcessTree_T *pt;
+        int            count;
+        int            fields;
+        boolean_t      started;
+        Thread_T       thread;
+} ProcessShard_T;
+
+
 static unsigned long long old_cpu_user     = 0;
 static unsigned long long old_cpu_syst     = 0;
 static unsigned long long old_cpu_wait     = 0;
 static unsigned long long old_cpu_total    = 0;
 static int                page_shift_to_kb = 0;
+static int               *pids             = NULL;
+static int                pids_capacity    = 0;
+static time_t             boottime         = 0;
+static long               clktck           = 0;
 
 
 /**
@@ -131,6 +199,746 @@ static time_t get_starttime() {
 }
 
 
+/**
+ * Read the file relative to the given /proc/PID directory descriptor
+ * @return number of bytes read or -1 on error
+ */
+static int _readProcessFile(int dirfd, const char *name, char *buf, int buf_size) {
+        int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -1;
+        int bytes = (int)read(fd, buf, buf_size - 1);
+        close(fd);
+        if (bytes < 0)
+                return -1;
+        buf[bytes] = 0;
+        return bytes;
+}
+
+
+/**
+ * Parse an unsigned decimal number and skip the trailing field separator(s)
+ * @return the number, *s is moved to the next field
+ */
+static unsigned long long _parseNumber(char **s) {
+        char *p = *s;
+        boolean_t negative = false;
+        unsigned long long n = 0ULL;
+        if (*p == '-') {
+                negative = true;
+                p++;
+        }
+        for (; *p >= '0' && *p <= '9'; p++)
+                n = n * 10 + (*p - '0');
+        while (*p == ' ' || *p == '\t')
+                p++;
+        *s = p;
+        return negative ? -n : n;
+}
+
+
+/**
+ * Skip the given number of space separated fields
+ */
+static char *_skipFields(char *s, int count) {
+        for (; count > 0 && *s; count--) {
+                while (*s && *s != ' ')
+                        s++;
+                while (*s == ' ')
+                        s++;
+        }
+        return s;
+}
+
+
+/**
+ * Parse /proc/PID/stat: "pid (comm) state ppid ... utime stime cutime cstime ... starttime vsize rss ..."
+ * The process name may contain spaces and parentheses, so the fields are located relative to the last ')'
+ */
+static boolean_t _parseProcessStat(char *buf, ProcessStat_T *stat) {
+        char *name = strchr(buf, '(');
+        char *p = strrchr(buf, ')');
+        if (! name || ! p || p < name)
+                return false;
+        /* Keep the process name up to the first whitespace as before */
+        int i = 0;
+        for (name++; name < p && *name != ' ' && i < STRLEN - 1; name++)
+                stat->name[i++] = *name;
+        stat->name[i] = 0;
+        p++;
+        while (*p == ' ')
+                p++;
+        if (! *p)
+                return false;
+        stat->state = *p;                                 // field 3
+        p = _skipFields(p, 1);
+        stat->ppid = (int)_parseNumber(&p);               // field 4
+        p = _skipFields(p, 9);
+        stat->utime = (unsigned long)_parseNumber(&p);    // field 14
+        stat->stime = (unsigned long)_parseNumber(&p);    // field 15
+        p = _skipFields(p, 6);
+        stat->starttime = _parseNumber(&p);               // field 22
+        p = _skipFields(p, 1);
+        if (! *p)
+                return false;
+        stat->rss = (long)_parseNumber(&p);               // field 24
+        return true;
+}
+
+
+/**
+ * Parse the real and effective uid and the real gid from /proc/PID/status
+ */
+static boolean_t _parseProcessStatus(char *buf, ProcessStat_T *stat) {
+        boolean_t uid = false, gid = false;
+        for (char *line = buf; *line && ! (uid && gid); line++) {
+                if (line[0] == 'U' && line[1] == 'i' && line[2] == 'd' && line[3] == ':') {
+                        char *p = line + 4;
+                        while (*p == '\t' || *p == ' ')
+                                p++;
+                        stat->uid = (int)_parseNumber(&p);
+                        stat->euid = (int)_parseNumber(&p);
+                        uid = true;
+                } else if (line[0] == 'G' && line[1] == 'i' && line[2] == 'd' && line[3] == ':') {
+                        char *p = line + 4;
+                        while (*p == '\t' || *p == ' ')
+                                p++;
+                        stat->gid = (int)_parseNumber(&p);
+                        gid = true;
+                }
+                if (! (line = strchr(line, '\n')))
+                        break;
+        }
+        return uid && gid;
+}
+
+
+/**
+ * Read the requested parts of the process information from the /proc/PID
+ * directory. The data are set only if all reads succeeded, so a partial
+ * result never overwrites a valid entry.
+ * @param piddirfd The /proc/PID directory descriptor
+ * @param pid The process id
+ * @param what ProcessField_* parts to read (/proc/PID/stat, status and cmdline)
+ * @param pt The process tree entry to update (except of the command line)
+ * @param cmdline Buffer of CMDLINE_MAX size for the command line if requested
+ * @return true if succeeded otherwise false
+ */
+static boolean_t _readProcess(int piddirfd, int pid, int what, ProcessTree_T *pt, char *cmdline) {
+        int bytes = 0;
+        char buf[4096];
+        ProcessStat_T procstat;
+
+        if (what & ProcessField_Cmdline)
+                what |= ProcessField_Stat; // Kernel threads have no cmdline, the process name is used instead
+
+        /********** /proc/PID/stat **********/
+        if (what & ProcessField_Stat) {
+                if (_readProcessFile(piddirfd, "stat", buf, sizeof(buf)) < 0) {
+                        DEBUG("system statistic error -- cannot read /proc/%d/stat\n", pid);
+                        return false;
+                }
+                if (! _parseProcessStat(buf, &procstat)) {
+                        DEBUG("system statistic error -- file /proc/%d/stat parse error\n", pid);
+                        return false;
+                }
+        }
+
+        /********** /proc/PID/status **********/
+        if (what & ProcessField_Status) {
+                if (_readProcessFile(piddirfd, "status", buf, sizeof(buf)) < 0) {
+                        DEBUG("system statistic error -- cannot read /proc/%d/status\n", pid);
+                        return false;
+                }
+                if (! _parseProcessStatus(buf, &procstat)) {
+                        DEBUG("system statistic error -- cannot read process uid/gid\n");
+                        return false;
+                }
+        }
+
+        /********** /proc/PID/cmdline **********/
+        if (what & ProcessField_Cmdline) {
+                if ((bytes = _readProcessFile(piddirfd, "cmdline", buf, sizeof(buf))) < 0) {
+                        DEBUG("system statistic error -- cannot read /proc/%d/cmdline\n", pid);
+                        return false;
+                }
+                for (int j = 0; j < (bytes - 1); j++) // The cmdline file contains argv elements/strings terminated separated by '\0' => join the string
+                        if (buf[j] == 0)
+                                buf[j] = ' ';
+        }
+
+        /* Set the data in ptree only if all process related reads succeeded (prevent partial data in the case that some read failed) */
+        pt->pid = pid;
+        if (what & ProcessField_Stat) {
+                pt->time = get_float_time();
+                pt->ppid = procstat.ppid;
+                pt->starttime = boottime + (time_t)(procstat.starttime / clktck);
+                pt->cputime = ((float)(procstat.utime + procstat.stime) * 10.0) / clktck; // jiffies -> seconds = 1 / HZ. HZ is defined in "asm/param.h" and it is usually 1/100s but on alpha system it is 1/1024s
+                pt->cpu_percent = 0;
+                pt->mem_kbyte = (page_shift_to_kb < 0) ? (procstat.rss >> abs(page_shift_to_kb)) : (procstat.rss << abs(page_shift_to_kb));
+                pt->zombie = procstat.state == 'Z' ? true : false; // State is Zombie -> then we are a Zombie ... clear or? (-:
+        }
+        if (what & ProcessField_Status) {
+                pt->uid = procstat.uid;
+                pt->euid = procstat.euid;
+                pt->gid = procstat.gid;
+        }
+        if (what & ProcessField_Cmdline)
+                snprintf(cmdline, CMDLINE_MAX, "%s", *buf ? buf : procstat.name);
+        return true;
+}
+
+
+/**
+ * The pid buffer is reused by each cycle for the /proc scan and as a
+ * temporary pid list, so steady state cycles don't allocate it
+ * @return The buffer with capacity for at least count pids
+ */
+static int *_reservePids(int count) {
+        if (count > pids_capacity) {
+                pids_capacity = MAX(count, pids_capacity ? pids_capacity * 2 : 1024);
+                RESIZE(pids, pids_capacity * sizeof(int));
+        }
+        return pids;
+}
+
+
+/**
+ * Read the process information for a slice of the pid list. Entries of
+ * processes which couldn't be read are left with pid 0, the credentials
+ * are set to -1 if they are not part of the collection plan.
+ */
+static void *_scanShard(void *args) {
+        ProcessShard_T *shard = args;
+        char name[16];
+        char cmdline[CMDLINE_MAX];
+        for (int i = 0; i < shard->count; i++) {
+                snprintf(name, sizeof(name), "%d", shard->pids[i]);
+                int piddirfd = openat(shard->procfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (piddirfd < 0)
+                        continue; // The process exited meanwhile
+                if (_readProcess(piddirfd, shard->pids[i], shard->fields, &shard->pt[i], cmdline)) {
+                        if (! (shard->fields & ProcessField_Status))
+                                shard->pt[i].uid = shard->pt[i].euid = shard->pt[i].gid = -1;
+                        if (shard->fields & ProcessField_Cmdline)
+                                shard->pt[i].cmdline = allocprocessstring(cmdline);
+                }
+                close(piddirfd);
+        }
+        return NULL;
+}
+
+
+/**
+ * Read all processes of the proc files system. The /proc directory is
+ * walked with getdents64 and the per process files are opened relative
+ * to the /proc descriptor. If more workers are configured and there are
+ * enough processes, the pid list is split into slices read in parallel.
+ * @param reference  reference of ProcessTree
+ * @return treesize>0 if succeeded otherwise =0.
+ */
+static int _scanProcessTree(ProcessTree_T **reference) {
+        int                 count = 0;
+        int                 treesize = 0;
+        char                dirents[DIRENT_BUFFER];
+        ProcessTree_T      *pt = NULL;
+
+        ASSERT(reference);
+
+        int procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (procfd < 0) {
+                LogError("system statistic error -- cannot open /proc: %s\n", STRERROR);
+                return 0;
+        }
+
+        /* Read the values shared by all processes only once per scan */
+        boottime = get_starttime();
+        clktck = HZ;
+
+        /* Collect the pid list */
+        long n;
+        while ((n = syscall(SYS_getdents64, procfd, dirents, sizeof(dirents))) > 0) {
+                for (long offset = 0; offset < n; ) {
+                        struct linux_dirent64 *entry = (struct linux_dirent64 *)(dirents + offset);
+                        offset += entry->d_reclen;
+
+                        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+                                continue;
+                        int pid = 0;
+                        char *c = entry->d_name;
+                        for (; *c >= '0' && *c <= '9'; c++)
+                                pid = pid * 10 + (*c - '0');
+                        if (*c || c == entry->d_name)
+                                continue;
+                        _reservePids(count + 1);
+                        pids[count++] = pid;
+                }
+        }
+        if (n < 0)
+                LogError("system statistic error -- cannot read /proc: %s\n", STRERROR);
+
+        if (count > 0) {
+                pt = allocprocesstree(count);
+
+                /* Read the process data, in parallel slices if enabled and worth it */
+                int workers = MIN(MAX(Run.process_workers, 1), MIN(count / SHARD_MIN, WORKERS_MAX));
+                if (workers > 1) {
+                        ProcessShard_T shards[WORKERS_MAX];
+                        int slice = (count + workers - 1) / workers;
+                        for (int i = 0; i < workers; i++) {
+                                shards[i].procfd = procfd;
+                                shards[i].pids = pids + i * slice;
+                                shards[i].pt = pt + i * slice;
+                                shards[i].count = MIN(slice, count - i * slice);
+                                shards[i].fields = Run.process_fields;
+                                shards[i].started = true;
+                                TRY
+                                {
+                                        Thread_create(shards[i].thread, _scanShard, &shards[i]);
+                                }
+                                ELSE
+                                {
+                                        shards[i].started = false;
+                                }
+                                END_TRY;
+                                if (! shards[i].started)
+                                        _scanShard(&shards[i]);
+                        }
+                        for (int i = 0; i < workers; i++)
+                                if (shards[i].started)
+                                        Thread_join(shards[i].thread);
+                } else {
+                        ProcessShard_T shard = {.procfd = procfd, .pids = pids, .pt = pt, .count = count, .fields = Run.process_fields};
+                        _scanShard(&shard);
+                }
+
+                /* Remove the entries of processes which exited during the scan */
+                for (int i = 0; i < count; i++)
+                        if (pt[i].pid)
+                                pt[treesize++] = pt[i];
+        }
+        close(procfd);
+
+        if (treesize == 0)
+                return 0;
+
+        *reference = pt;
+
+        return treesize;
+}
+
+
+static int _comparePid(const void *a, const void *b) {
+        int x = *(const int *)a, y = *(const int *)b;
+        return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/**
+ * If the collection plan skips /proc/PID/status, read the credentials only
+ * for the processes of process services (as found in the previous cycle),
+ * so they are still available for the status report
+ */
+static void _readServiceCredentials(ProcessTree_T *pt, int treesize) {
+        if (Run.process_fields & ProcessField_Status || treesize <= 0)
+                return;
+        int count = 0;
+        for (Service_T s = servicelist; s; s = s->next)
+                if (s->type == Service_Process && s->inf->priv.process.pid > 0)
+                        count++;
+        if (! count)
+                return;
+        int *wanted = _reservePids(count);
+        count = 0;
+        for (Service_T s = servicelist; s; s = s->next)
+                if (s->type == Service_Process && s->inf->priv.process.pid > 0)
+                        wanted[count++] = s->inf->priv.process.pid;
+        qsort(wanted, count, sizeof(int), _comparePid);
+        int procfd = -1;
+        for (int i = 0; i < treesize; i++) {
+                if (pt[i].uid >= 0 || ! bsearch(&pt[i].pid, wanted, count, sizeof(int), _comparePid))
+                        continue;
+                if (procfd < 0 && (procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+                        break;
+                char name[16];
+                snprintf(name, sizeof(name), "%d", pt[i].pid);
+                int piddirfd = openat(procfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (piddirfd >= 0) {
+                        _readProcess(piddirfd, pt[i].pid, ProcessField_Status, &pt[i], NULL);
+                        close(piddirfd);
+                }
+        }
+        if (procfd >= 0)
+                close(procfd);
+}
+
+
+#ifdef HAVE_LINUX_CN_PROC_H
+
+
+/* ---------------------------------------------- Process events (netlink) */
+
+
+/*
+ * The kernel proc connector reports fork, exec, exit and uid/gid changes.
+ * When enabled, the process list is kept in a persistent cache updated by
+ * these events and the tree is built from the cache instead of scanning
+ * /proc. Only new and changed processes and the processes referenced by
+ * process services (including their children) are re-read each cycle.
+ * The full scan is used to seed the cache, when events were lost and
+ * periodically as a safety net.
+ */
+
+
+#define EVENTS_BUFFER   8192
+#define EVENTS_RCVBUF   (4 * 1024 * 1024)
+#define EVENTS_RESYNC   60                 /**< Cycles between full rescans */
+
+
+typedef struct ProcessEntry_T {
+        ProcessTree_T data;           /**< Cached process data, pid 0 = free slot */
+        int           update;    /**< ProcessField_* parts to read in next cycle */
+        boolean_t     exited;         /**< Exit reported, remove once /proc is gone */
+} ProcessEntry_T;
+
+
+static struct {
+        int             socket;                  /**< Netlink socket or -1 if off */
+        boolean_t       failed;            /**< The connector is not available */
+        boolean_t       resync;             /**< Events were lost, full rescan */
+        int             cycles;                 /**< Cycles since the last rescan */
+        int             fields;          /**< The collection plan of the cache */
+        int             count;                         /**< Cached processes count */
+        unsigned int    mask;                          /**< Cache capacity minus one */
+        ProcessEntry_T *cache;
+} events = {.socket = -1};
+
+
+static inline unsigned int _cacheHash(pid_t pid) {
+        return ((unsigned int)pid * 2654435761U) & events.mask;
+}
+
+
+static ProcessEntry_T *_cacheFind(pid_t pid) {
+        if (events.cache && pid > 0)
+                for (unsigned int h = _cacheHash(pid); events.cache[h].data.pid; h = (h + 1) & events.mask)
+                        if (events.cache[h].data.pid == pid)
+                                return &events.cache[h];
+        return NULL;
+}
+
+
+static void _cacheResize(unsigned int size) {
+        ProcessEntry_T *old = events.cache;
+        unsigned int oldsize = old ? events.mask + 1 : 0;
+        events.cache = CALLOC(sizeof(ProcessEntry_T), size);
+        events.mask = size - 1;
+        for (unsigned int i = 0; i < oldsize; i++) {
+                if (old[i].data.pid) {
+                        unsigned int h = _cacheHash(old[i].data.pid);
+                        while (events.cache[h].data.pid)
+                                h = (h + 1) & events.mask;
+                        events.cache[h] = old[i];
+                }
+        }
+        FREE(old);
+}
+
+
+/**
+ * Find or create the cache entry for the given pid
+ */
+static ProcessEntry_T *_cacheAdd(pid_t pid) {
+        ProcessEntry_T *e = _cacheFind(pid);
+        if (! e) {
+                if (! events.cache || (unsigned int)(events.count + 1) * 2 > events.mask + 1)
+                        _cacheResize(events.cache ? (events.mask + 1) * 2 : 1024);
+                unsigned int h = _cacheHash(pid);
+                while (events.cache[h].data.pid)
+                        h = (h + 1) & events.mask;
+                e = &events.cache[h];
+                memset(e, 0, sizeof(ProcessEntry_T));
+                e->data.pid = pid;
+                e->data.uid = e->data.euid = e->data.gid = -1;
+                events.count++;
+        }
+        return e;
+}
+
+
+/**
+ * Remove the entry, the following entries of the probe sequence are shifted back
+ */
+static void _cacheRemove(ProcessEntry_T *e) {
+        unsigned int i = (unsigned int)(e - events.cache);
+        FREE(events.cache[i].data.cmdline);
+        events.cache[i].data.pid = 0;
+        events.count--;
+        for (unsigned int j = (i + 1) & events.mask; events.cache[j].data.pid; j = (j + 1) & events.mask) {
+                unsigned int h = _cacheHash(events.cache[j].data.pid);
+                /* Move the entry to the hole if its home slot is not in the cyclic range (i, j] */
+                if ((j > i && (h <= i || h > j)) || (j < i && (h <= i && h > j))) {
+                        events.cache[i] = events.cache[j];
+                        events.cache[j].data.pid = 0;
+                        events.cache[j].data.cmdline = NULL;
+                        i = j;
+                }
+        }
+}
+
+
+static void _cacheClear() {
+        if (events.cache) {
+                for (unsigned int i = 0; i <= events.mask; i++)
+                        FREE(events.cache[i].data.cmdline);
+                FREE(events.cache);
+        }
+        events.count = 0;
+        events.mask = 0;
+}
+
+
+/**
+ * Seed the cache from a full scan
+ */
+static void _cacheLoad(ProcessTree_T *pt, int treesize) {
+        _cacheClear();
+        unsigned int size = 1024;
+        while (size < (unsigned int)treesize * 2)
+                size <<= 1;
+        _cacheResize(size);
+        for (int i = 0; i < treesize; i++) {
+                ProcessEntry_T *e = _cacheAdd(pt[i].pid);
+                e->data = pt[i];
+                e->data.cmdline = pt[i].cmdline ? Str_dup(pt[i].cmdline) : NULL;
+        }
+}
+
+
+static void _eventsStop() {
+        if (events.socket >= 0) {
+                close(events.socket);
+                events.socket = -1;
+        }
+        _cacheClear();
+}
+
+
+/**
+ * Subscribe to the proc connector multicast group
+ * @return true if succeeded otherwise false
+ */
+static boolean_t _eventsStart() {
+        struct sockaddr_nl sa = {.nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC};
+        if ((events.socket = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR)) < 0) {
+                LogWarning("Process engine -- cannot create the netlink connector socket: %s -- using /proc scan\n", STRERROR);
+                return false;
+        }
+        int rcvbuf = EVENTS_RCVBUF;
+        setsockopt(events.socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (bind(events.socket, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+                LogWarning("Process engine -- cannot bind the netlink connector socket: %s -- using /proc scan\n", STRERROR);
+                goto error;
+        }
+        struct __attribute__((aligned(NLMSG_ALIGNTO))) {
+                struct nlmsghdr header;
+                struct __attribute__((__packed__)) {
+                        struct cn_msg message;
+                        enum proc_cn_mcast_op operation;
+                } body;
+        } request;
+        memset(&request, 0, sizeof(request));
+        request.header.nlmsg_len = sizeof(request);
+        request.header.nlmsg_type = NLMSG_DONE;
+        request.header.nlmsg_pid = getpid();
+        request.body.message.id.idx = CN_IDX_PROC;
+        request.body.message.id.val = CN_VAL_PROC;
+        request.body.message.len = sizeof(enum proc_cn_mcast_op);
+        request.body.operation = PROC_CN_MCAST_LISTEN;
+        if (send(events.socket, &request, sizeof(request), 0) < 0) {
+                LogWarning("Process engine -- cannot subscribe to process events: %s -- using /proc scan\n", STRERROR);
+                goto error;
+        }
+        DEBUG("Process engine -- subscribed to the kernel process events\n");
+        events.resync = true;
+        return true;
+error:
+        close(events.socket);
+        events.socket = -1;
+        return false;
+}
+
+
+static void _eventsHandle(struct proc_event *event) {
+        ProcessEntry_T *e;
+        switch (event->what) {
+                case PROC_EVENT_FORK:
+                        /* Threads are not listed in /proc, track only new thread group leaders */
+                        if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid) {
+                                e = _cacheAdd(event->event_data.fork.child_tgid);
+                                e->update = Run.process_fields;
+                                e->exited = false;
+                        }
+                        break;
+                case PROC_EVENT_EXEC:
+                        if ((e = _cacheFind(event->event_data.exec.process_tgid))) {
+                                e->update |= ProcessField_Stat | (Run.process_fields & ProcessField_Cmdline);
+                        } else {
+                                e = _cacheAdd(event->event_data.exec.process_tgid);
+                                e->update = Run.process_fields;
+                        }
+                        break;
+                case PROC_EVENT_UID:
+                        if ((e = _cacheFind(event->event_data.id.process_tgid))) {
+                                e->data.uid = event->event_data.id.r.ruid;
+                                e->data.euid = event->event_data.id.e.euid;
+                        }
+                        break;
+                case PROC_EVENT_GID:
+                        if ((e = _cacheFind(event->event_data.id.process_tgid)))
+                                e->data.gid = event->event_data.id.r.rgid;
+                        break;
+                case PROC_EVENT_EXIT:
+                        /* The process is a zombie until reaped, keep it while /proc/PID exists */
+                        if (event->event_data.exit.process_pid == event->event_data.exit.process_tgid && (e = _cacheFind(event->event_data.exit.process_tgid))) {
+                                e->update |= ProcessField_Stat;
+                                e->exited = true;
+                        }
+                        break;
+                default:
+                        break;
+        }
+}
+
+
+/**
+ * Apply all queued events to the cache
+ * @return false if events were lost and the cache must be reloaded
+ */
+static boolean_t _eventsDrain() {
+        char buf[EVENTS_BUFFER] __attribute__((aligned(NLMSG_ALIGNTO)));
+        ssize_t n;
+        while ((n = recv(events.socket, buf, sizeof(buf), 0)) > 0) {
+                for (struct nlmsghdr *header = (struct nlmsghdr *)buf; NLMSG_OK(header, n); header = NLMSG_NEXT(header, n)) {
+                        if (header->nlmsg_type == NLMSG_ERROR || header->nlmsg_type == NLMSG_OVERRUN)
+                                return false;
+                        if (header->nlmsg_type == NLMSG_NOOP)
+                                continue;
+                        struct cn_msg *message = NLMSG_DATA(header);
+                        if (message->id.idx == CN_IDX_PROC && message->id.val == CN_VAL_PROC)
+                                _eventsHandle((struct proc_event *)message->data);
+                }
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                if (errno == ENOBUFS)
+                        DEBUG("Process engine -- process events were dropped, rescanning /proc\n");
+                else
+                        LogError("Process engine -- process events read error: %s\n", STRERROR);
+                return false;
+        }
+        return true;
+}
+
+
+/**
+ * Mark the processes referenced by process services and their children in
+ * the previous tree for update, so their CPU and memory usage is current
+ */
+static void _markReferenced() {
+        int *stack = NULL;
+        for (Service_T s = servicelist; s; s = s->next) {
+                if (s->type != Service_Process || s->inf->priv.process.pid <= 0)
+                        continue;
+                ProcessEntry_T *e = _cacheFind(s->inf->priv.process.pid);
+                if (e)
+                        e->update |= ProcessField_Stat;
+                int root;
+                if (! oldptree || (root = findprocess(s->inf->priv.process.pid, oldptree, oldptreesize)) < 0)
+                        continue;
+                if (! stack)
+                        stack = _reservePids(oldptreesize);
+                int depth = 0;
+                stack[depth++] = root;
+                while (depth > 0) {
+                        ProcessTree_T *p = &oldptree[stack[--depth]];
+                        for (int i = 0; i < p->children_num && depth < oldptreesize; i++) {
+                                if ((e = _cacheFind(oldptree[p->children[i]].pid)))
+                                        e->update |= ProcessField_Stat;
+                                stack[depth++] = p->children[i];
+                        }
+                }
+        }
+}
+
+
+/**
+ * Build the process tree from the event cache
+ * @return treesize>0 if succeeded otherwise =0.
+ */
+static int _eventsProcessTree(ProcessTree_T **reference) {
+        int procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (procfd < 0) {
+                LogError("system statistic error -- cannot open /proc: %s\n", STRERROR);
+                return 0;
+        }
+        boottime = get_starttime();
+        clktck = HZ;
+
+        _markReferenced();
+
+        int treesize = 0, gonecount = 0;
+        int *gone = _reservePids(events.count);
+        char cmdline[CMDLINE_MAX];
+        ProcessTree_T *pt = allocprocesstree(events.count);
+        for (unsigned int i = 0; i <= events.mask; i++) {
+                ProcessEntry_T *e = &events.cache[i];
+                if (! e->data.pid)
+                        continue;
+                /* The process was reparented if its parent is gone, re-read the stat */
+                if (e->data.ppid > 0 && e->data.ppid != e->data.pid && ! _cacheFind(e->data.ppid))
+                        e->update |= ProcessField_Stat;
+                if (e->update) {
+                        char name[16];
+                        snprintf(name, sizeof(name), "%d", e->data.pid);
+                        int piddirfd = openat(procfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                        boolean_t alive = piddirfd >= 0 && _readProcess(piddirfd, e->data.pid, e->update, &e->data, cmdline);
+                        if (piddirfd >= 0)
+                                close(piddirfd);
+                        if (! alive) {
+                                /* The process is gone, remove it after the walk as the removal moves other entries */
+                                gone[gonecount++] = e->data.pid;
+                                continue;
+                        }
+                        if (e->update & ProcessField_Cmdline) {
+                                FREE(e->data.cmdline);
+                                e->data.cmdline = Str_dup(cmdline);
+                        }
+                        e->update = e->exited ? ProcessField_Stat : 0;
+                }
+                pt[treesize] = e->data;
+                pt[treesize].cmdline = allocprocessstring(e->data.cmdline);
+                pt[treesize].children = NULL;
+                pt[treesize].children_num = 0;
+                pt[treesize].visited = false;
+                treesize++;
+        }
+        for (int i = 0; i < gonecount; i++) {
+                ProcessEntry_T *e = _cacheFind(gone[i]);
+                if (e)
+                        _cacheRemove(e);
+        }
+        close(procfd);
+
+        if (treesize == 0)
+                return 0;
+        *reference = pt;
+        return treesize;
+}
+
+
+#endif
+
+
 /* ------------------------------------------------------------------ Public */
 
 
@@ -174,132 +982,50 @@ boolean_t init_process_info_sysdep(void) {
 }
 
 
+
+
 /**
  * Read all processes of the proc files system to initialize
  * the process tree (sysdep version... but should work for
- * all procfs based unices)
+ * all procfs based unices). If process events are enabled,
+ * the tree is built from the event cache instead of a full
+ * /proc scan whenever possible.
  * @param reference  reference of ProcessTree
  * @return treesize>0 if succeeded otherwise =0.
  */
-int initprocesstree_sysdep(ProcessTree_T ** reference) {
-        int                 rv, bytes = 0;
-        int                 treesize = 0;
-        int                 stat_pid = 0;
-        int                 stat_ppid = 0;
-        int                 stat_uid = 0;
-        int                 stat_euid = 0;
-        int                 stat_gid = 0;
-        char               *tmp = NULL;
-        char                procname[STRLEN];
-        char                buf[4096];
-        char                stat_item_state;
-        long                stat_item_cutime = 0;
-        long                stat_item_cstime = 0;
-        long                stat_item_rss = 0;
-        glob_t              globbuf;
-        unsigned long       stat_item_utime = 0;
-        unsigned long       stat_item_stime = 0;
-        unsigned long long  stat_item_starttime = 0ULL;
-        ProcessTree_T      *pt = NULL;
-
+int initprocesstree_sysdep(ProcessTree_T **reference) {
         ASSERT(reference);
-
-        /* Find all processes in the /proc directory */
-        if ((rv = glob("/proc/[0-9]*", GLOB_ONLYDIR, NULL, &globbuf))) {
-                LogError("system statistic error -- glob failed: %d (%s)\n", rv, STRERROR);
-                return 0;
-        }
-
-        treesize = globbuf.gl_pathc;
-
-        pt = CALLOC(sizeof(ProcessTree_T), treesize);
-
-        /* Insert data from /proc directory */
-        for (int i = 0; i < treesize; i++) {
-                stat_pid = atoi(globbuf.gl_pathv[i] + strlen("/proc/"));
-
-                /********** /proc/PID/stat **********/
-                if (! read_proc_file(buf, sizeof(buf), "stat", stat_pid, NULL)) {
-                        DEBUG("system statistic error -- cannot read /proc/%d/stat\n", stat_pid);
-                        continue;
-                }
-                if (! (tmp = strrchr(buf, ')'))) {
-                        DEBUG("system statistic error -- file /proc/%d/stat parse error\n", stat_pid);
-                        continue;
-                }
-                *tmp = 0;
-                if (sscanf(buf, "%*d (%256s", procname) != 1) {
-                        DEBUG("system statistic error -- file /proc/%d/stat process name parse error\n", stat_pid);
-                        continue;
-                }
-                tmp += 2;
-                if (sscanf(tmp,
-                           "%c %d %*d %*d %*d %*d %*u %*u"
-                           "%*u %*u %*u %lu %lu %ld %ld %*d %*d %*d "
-                           "%*u %llu %*u %ld %*u %*u %*u %*u %*u "
-                           "%*u %*u %*u %*u %*u %*u %*u %*u %*d %*d\n",
-                           &stat_item_state,
-                           &stat_ppid,
-                           &stat_item_utime,
-                           &stat_item_stime,
-                           &stat_item_cutime,
-                           &stat_item_cstime,
-                           &stat_item_starttime,
-                           &stat_item_rss) != 8) {
-                        DEBUG("system statistic error -- file /proc/%d/stat parse error\n", stat_pid);
-                        continue;
-                }
-
-                /********** /proc/PID/status **********/
-                if (! read_proc_file(buf, sizeof(buf), "status", stat_pid, NULL)) {
-                        DEBUG("system statistic error -- cannot read /proc/%d/status\n", stat_pid);
-                        continue;
-                }
-                if (! (tmp = strstr(buf, UID))) {
-                        DEBUG("system statistic error -- cannot find process uid\n");
-                        continue;
+#ifdef HAVE_LINUX_CN_PROC_H
+        if (Run.flags & Run_ProcessEvents) {
+                if (events.socket < 0 && ! events.failed && ! _eventsStart())
+                        events.failed = true;
+                if (events.socket >= 0) {
+                        /* The cache must be reloaded if the collection plan changed (configuration reload) */
+                        if (! _eventsDrain() || ++events.cycles >= EVENTS_RESYNC || events.fields != Run.process_fields)
+                                events.resync = true;
+                        if (! events.resync) {
+                                int treesize = _eventsProcessTree(reference);
+                                if (treesize > 0) {
+                                        _readServiceCredentials(*reference, treesize);
+                                        return treesize;
+                                }
+                        }
+                        /* Subscribed before the scan, so no event is missed between the scan and the next drain */
+                        int treesize = _scanProcessTree(reference);
+                        _readServiceCredentials(*reference, treesize);
+                        _cacheLoad(*reference, treesize);
+                        events.resync = false;
+                        events.cycles = 0;
+                        events.fields = Run.process_fields;
+                        return treesize;
                 }
-                if (sscanf(tmp+strlen(UID), "\t%d\t%d", &stat_uid, &stat_euid) != 2) {
-                        DEBUG("system statistic error -- cannot read process uid\n");
-                        continue;
-                }
-                if (! (tmp = strstr(buf, GID))) {
-                        DEBUG("system statistic error -- cannot find process gid\n");
-                        continue;
-                }
-                if (sscanf(tmp+strlen(GID), "\t%d", &stat_gid) != 1) {
-                        DEBUG("system statistic error -- cannot read process gid\n");
-                        continue;
-                }
-
-                /********** /proc/PID/cmdline **********/
-                if (! read_proc_file(buf, sizeof(buf), "cmdline", stat_pid, &bytes)) {
-                        DEBUG("system statistic error -- cannot read /proc/%d/cmdline\n", stat_pid);
-                        continue;
-                }
-                for (int j = 0; j < (bytes - 1); j++) // The cmdline file contains argv elements/strings terminated separated by '\0' => join the string
-                        if (buf[j] == 0)
-                                buf[j] = ' ';
-
-                /* Set the data in ptree only if all process related reads succeeded (prevent partial data in the case that continue was called during data gathering) */
-                pt[i].time = get_float_time();
-                pt[i].pid = stat_pid;
-                pt[i].ppid = stat_ppid;
-                pt[i].uid = stat_uid;
-                pt[i].euid = stat_euid;
-                pt[i].gid = stat_gid;
-                pt[i].starttime = get_starttime() + (time_t)(stat_item_starttime / HZ);
-                pt[i].cmdline = Str_dup(*buf ? buf : procname);
-                pt[i].cputime = ((float)(stat_item_utime + stat_item_stime) * 10.0) / HZ; // jiffies -> seconds = 1 / HZ. HZ is defined in "asm/param.h" and it is usually 1/100s but on alpha system it is 1/1024s
-                pt[i].cpu_percent = 0;
-                pt[i].mem_kbyte = (page_shift_to_kb < 0) ? (stat_item_rss >> abs(page_shift_to_kb)) : (stat_item_rss << abs(page_shift_to_kb));
-                if (stat_item_state == 'Z') // State is Zombie -> then we are a Zombie ... clear or? (-:
-                        pt[i].zombie = true;
+        } else if (events.socket >= 0 || events.failed) {
+                _eventsStop();
+                events.failed = false;
         }
-
-        *reference = pt;
-        globfree(&globbuf);
-
+#endif
+        int treesize = _scanProcessTree(reference);
+        _readServiceCredentials(*reference, treesize);
         return treesize;
 }
 
@@ -184,11 +184,10 @@ int initprocesstree_sysdep(ProcessTree_T **reference) {
         treesize = (int)(size / sizeof(struct kinfo_proc));
 #endif
 
-        pt = CALLOC(sizeof(ProcessTree_T), treesize);
+        pt = allocprocesstree(treesize);
 
         if (! (kvm_handle = kvm_openfiles(NULL, NULL, NULL, KVM_NO_FILES, buf))) {
                 FREE(pinfo);
-                FREE(pt);
                 LogError("system statistic error -- kvm_openfiles failed: %s\n", buf);
                 return 0;
         }
@@ -215,12 +214,11 @@ int initprocesstree_sysdep(ProcessTree_T **reference) {
                         StringBuffer_T cmdline = StringBuffer_create(64);;
                         for (int j = 0; args[j]; j++)
                                 StringBuffer_append(cmdline, args[j + 1] ? "%s " : "%s", args[j]);
-                        pt[i].cmdline = Str_dup(StringBuffer_toString(StringBuffer_trim(cmdline)));
+                        pt[i].cmdline = allocprocessstring(StringBuffer_toString(StringBuffer_trim(cmdline)));
                         StringBuffer_free(&cmdline);
                 }
                 if (! pt[i].cmdline || ! *pt[i].cmdline) {
-                        FREE(pt[i].cmdline);
-                        pt[i].cmdline = Str_dup(pinfo[i].p_comm);
+                        pt[i].cmdline = allocprocessstring(pinfo[i].p_comm);
                 }
         }
         FREE(pinfo);
@@ -169,7 +169,7 @@ int initprocesstree_sysdep(ProcessTree_T ** reference) {
         treesize = globbuf.gl_pathc;
 
         /* Allocate the tree */
-        pt = CALLOC(sizeof(ProcessTree_T), treesize);
+        pt = allocprocesstree(treesize);
 
         /* Insert data from /proc directory */
         for (int i = 0; i < treesize; i++) {
@@ -203,10 +203,9 @@ int initprocesstree_sysdep(ProcessTree_T ** reference) {
 
                 pt[i].mem_kbyte = psinfo->pr_rssize;
 
-                pt[i].cmdline  = Str_dup(psinfo->pr_psargs);
+                pt[i].cmdline  = allocprocessstring(psinfo->pr_psargs);
                 if (! pt[i].cmdline || ! *pt[i].cmdline) {
-                        FREE(pt[i].cmdline);
-                        pt[i].cmdline = Str_dup(psinfo->pr_fname);
+                        pt[i].cmdline = allocprocessstring(psinfo->pr_fname);
                 }
 
                 if (! read_proc_file(buf, sizeof(buf), "status", pt[i].pid, NULL)) {
@@ -272,7 +271,7 @@ boolean_t used_system_memory_sysdep(SystemInfo_T *si) {
                         /* Solaris Zone */
                         size_t nres;
                         vmusage_t result;
-                        if (getvmusage(VMUSAGE_ZONE, Run.polltime, &result, &nres) != 0) {
+                        if (getvmusage(VMUSAGE_ZONE, Run.polltime / 1000, &result, &nres) != 0) {
                                 LogError("system statistic error -- getvmusage failed\n");
                                 kstat_close(kctl);
                                 return false;
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include "monit.h"
+#include "profile.h"
+
+
+/**
+ * Implementation of the cycle profiler. The histogram buckets grow
+ * exponentially, four buckets per power of two, so a histogram covers
+ * the durations from 1 microsecond to about two minutes in 104 counters.
+ * The bucket index is derived from the position of the highest set bit
+ * and the next two bits of the duration.
+ *
+ * @file
+ */
+
+
+/* ------------------------------------------------------------- Definitions */
+
+
+static const char *stageNames[] = {"Cycle", "Event queue", "System load", "Process tree", "Connection retries", "Actions", "Async connections", "Services", "State save"};
+
+
+static struct {
+        Histogram_T stage[Profile_Stages];
+        long long current[Profile_Stages];  /**< Stage durations in this cycle */
+        struct {
+                Service_T service;
+                long long duration;
+        } slowest;                       /**< The slowest service in this cycle */
+} profile;
+
+
+static Mutex_T profilemutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ----------------------------------------------------------------- Private */
+
+
+static int _bucket(long long duration) {
+        if (duration < 4)
+                return duration > 0 ? (int)duration : 0;
+        int bit = 63 - __builtin_clzll((unsigned long long)duration);
+        int index = (bit - 1) * 4 + (int)((duration >> (bit - 2)) & 3);
+        return MIN(index, HISTOGRAM_BUCKETS - 1);
+}
+
+
+static long long _upper(int index) {
+        if (index < 4)
+                return index;
+        int bit = index / 4 + 1;
+        return ((4LL + index % 4 + 1) << (bit - 2)) - 1;
+}
+
+
+static void _record(Histogram_T *h, long long duration) {
+        duration = MAX(duration, 0);
+        h->count++;
+        h->sum += duration;
+        h->last = duration;
+        h->max = MAX(h->max, duration);
+        h->bucket[_bucket(duration)]++;
+}
+
+
+/* ------------------------------------------------------------------ Public */
+
+
+long long Profile_now() {
+#ifdef CLOCK_MONOTONIC
+        struct timespec t;
+        if (clock_gettime(CLOCK_MONOTONIC, &t) == 0)
+                return (long long)t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+#endif
+        struct timeval t2;
+        gettimeofday(&t2, NULL);
+        return (long long)t2.tv_sec * 1000000LL + t2.tv_usec;
+}
+
+
+void Profile_stage(Profile_Stage stage, long long start) {
+        ASSERT(stage < Profile_Stages);
+        long long duration = Profile_now() - start;
+        _record(&profile.stage[stage], duration);
+        profile.current[stage] += duration;
+}
+
+
+void Profile_service(Service_T s, long long start) {
+        ASSERT(s);
+        long long duration = Profile_now() - start;
+        /* The service is checked by one thread at a time, only the cycle maximum is shared */
+        _record(&s->latency, duration);
+        LOCK(profilemutex)
+        {
+                if (duration > profile.slowest.duration) {
+                        profile.slowest.service = s;
+                        profile.slowest.duration = duration;
+                }
+        }
+        END_LOCK;
+}
+
+
+void Profile_cycle(long long start) {
+        Histogram_T *cycle = &profile.stage[Profile_Cycle];
+        _record(cycle, Profile_now() - start);
+        if (Run.debug && cycle->last > Run.polltime * 1000LL) {
+                char buf[STRLEN] = {};
+                int length = 0;
+                for (int i = Profile_Events; i < Profile_Stages && length < (int)sizeof(buf); i++)
+                        length += snprintf(buf + length, sizeof(buf) - length, "%s%s %.3f ms", i > Profile_Events ? ", " : "", stageNames[i], profile.current[i] / 1000.);
+                DEBUG("Cycle overrun: the cycle took %.3f ms (poll time %d ms) -- %s; slowest service '%s' %.3f ms\n",
+                      cycle->last / 1000., Run.polltime, buf, profile.slowest.service ? profile.slowest.service->name : "", profile.slowest.duration / 1000.);
+        }
+        memset(profile.current, 0, sizeof(profile.current));
+        LOCK(profilemutex)
+        {
+                profile.slowest.service = NULL;
+                profile.slowest.duration = 0;
+        }
+        END_LOCK;
+}
+
+
+Histogram_T *Profile_histogram(Profile_Stage stage) {
+        ASSERT(stage < Profile_Stages);
+        return &profile.stage[stage];
+}
+
+
+const char *Profile_name(Profile_Stage stage) {
+        ASSERT(stage < Profile_Stages);
+        return stageNames[stage];
+}
+
+
+long long Profile_percentile(Histogram_T *h, double percentile) {
+        ASSERT(h);
+        if (! h->count)
+                return 0;
+        /* The rank of the percentile, rounded up */
+        unsigned long long rank = (h->count * (unsigned long long)(percentile * 100) + 9999) / 10000;
+        if (rank < 1)
+                rank = 1;
+        unsigned long long seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                seen += h->bucket[i];
+                if (seen >= rank)
+                        return MIN(_upper(i), h->max);
+        }
+        return h->max;
+}
+
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+
+
+#ifndef MONIT_PROFILE_H
+#define MONIT_PROFILE_H
+
+
+/**
+ * Cycle profiler.
+ *
+ * The stages of the validation cycle and the checks of each service are
+ * timed on the monotonic clock and the durations are collected into latency
+ * histograms, from which the percentiles are read for the status pages. If
+ * a cycle takes longer than the poll time, the durations of the stages and
+ * the slowest service of the cycle are logged on the debug level.
+ *
+ *  @file
+ */
+
+
+typedef enum {
+        Profile_Cycle = 0,
+        Profile_Events,
+        Profile_SystemLoad,
+        Profile_ProcessTree,
+        Profile_Retries,
+        Profile_Actions,
+        Profile_Probes,
+        Profile_Services,
+        Profile_StateSave,
+        Profile_Stages
+} Profile_Stage;
+
+
+/**
+ * Get the profiler time
+ * @return Monotonic time in microseconds
+ */
+long long Profile_now();
+
+
+/**
+ * Record the duration of a cycle stage
+ * @param stage The stage
+ * @param start The stage start time from Profile_now()
+ */
+void Profile_stage(Profile_Stage stage, long long start);
+
+
+/**
+ * Record the duration of a service check
+ * @param s The service
+ * @param start The check start time from Profile_now()
+ */
+void Profile_service(Service_T s, long long start);
+
+
+/**
+ * Record the duration of the whole cycle and log the stages if the cycle
+ * took longer than the poll time
+ * @param start The cycle start time from Profile_now()
+ */
+void Profile_cycle(long long start);
+
+
+/**
+ * Get the histogram of a cycle stage
+ * @param stage The stage
+ * @return The histogram
+ */
+Histogram_T *Profile_histogram(Profile_Stage stage);
+
+
+/**
+ * Get the stage name
+ * @param stage The stage
+ * @return The name
+ */
+const char *Profile_name(Profile_Stage stage);
+
+
+/**
+ * Get a percentile from the histogram. The value is the upper bound of the
+ * bucket holding the percentile, so it is accurate to about 20 percent
+ * @param h The histogram
+ * @param percentile The percentile (0-100)
+ * @return The duration in microseconds, 0 if there are no samples
+ */
+long long Profile_percentile(Histogram_T *h, double percentile);
+
+
+#endif
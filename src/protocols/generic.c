@@ -101,32 +101,17 @@ void check_generic(Socket_T socket) {
                         int timeout = Socket_getTimeout(socket);
                         Socket_setTimeout(socket, 200);
                         int n = Socket_read(socket, buf + 1, Run.expectbuffer - 1) + 1;
-                        buf[n] = 0;
-                        if (n > 0)
-                                _escapeZeroInExpectBuffer(buf, n);
                         Socket_setTimeout(socket, timeout); // Reset back original timeout for next send/expect
-#ifdef HAVE_REGEX_H
-                        int regex_return = regexec(g->expect, buf, 0, NULL, 0);
-                        if (regex_return != 0) {
-                                char e[STRLEN];
-                                regerror(regex_return, g->expect, e, STRLEN);
-                                FREE(buf);
-                                THROW(IOException, "GENERIC: received unexpected data -- %s", e);
-                        } else {
-                                DEBUG("GENERIC: successfully received: '%s'\n", Str_trunc(buf, STRLEN - 4));
+                        TRY
+                        {
+                                check_generic_expect(g, buf, n);
                         }
-
-#else
-                        /* w/o regex support */
-
-                        if (strncmp(buf, g->expect, strlen(g->expect)) != 0) {
+                        ELSE
+                        {
                                 FREE(buf);
-                                THROW(IOException, "GENERIC: received unexpected data");
-                        } else {
-                                DEBUG("GENERIC: successfully received: '%s'\n", Str_trunc(buf, STRLEN - 4));
+                                RETHROW;
                         }
-
-#endif
+                        END_TRY;
 
                 } else {
                         /* This should not happen */
@@ -138,3 +123,27 @@ void check_generic(Socket_T socket) {
         FREE(buf);
 }
 
+
+void check_generic_expect(Generic_T g, char *buf, int n) {
+        ASSERT(g);
+        ASSERT(buf);
+        buf[n] = 0;
+        if (n > 0)
+                _escapeZeroInExpectBuffer(buf, n);
+#ifdef HAVE_REGEX_H
+        int regex_return = regexec(g->expect, buf, 0, NULL, 0);
+        if (regex_return != 0) {
+                char e[STRLEN];
+                regerror(regex_return, g->expect, e, STRLEN);
+                THROW(IOException, "GENERIC: received unexpected data -- %s", e);
+        } else {
+                DEBUG("GENERIC: successfully received: '%s'\n", Str_trunc(buf, STRLEN - 4));
+        }
+#else
+        /* w/o regex support */
+        if (strncmp(buf, g->expect, strlen(g->expect)) != 0)
+                THROW(IOException, "GENERIC: received unexpected data");
+        else
+                DEBUG("GENERIC: successfully received: '%s'\n", Str_trunc(buf, STRLEN - 4));
+#endif
+}
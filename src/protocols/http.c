@@ -77,37 +77,17 @@ static boolean_t _hasHeader(List_T list, const char *name) {
 }
 
 
-static void do_regex(Socket_T socket, int content_length, Request_T R) {
+/**
+ * Match the content against the regular expression of the request
+ */
+static void _checkContent(Request_T R, const char *buf) {
         boolean_t rv = false;
-
-        if (content_length == 0)
-                THROW(IOException, "HTTP error: No content returned from server");
-        else if (content_length < 0 || content_length > HTTP_CONTENT_MAX) /* content_length < 0 if no Content-Length header was found */
-                content_length = HTTP_CONTENT_MAX;
-
         char error[STRLEN];
-        int size = 0, length = content_length, buflen = content_length + 1;
-        char *buf = ALLOC(buflen);
-        do {
-                int n = Socket_read(socket, &buf[size], length);
-                if (n <= 0)
-                        break;
-                size += n;
-                length -= n;
-        } while (length > 0);
-
-        if (size == 0) {
-                snprintf(error, sizeof(error), "Receiving data -- %s", STRERROR);
-                goto error;
-        }
-        buf[size] = 0;
-
 #ifdef HAVE_REGEX_H
         int regex_return = regexec(R->regex, buf, 0, NULL, 0);
 #else
         int regex_return = strstr(buf, R->regex) ? 0 : 1;
 #endif
-        FREE(buf);
         switch (R->operator) {
                 case Operator_Equal:
                         if (regex_return == 0) {
@@ -135,16 +115,55 @@ static void do_regex(Socket_T socket, int content_length, Request_T R) {
                         snprintf(error, sizeof(error), "Invalid content operator");
                         break;
         }
-
-error:
         if (! rv)
                 THROW(IOException, "HTTP error: %s", error);
 }
 
 
+static void do_regex(Socket_T socket, int content_length, Request_T R) {
+        if (content_length == 0)
+                THROW(IOException, "HTTP error: No content returned from server");
+        else if (content_length < 0 || content_length > HTTP_CONTENT_MAX) /* content_length < 0 if no Content-Length header was found */
+                content_length = HTTP_CONTENT_MAX;
+
+        int size = 0, length = content_length, buflen = content_length + 1;
+        char *buf = ALLOC(buflen);
+        do {
+                int n = Socket_read(socket, &buf[size], length);
+                if (n <= 0)
+                        break;
+                size += n;
+                length -= n;
+        } while (length > 0);
+
+        if (size == 0) {
+                FREE(buf);
+                THROW(IOException, "HTTP error: Receiving data -- %s", STRERROR);
+        }
+        buf[size] = 0;
+        TRY
+        {
+                _checkContent(R, buf);
+        }
+        FINALLY
+        {
+                FREE(buf);
+        }
+        END_TRY;
+}
+
+
+static void _compareChecksum(MD_T hash, int keylength, char *checksum) {
+        MD_T result;
+        if (strncasecmp(Util_digest2Bytes((unsigned char *)hash, keylength, result), checksum, keylength * 2) != 0)
+                THROW(IOException, "HTTP checksum error: Document checksum mismatch");
+        DEBUG("HTTP: Succeeded testing document checksum\n");
+}
+
+
 static void check_request_checksum(Socket_T socket, int content_length, char *checksum, Hash_Type hashtype) {
         int n, keylength = 0;
-        MD_T result, hash;
+        MD_T hash;
         md5_context_t ctx_md5;
         sha1_context_t ctx_sha1;
         char buf[8192];
@@ -180,9 +199,7 @@ static void check_request_checksum(Socket_T socket, int content_length, char *ch
                 default:
                         THROW(IOException, "HTTP checksum error: Unknown hash type");
         }
-        if (strncasecmp(Util_digest2Bytes((unsigned char *)hash, keylength, result), checksum, keylength * 2) != 0)
-                THROW(IOException, "HTTP checksum error: Document checksum mismatch");
-        DEBUG("HTTP: Succeeded testing document checksum\n");
+        _compareChecksum(hash, keylength, checksum);
 }
 
 
@@ -248,17 +265,10 @@ static char *get_auth_header(Port_T P, char *auth, int l) {
 }
 
 
-/* ------------------------------------------------------------------ Public */
-
-
-void check_http(Socket_T socket) {
-
-        ASSERT(socket);
-
-        Port_T P = Socket_getPort(socket);
-        ASSERT(P);
-
-        StringBuffer_T sb = StringBuffer_create(168);
+/**
+ * Build the request for the port
+ */
+static void _buildRequest(StringBuffer_T sb, Port_T P, const char *host) {
         StringBuffer_append(sb,
                             "GET %s HTTP/1.1\r\n"
                             "Accept: */*\r\n"
@@ -266,7 +276,7 @@ void check_http(Socket_T socket) {
                             P->parameters.http.request ? P->parameters.http.request : "/",
                             get_auth_header(P, (char[STRLEN]){0}, STRLEN));
         if (! _hasHeader(P->parameters.http.headers, "Host"))
-                StringBuffer_append(sb, "Host: %s\r\n", Util_getHTTPHostHeader(socket, (char[STRLEN]){}, STRLEN));
+                StringBuffer_append(sb, "Host: %s\r\n", host);
         if (! _hasHeader(P->parameters.http.headers, "User-Agent"))
                 StringBuffer_append(sb, "User-Agent: Monit/%s\r\n", VERSION);
         // Add headers if we have them
@@ -277,6 +287,20 @@ void check_http(Socket_T socket) {
                 }
         }
         StringBuffer_append(sb, "\r\n");
+}
+
+
+/* ------------------------------------------------------------------ Public */
+
+
+void check_http(Socket_T socket) {
+        ASSERT(socket);
+
+        Port_T P = Socket_getPort(socket);
+        ASSERT(P);
+
+        StringBuffer_T sb = StringBuffer_create(168);
+        _buildRequest(sb, P, Util_getHTTPHostHeader(socket, (char[STRLEN]){}, STRLEN));
         int send_status = Socket_write(socket, (void*)StringBuffer_toString(sb), StringBuffer_length(sb));
         StringBuffer_free(&sb);
         if (send_status < 0)
@@ -284,3 +308,88 @@ void check_http(Socket_T socket) {
         check_request(socket, P);
 }
 
+
+void check_http_request(Port_T P, StringBuffer_T sb) {
+        ASSERT(P);
+        ASSERT(sb);
+        char host[STRLEN];
+        if (P->target.net.port == 80)
+                snprintf(host, sizeof(host), "%s", P->hostname);
+        else
+                snprintf(host, sizeof(host), "%s:%d", P->hostname, P->target.net.port);
+        _buildRequest(sb, P, host);
+}
+
+
+boolean_t check_http_response(Port_T P, char *response, int length, boolean_t eof) {
+        ASSERT(P);
+        ASSERT(response);
+        int status, content_length = -1;
+        char *body = strstr(response, "\r\n\r\n");
+        if (body) {
+                body += 4;
+        } else if ((body = strstr(response, "\n\n"))) {
+                body += 2;
+        } else {
+                if (eof)
+                        THROW(IOException, "HTTP: Error receiving data -- %s", length ? "incomplete response header" : "no data");
+                return false;
+        }
+        if (sscanf(response, "%*s %d", &status) != 1)
+                THROW(IOException, "HTTP error: Cannot parse HTTP status in response: %.*s", (int)strcspn(response, "\r\n"), response);
+        if (! Util_evalQExpression(P->parameters.http.operator, status, P->parameters.http.status ? P->parameters.http.status : 400))
+                THROW(IOException, "HTTP error: Server returned status %d", status);
+        for (char *header = strchr(response, '\n'); header && header + 1 < body; header = strchr(header + 1, '\n')) {
+                if (Str_startsWith(header + 1, "Content-Length")) {
+                        if (sscanf(header + 1, "%*s%*[: ]%d", &content_length) != 1 || content_length < 0)
+                                THROW(IOException, "HTTP error: Illegal Content-Length response header");
+                }
+        }
+        boolean_t content = P->url_request && P->url_request->regex;
+        if (! content && ! P->parameters.http.checksum)
+                return true;
+        if (P->parameters.http.checksum && content_length > HTTP_CONTENT_MAX)
+                THROW(IOException, "HTTP checksum error: Document too large (%d bytes)", content_length);
+        /* Wait for the whole content, until the connection is closed if the length is unknown */
+        int body_length = length - (int)(body - response);
+        if (! eof && (content_length < 0 || body_length < content_length))
+                return false;
+        if (content_length >= 0 && body_length > content_length)
+                body_length = content_length;
+        body[body_length] = 0;
+        if (content) {
+                if (content_length == 0 || body_length == 0)
+                        THROW(IOException, "HTTP error: No content returned from server");
+                _checkContent(P->url_request, body);
+        }
+        if (P->parameters.http.checksum) {
+                if (content_length <= 0) {
+                        DEBUG("HTTP warning: Response does not contain a valid Content-Length -- cannot compute checksum\n");
+                } else {
+                        MD_T hash;
+                        switch (P->parameters.http.hashtype) {
+                                case Hash_Md5:
+                                {
+                                        md5_context_t ctx_md5;
+                                        md5_init(&ctx_md5);
+                                        md5_append(&ctx_md5, (const md5_byte_t *)body, body_length);
+                                        md5_finish(&ctx_md5, (md5_byte_t *)hash);
+                                        _compareChecksum(hash, 16, P->parameters.http.checksum);
+                                        break;
+                                }
+                                case Hash_Sha1:
+                                {
+                                        sha1_context_t ctx_sha1;
+                                        sha1_init(&ctx_sha1);
+                                        sha1_append(&ctx_sha1, (md5_byte_t *)body, body_length);
+                                        sha1_finish(&ctx_sha1, (md5_byte_t *)hash);
+                                        _compareChecksum(hash, 20, P->parameters.http.checksum);
+                                        break;
+                                }
+                                default:
+                                        THROW(IOException, "HTTP checksum error: Unknown hash type");
+                        }
+                }
+        }
+        return true;
+}
@@ -100,6 +100,26 @@ void check_memcache(Socket_T);
 void check_websocket(Socket_T);
 
 
+/*
+ * Verify the data received for the generic expect step. The buffer must have
+ * space for the terminating zero after n bytes
+ */
+void check_generic_expect(Generic_T g, char *buf, int n);
+
+
+/*
+ * Append the http request for the port to the string buffer
+ */
+void check_http_request(Port_T P, StringBuffer_T sb);
+
+
+/*
+ * Verify the http response received so far. Returns false if more data are
+ * needed (and the connection was not closed), throws IOException on error
+ */
+boolean_t check_http_response(Port_T P, char *response, int length, boolean_t eof);
+
+
 /*
  * Returns a protocol object for the given protocol type
  */
@@ -0,0 +1,709 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+
+
+#include "config.h"
+
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
+#include "monit.h"
+#include "event.h"
+#include "queue.h"
+
+// libmonit
+#include "io/File.h"
+
+
+/**
+ * Implementation of the event queue. The queue directory holds the log
+ * segments "segment.<number>" and the "cursor" file with the position of
+ * each handler in the log. The events are appended to the last segment
+ * as records of a fixed header followed by the source service name and
+ * the message. A new segment is started when the last one reaches
+ * QUEUE_SEGMENT bytes, or when all events were delivered, so the delivered
+ * segments can be removed. The records are checksummed, a record which was
+ * partially written when Monit stopped is truncated when the queue is
+ * opened.
+ *
+ * @file
+ */
+
+
+/* ------------------------------------------------------------- Definitions */
+
+
+#define QUEUE_MAGIC    0x4d514531  /* "MQE1" */
+#define QUEUE_SEGMENT  1048576
+#define QUEUE_RECORD   65536
+#define QUEUE_HANDLERS 2
+
+
+typedef struct {
+        uint32_t magic;
+        uint32_t length;                /**< Record length including the header */
+        uint32_t checksum;       /**< FNV-1a hash of the record, zero checksum */
+        uint32_t count;                                      /**< The event rate */
+        uint64_t id;                               /**< The event identification */
+        int64_t  sec;                                  /**< When the event occured */
+        int32_t  usec;
+        uint32_t message;                              /**< Length of the message */
+        uint16_t source;                    /**< Length of the source service name */
+        uint8_t  flag;                  /**< Handlers which have to deliver the event */
+        uint8_t  state;                                          /**< Event state */
+        uint8_t  changed;                       /**< true if the event state changed */
+        uint8_t  mode;                                     /**< Service monitor mode */
+        uint8_t  type;                                             /**< Service type */
+        uint8_t  action;                                         /**< Event action */
+} Record_T;
+
+
+typedef struct {
+        uint64_t segment;
+        uint64_t offset;
+} Cursor_T;
+
+
+static const Handler_Type handlers[QUEUE_HANDLERS] = {Handler_Alert, Handler_Mmonit};
+static const char *handlerNames[QUEUE_HANDLERS] = {"Alert", "M/Monit"};
+
+
+static struct {
+        char *dir;                                   /**< The open queue directory */
+        int fd;                          /**< The last segment, open for appending */
+        uint64_t first;                                     /**< The oldest segment */
+        uint64_t segment;                                     /**< The last segment */
+        off_t size;                                      /**< The last segment size */
+        int count;                                  /**< Number of queued events */
+        boolean_t dirty;                     /**< Data not flushed to the disk yet */
+        unsigned generation;                  /**< Incremented when the queue is opened */
+        boolean_t delivering[QUEUE_HANDLERS];    /**< Handler delivery in progress */
+        struct {
+                int fd;
+                Cursor_T cursor[QUEUE_HANDLERS];
+        } cursors;                                   /**< Handler delivery cursors */
+        struct {
+                int fd;
+                uint64_t segment;
+                off_t size;
+        } reader;                                       /**< The segment being read */
+        char data[QUEUE_RECORD];                         /**< The record being read */
+} queue = {.fd = -1, .cursors.fd = -1, .reader.fd = -1};
+
+
+static Mutex_T queuemutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ----------------------------------------------------------------- Private */
+
+
+static uint32_t _hash(uint32_t hash, const void *data, size_t size) {
+        for (const unsigned char *p = data; size--; p++)
+                hash = (hash ^ *p) * 16777619u;
+        return hash;
+}
+
+
+static uint32_t _checksum(Record_T *r, const char *source, const char *message) {
+        Record_T header = *r;
+        header.checksum = 0;
+        uint32_t hash = _hash(2166136261u, &header, sizeof(header));
+        hash = _hash(hash, source, r->source);
+        return _hash(hash, message, r->message);
+}
+
+
+static void _segmentPath(char *path, int size, uint64_t segment) {
+        snprintf(path, size, "%s/segment.%llu", queue.dir, (unsigned long long)segment);
+}
+
+
+/*
+ * Return true if the name is not a log file, but an event file of the
+ * previous queue format
+ */
+static boolean_t _isLegacy(const char *name) {
+        return *name != '.' && ! Str_isEqual(name, "cursor") && ! Str_startsWith(name, "segment.");
+}
+
+
+/*
+ * Return true if the cursor moved past the record at the given position
+ */
+static boolean_t _passed(Cursor_T *c, uint64_t segment, off_t offset) {
+        return c->segment > segment || (c->segment == segment && c->offset > (uint64_t)offset);
+}
+
+
+/*
+ * Return true if some other handler than h didn't deliver the record yet
+ */
+static boolean_t _pending(int h, uint64_t segment, off_t offset, int flag) {
+        for (int i = 0; i < QUEUE_HANDLERS; i++)
+                if (i != h && (flag & handlers[i]) && ! _passed(&queue.cursors.cursor[i], segment, offset))
+                        return true;
+        return false;
+}
+
+
+static void _flush() {
+        if (queue.fd >= 0 && fsync(queue.fd))
+                LogError("Event queue: cannot flush the segment -- %s\n", STRERROR);
+        if (queue.cursors.fd >= 0 && fsync(queue.cursors.fd))
+                LogError("Event queue: cannot flush the cursors -- %s\n", STRERROR);
+        queue.dirty = false;
+}
+
+
+static void _closeReader() {
+        if (queue.reader.fd >= 0) {
+                close(queue.reader.fd);
+                queue.reader.fd = -1;
+        }
+}
+
+
+/*
+ * Open the segment for reading. The readable end of the last segment is
+ * the end of the last appended record, a partial record at the end of the
+ * file is not read
+ * @return The file descriptor or -1 if the segment doesn't exist
+ */
+static int _reader(uint64_t segment, off_t *end) {
+        if (queue.reader.fd < 0 || queue.reader.segment != segment) {
+                char path[PATH_MAX];
+                _closeReader();
+                _segmentPath(path, sizeof(path), segment);
+                if ((queue.reader.fd = open(path, O_RDONLY)) < 0) {
+                        if (errno != ENOENT)
+                                LogError("Event queue: cannot open the segment %s -- %s\n", path, STRERROR);
+                        return -1;
+                }
+                struct stat st;
+                queue.reader.segment = segment;
+                queue.reader.size = fstat(queue.reader.fd, &st) ? 0 : st.st_size;
+        }
+        *end = (segment == queue.segment && queue.fd >= 0) ? queue.size : queue.reader.size;
+        return queue.reader.fd;
+}
+
+
+/*
+ * Read the record at the offset, the source and message are read to
+ * queue.data
+ * @return The record length or 0 if there is no valid record
+ */
+static int _read(int fd, off_t offset, off_t end, Record_T *r) {
+        if (end - offset < (off_t)sizeof(Record_T) || pread(fd, r, sizeof(Record_T), offset) != sizeof(Record_T))
+                return 0;
+        if (r->magic != QUEUE_MAGIC || r->length != sizeof(Record_T) + r->source + r->message || r->length > QUEUE_RECORD || offset + r->length > end)
+                return 0;
+        ssize_t size = r->length - sizeof(Record_T);
+        if (size > 0 && pread(fd, queue.data, size, offset + sizeof(Record_T)) != size)
+                return 0;
+        if (_checksum(r, queue.data, queue.data + r->source) != r->checksum)
+                return 0;
+        return r->length;
+}
+
+
+static void _saveCursors() {
+        if (pwrite(queue.cursors.fd, queue.cursors.cursor, sizeof(queue.cursors.cursor), 0) != sizeof(queue.cursors.cursor))
+                LogError("Event queue: cannot save the delivery cursors -- %s\n", STRERROR);
+        queue.dirty = true;
+        if (Run.eventlist_sync == Sync_Always)
+                _flush();
+}
+
+
+static boolean_t _loadCursors() {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/cursor", queue.dir);
+        if ((queue.cursors.fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+                LogError("Event queue: cannot open the cursor file %s -- %s\n", path, STRERROR);
+                return false;
+        }
+        boolean_t valid = pread(queue.cursors.fd, queue.cursors.cursor, sizeof(queue.cursors.cursor), 0) == sizeof(queue.cursors.cursor);
+        for (int i = 0; i < QUEUE_HANDLERS; i++) {
+                Cursor_T *c = &queue.cursors.cursor[i];
+                if (! valid || c->segment < queue.first || c->segment > queue.segment) {
+                        c->segment = queue.first;
+                        c->offset = 0;
+                }
+        }
+        return true;
+}
+
+
+static boolean_t _openSegment() {
+        char path[PATH_MAX];
+        _segmentPath(path, sizeof(path), queue.segment);
+        if ((queue.fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600)) < 0) {
+                LogError("Event queue: cannot open the segment %s -- %s\n", path, STRERROR);
+                return false;
+        }
+        struct stat st;
+        queue.size = fstat(queue.fd, &st) ? 0 : st.st_size;
+        return true;
+}
+
+
+/*
+ * Start a new segment
+ */
+static boolean_t _rotate() {
+        if (queue.fd >= 0) {
+                if (queue.dirty && Run.eventlist_sync != Sync_Never)
+                        _flush();
+                close(queue.fd);
+                queue.fd = -1;
+        }
+        if (queue.reader.segment == queue.segment)
+                _closeReader();
+        queue.segment++;
+        return _openSegment();
+}
+
+
+/*
+ * Count the queued events of the record
+ */
+static void _count(Record_T *r, uint64_t segment, off_t offset) {
+        boolean_t queued = false;
+        for (int i = 0; i < QUEUE_HANDLERS; i++) {
+                if ((r->flag & handlers[i]) && ! _passed(&queue.cursors.cursor[i], segment, offset)) {
+                        Run.handler_queue[handlers[i]]++;
+                        queued = true;
+                }
+        }
+        if (queued)
+                queue.count++;
+}
+
+
+/*
+ * Read the log, count the queued events and truncate the partially written
+ * record at the end of the last segment
+ */
+static void _scan() {
+        for (uint64_t segment = queue.first; segment <= queue.segment; segment++) {
+                off_t end, offset = 0;
+                int fd = _reader(segment, &end);
+                if (fd < 0)
+                        continue;
+                Record_T r;
+                for (int length; (length = _read(fd, offset, end, &r)); offset += length)
+                        _count(&r, segment, offset);
+                if (offset < end) {
+                        char path[PATH_MAX];
+                        _segmentPath(path, sizeof(path), segment);
+                        LogError("Event queue: invalid record at offset %lld of the segment %s, %lld bytes dropped\n", (long long)offset, path, (long long)(end - offset));
+                        if (segment == queue.segment && truncate(path, offset))
+                                LogError("Event queue: cannot truncate the segment %s -- %s\n", path, STRERROR);
+                }
+        }
+        _closeReader();
+}
+
+
+static boolean_t _append(Event_T E, Action_Type action) {
+        if (Run.eventlist_slots >= 0 && queue.count >= Run.eventlist_slots) {
+                LogError("Event queue is full\n");
+                return false;
+        }
+        if ((queue.fd < 0 || queue.size >= QUEUE_SEGMENT) && ! _rotate())
+                return false;
+        size_t source = E->source ? MIN(strlen(E->source), STRLEN) : 0;
+        size_t message = E->message ? MIN(strlen(E->message), QUEUE_RECORD - sizeof(Record_T) - STRLEN) : 0;
+        Record_T r = {
+                .magic = QUEUE_MAGIC,
+                .length = sizeof(Record_T) + source + message,
+                .count = E->count,
+                .id = E->id,
+                .sec = E->collected.tv_sec,
+                .usec = E->collected.tv_usec,
+                .message = message,
+                .source = source,
+                .flag = E->flag,
+                .state = E->state,
+                .changed = E->state_changed,
+                .mode = E->mode,
+                .type = E->type,
+                .action = action
+        };
+        r.checksum = _checksum(&r, E->source, E->message);
+        struct iovec iov[3] = {
+                {.iov_base = &r, .iov_len = sizeof(r)},
+                {.iov_base = E->source, .iov_len = source},
+                {.iov_base = E->message, .iov_len = message}
+        };
+        ssize_t n = writev(queue.fd, iov, 3);
+        if (n != (ssize_t)r.length) {
+                LogError("Event queue: cannot write the event -- %s\n", n < 0 ? STRERROR : "short write");
+                if (n > 0 && ftruncate(queue.fd, queue.size))
+                        LogError("Event queue: cannot truncate the segment -- %s\n", STRERROR);
+                return false;
+        }
+        queue.size += n;
+        queue.dirty = true;
+        if (Run.eventlist_sync == Sync_Always)
+                _flush();
+        _count(&r, queue.segment, queue.size - n);
+        return true;
+}
+
+
+/*
+ * Append the event file of the previous queue format to the log
+ */
+static boolean_t _migrateFile(const char *path) {
+        FILE *file = fopen(path, "r");
+        if (! file) {
+                LogError("Event queue: cannot open the event file %s -- %s\n", path, STRERROR);
+                return false;
+        }
+        boolean_t rv = false;
+        size_t size;
+        Event_T e = NULL;
+        Action_Type *action = NULL;
+        int *version = file_readQueue(file, &size);
+        if (! version || size != sizeof(int) || *version != EVENT_VERSION)
+                goto error;
+        if (! (e = file_readQueue(file, &size)))
+                goto error;
+        if (size != sizeof(*e)) {
+                FREE(e);
+                goto error;
+        }
+        e->source = e->message = NULL;
+        if (! (e->source = file_readQueue(file, &size)) || ! (e->message = file_readQueue(file, &size)))
+                goto error;
+        if (! (action = file_readQueue(file, &size)) || size != sizeof(Action_Type))
+                goto error;
+        rv = _append(e, *action);
+error:
+        if (e) {
+                FREE(e->source);
+                FREE(e->message);
+                FREE(e);
+        }
+        FREE(action);
+        FREE(version);
+        fclose(file);
+        return rv;
+}
+
+
+/*
+ * Move the event files of the previous queue format to the log
+ */
+static void _migrate() {
+        DIR *dir = opendir(queue.dir);
+        if (! dir) {
+                LogError("Event queue: cannot open the directory %s -- %s\n", queue.dir, STRERROR);
+                return;
+        }
+        int migrated = 0;
+        for (struct dirent *de; (de = readdir(dir));) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", queue.dir, de->d_name);
+                if (! _isLegacy(de->d_name) || ! File_isFile(path))
+                        continue;
+                if (! _migrateFile(path))
+                        LogError("Event queue: skipping the event file %s -- unknown data format\n", path);
+                else if (unlink(path) < 0)
+                        LogError("Event queue: cannot remove the event file %s -- %s\n", path, STRERROR);
+                else
+                        migrated++;
+        }
+        closedir(dir);
+        if (migrated)
+                LogInfo("Event queue: %d queued events moved from the event files to the log\n", migrated);
+}
+
+
+static void _close() {
+        if (queue.fd >= 0) {
+                if (queue.dirty && Run.eventlist_sync != Sync_Never)
+                        _flush();
+                close(queue.fd);
+                queue.fd = -1;
+        }
+        if (queue.cursors.fd >= 0) {
+                close(queue.cursors.fd);
+                queue.cursors.fd = -1;
+        }
+        _closeReader();
+        queue.dirty = false;
+        FREE(queue.dir);
+}
+
+
+/*
+ * Open the queue in the event queue directory if it is not open yet, or
+ * reopen it after the configuration was reloaded. The queued events are
+ * counted in the handler queue counters
+ */
+static boolean_t _open() {
+        if (queue.dir && ! (Run.flags & Run_HandlerInit) && IS(queue.dir, Run.eventlist_dir))
+                return true;
+        _close();
+        if (! Run.eventlist_dir || ! file_checkQueueDirectory(Run.eventlist_dir))
+                return false;
+        DIR *dir = opendir(Run.eventlist_dir);
+        if (! dir) {
+                LogError("Event queue: cannot open the directory %s -- %s\n", Run.eventlist_dir, STRERROR);
+                return false;
+        }
+        boolean_t legacy = false;
+        unsigned long long first = 0, last = 0;
+        for (struct dirent *de; (de = readdir(dir));) {
+                unsigned long long segment;
+                if (sscanf(de->d_name, "segment.%llu", &segment) == 1 && segment > 0) {
+                        if (! first || segment < first)
+                                first = segment;
+                        if (segment > last)
+                                last = segment;
+                } else if (_isLegacy(de->d_name)) {
+                        legacy = true;
+                }
+        }
+        closedir(dir);
+        queue.dir = Str_dup(Run.eventlist_dir);
+        queue.first = first ? first : 1;
+        queue.segment = last ? last : 1;
+        queue.count = 0;
+        for (int i = 0; i < QUEUE_HANDLERS; i++)
+                Run.handler_queue[handlers[i]] = 0;
+        if (! _loadCursors()) {
+                _close();
+                return false;
+        }
+        _scan();
+        if (! _openSegment()) {
+                _close();
+                return false;
+        }
+        if (legacy)
+                _migrate();
+        Run.flags &= ~Run_HandlerInit;
+        queue.generation++;
+        DEBUG("Event queue %s: %d events queued\n", queue.dir, queue.count);
+        return true;
+}
+
+
+/*
+ * Remove the segments which all handlers delivered. If all events were
+ * delivered, a new segment is started so the last one can be removed too
+ */
+static void _collect() {
+        if (queue.count == 0 && queue.size > 0 && _rotate()) {
+                for (int i = 0; i < QUEUE_HANDLERS; i++) {
+                        queue.cursors.cursor[i].segment = queue.segment;
+                        queue.cursors.cursor[i].offset = 0;
+                }
+                _saveCursors();
+        }
+        uint64_t keep = queue.segment;
+        for (int i = 0; i < QUEUE_HANDLERS; i++)
+                keep = MIN(keep, queue.cursors.cursor[i].segment);
+        if (queue.reader.segment < keep)
+                _closeReader();
+        for (; queue.first < keep; queue.first++) {
+                char path[PATH_MAX];
+                _segmentPath(path, sizeof(path), queue.first);
+                if (unlink(path) < 0 && errno != ENOENT)
+                        LogError("Event queue: cannot remove the segment %s -- %s\n", path, STRERROR);
+        }
+}
+
+
+/*
+ * Read the record at the cursor. At the end of a segment the cursor moves
+ * to the next segment
+ * @return false if the cursor is at the end of the log
+ */
+static boolean_t _next(Cursor_T *c, Record_T *r) {
+        while (c->segment <= queue.segment) {
+                off_t end;
+                int fd = _reader(c->segment, &end);
+                if (fd >= 0 && c->offset < (uint64_t)end) {
+                        if (_read(fd, c->offset, end, r))
+                                return true;
+                        LogError("Event queue: invalid record at offset %llu of the segment %llu, skipping the rest of the segment\n", (unsigned long long)c->offset, (unsigned long long)c->segment);
+                        /* Don't append behind the invalid record, the events wouldn't be read */
+                        if (c->segment == queue.segment && ! _rotate())
+                                return false;
+                } else if (c->segment == queue.segment) {
+                        return false;
+                }
+                c->segment++;
+                c->offset = 0;
+        }
+        return false;
+}
+
+
+/*
+ * Deliver the record. The record is copied and the queue is unlocked while
+ * the handler runs, so a slow mail server or M/Monit doesn't block the
+ * events being queued meanwhile
+ */
+static Handler_Type _deliver(Record_T *r, Queue_Handler deliver) {
+        struct myaction a = {.id = r->action};
+        struct myeventaction ea = {.failed = &a, .succeeded = &a, .slot = -1};
+        struct myevent e = {
+                .id = r->id,
+                .collected = {.tv_sec = r->sec, .tv_usec = r->usec},
+                .source = Str_ndup(queue.data, r->source),
+                .mode = r->mode,
+                .type = r->type,
+                .state = r->state,
+                .state_changed = r->changed,
+                .flag = r->flag,
+                .count = r->count,
+                .message = Str_ndup(queue.data + r->source, r->message),
+                .action = &ea
+        };
+        LogInfo("Processing queued event of '%s'\n", e.source);
+        Mutex_unlock(queuemutex);
+        Handler_Type rv = deliver(&e);
+        Mutex_lock(queuemutex);
+        FREE(e.source);
+        FREE(e.message);
+        return rv;
+}
+
+
+/* ------------------------------------------------------------------ Public */
+
+
+boolean_t Queue_add(Event_T E) {
+        ASSERT(E);
+        ASSERT(E->flag != Handler_Succeeded);
+        boolean_t rv = false;
+        LOCK(queuemutex)
+        {
+                if (_open()) {
+                        LogInfo("Adding event to the queue %s for later delivery\n", queue.dir);
+                        rv = _append(E, Event_get_action(E));
+                }
+        }
+        END_LOCK;
+        return rv;
+}
+
+
+void Queue_process(Handler_Type handler, Queue_Handler deliver) {
+        ASSERT(deliver);
+        int h = handler == Handler_Alert ? 0 : 1;
+        LOCK(queuemutex)
+        {
+                if (! queue.delivering[h] && _open()) {
+                        queue.delivering[h] = true;
+                        Cursor_T *c = &queue.cursors.cursor[h];
+                        Cursor_T start = *c;
+                        Record_T r;
+                        if (Run.handler_queue[handler])
+                                DEBUG("Processing postponed events queue of the %s handler\n", handlerNames[h]);
+                        while (Run.handler_queue[handler] && ! (Run.handler_flag & handler) && _next(c, &r)) {
+                                if (r.flag & handler) {
+                                        unsigned generation = queue.generation;
+                                        Handler_Type rv = _deliver(&r, deliver);
+                                        /* The queue was reopened while unlocked, the cursors were reloaded from the disk */
+                                        if (queue.generation != generation)
+                                                break;
+                                        if (rv == handler) {
+                                                LogError("%s handler failed, retry scheduled for next cycle\n", handlerNames[h]);
+                                                Run.handler_flag |= handler;
+                                                break;
+                                        }
+                                        Run.handler_queue[handler]--;
+                                        if (! _pending(h, c->segment, c->offset, r.flag))
+                                                queue.count--;
+                                        c->offset += r.length;
+                                        _saveCursors();
+                                } else {
+                                        c->offset += r.length;
+                                }
+                        }
+                        if (queue.dir && (c->segment != start.segment || c->offset != start.offset)) {
+                                _saveCursors();
+                                _collect();
+                        }
+                        queue.delivering[h] = false;
+                }
+        }
+        END_LOCK;
+}
+
+
+void Queue_sync() {
+        LOCK(queuemutex)
+        {
+                if (queue.dirty && Run.eventlist_sync == Sync_Cycle)
+                        _flush();
+        }
+        END_LOCK;
+}
+
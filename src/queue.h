@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+
+#ifndef MONIT_QUEUE_H
+#define MONIT_QUEUE_H
+
+
+/**
+ * Event queue.
+ *
+ * The events which some handler (alert or M/Monit) failed to deliver are
+ * saved for later delivery in the event queue directory set with "set
+ * eventqueue basedir". The queue is an append-only log split into segment
+ * files. Each event is one binary record, which holds the handlers which
+ * still have to deliver it. Each handler has its own delivery cursor, which
+ * moves over the log as the handler delivers the events in order, so the
+ * delivery never rewrites a record. A segment is removed when all cursors
+ * have moved past it. The number of queued events is kept in memory, so the
+ * queue limit check is free.
+ *
+ * The event files of the queue format used by the previous Monit versions
+ * found in the queue directory are moved to the log when the queue is opened.
+ *
+ *  @file
+ */
+
+
+/**
+ * The event delivery function, returns Handler_Succeeded if the event was
+ * delivered or the handler flag if the delivery failed
+ */
+typedef Handler_Type (*Queue_Handler)(Event_T E);
+
+
+/**
+ * Add the partially handled event to the queue. The event is saved for
+ * the handlers set in the event flag
+ * @param E An event object
+ * @return true if succeeded, false if the event could not be saved
+ */
+boolean_t Queue_add(Event_T E);
+
+
+/**
+ * Deliver the queued events by the handler. The delivery stops at the first
+ * event which the handler fails to deliver, the event will be retried in
+ * the next cycle
+ * @param handler The handler
+ * @param deliver The delivery function of the handler
+ */
+void Queue_process(Handler_Type handler, Queue_Handler deliver);
+
+
+/**
+ * Flush the queue data to the disk if the queue fsync policy is "cycle"
+ */
+void Queue_sync();
+
+
+#endif
@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "monit.h"
+#include "schedule.h"
+
+
+/**
+ * The timer wheel has a root level of 256 ticks of 10ms and three upper
+ * levels of 64 slots each, where one slot spans the whole lower level. A
+ * service is placed into the lowest level which covers its due time and
+ * the slots of the upper levels are cascaded down as the wheel turns, like
+ * the classic kernel timer wheel. Times beyond the top level (about 7 days)
+ * are clamped, the service is then rescheduled when it comes out of the
+ * wheel early.
+ *
+ * The services checked in the cycle are linked into the ready list through
+ * the same link as in the wheel and inserted back after the check. The ready
+ * list is kept in the service list order, so the checks which depend on
+ * the order can iterate it instead of the whole service list. The services
+ * with deferred work, such as the connection retries, are linked into the
+ * deferred list, so the daemon doesn't need to search for them.
+ *
+ * The daemon sleeps until the absolute deadline of the next occupied slot on
+ * the monotonic clock (using timerfd on Linux), so the time spent in the
+ * checks doesn't shift the cadence. The sleep also waits on a notification
+ * descriptor (eventfd on Linux, a self-pipe elsewhere), which the http
+ * thread and the signal handlers write to, so the requested actions, the
+ * reload and the stop are handled at once. A notification sent before the
+ * daemon starts to sleep is not lost, the descriptor stays readable.
+ *
+ * @file
+ */
+
+
+/* ------------------------------------------------------------- Definitions */
+
+
+#define WHEEL_TICK 10 // ms
+#define ROOT_BITS  8
+#define ROOT_SIZE  (1 << ROOT_BITS)
+#define ROOT_MASK  (ROOT_SIZE - 1)
+#define LEVEL_BITS 6
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define LEVELS     3
+#define LEVEL_SHIFT(level) (ROOT_BITS + (level) * LEVEL_BITS)
+#define WHEEL_SPAN (1LL << LEVEL_SHIFT(LEVELS))
+
+
+static struct {
+        boolean_t initialized;
+        long long current;                      /**< The next tick to process */
+        Service_T ready;              /**< Services to be checked in this cycle */
+        Service_T deferred;   /**< Services with deferred work (wakeupmutex) */
+        long long wakeup;          /**< Extra wakeup requested outside the wheel */
+        Service_T root[ROOT_SIZE];
+        Service_T level[LEVELS][LEVEL_SIZE];
+} wheel;
+
+
+static struct {
+        int timer;
+        int notify[2];              /**< Notification descriptors (read, write) */
+        volatile long long notified;     /**< Time of the last notification */
+} waiter = {
+        .timer = -1,
+        .notify = {-1, -1}
+};
+
+
+static Mutex_T wakeupmutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ----------------------------------------------------------------- Private */
+
+
+static long long _now() {
+#ifdef CLOCK_MONOTONIC
+        struct timespec t;
+        if (clock_gettime(CLOCK_MONOTONIC, &t) == 0)
+                return (long long)t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+#endif
+        struct timeval t2;
+        gettimeofday(&t2, NULL);
+        return (long long)t2.tv_sec * 1000LL + t2.tv_usec / 1000;
+}
+
+
+/**
+ * The service check interval in milliseconds
+ */
+static long long _interval(Service_T s) {
+        long long interval = s->every.type == Every_Interval ? (s->every.adaptive.current ? s->every.adaptive.current : s->every.spec.interval) : Run.polltime;
+        return MAX(interval, WHEEL_TICK);
+}
+
+
+/**
+ * Adapt the interval of the service to its state: a failed or changed service
+ * is checked on the minimum (every) interval, a service without errors relaxes
+ * to twice the interval after the given number of successful checks, up to
+ * the maximum
+ */
+static void _adapt(Service_T s) {
+        if (s->every.type != Every_Interval || ! s->every.adaptive.maximum)
+                return;
+        if (! s->every.adaptive.current || s->error) {
+                s->every.adaptive.current = s->every.spec.interval;
+                s->every.adaptive.successes = 0;
+        } else if (++s->every.adaptive.successes >= s->every.adaptive.after) {
+                s->every.adaptive.current = (int)MIN((long long)s->every.adaptive.current * 2, s->every.adaptive.maximum);
+                s->every.adaptive.successes = 0;
+        }
+}
+
+
+/**
+ * The first time at or after t (monotonic ms) which falls on the phase of the
+ * service. The phase is derived from the service name, so the service keeps
+ * its place within the interval on the wall clock across restarts and reloads
+ */
+static long long _align(Service_T s, long long t) {
+        long long interval = _interval(s);
+        unsigned int hash = 2166136261U; // FNV-1a
+        for (const unsigned char *c = (const unsigned char *)s->name; *c; c++)
+                hash = (hash ^ *c) * 16777619U;
+        struct timeval wall;
+        gettimeofday(&wall, NULL);
+        long long offset = (long long)wall.tv_sec * 1000LL + wall.tv_usec / 1000 - _now();
+        long long shift = ((long long)(hash % (unsigned long long)interval) - (t + offset)) % interval;
+        return t + (shift < 0 ? shift + interval : shift);
+}
+
+
+static void _insert(Service_T s) {
+        long long expires = (s->schedule.due + WHEEL_TICK - 1) / WHEEL_TICK;
+        long long delta = expires - wheel.current;
+        Service_T *slot;
+        if (delta < 0) {
+                slot = &wheel.root[wheel.current & ROOT_MASK];
+        } else if (delta < ROOT_SIZE) {
+                slot = &wheel.root[expires & ROOT_MASK];
+        } else {
+                if (delta >= WHEEL_SPAN)
+                        expires = wheel.current + WHEEL_SPAN - 1;
+                int level = 0;
+                while (expires - wheel.current >= (1LL << LEVEL_SHIFT(level + 1)))
+                        level++;
+                slot = &wheel.level[level][(expires >> LEVEL_SHIFT(level)) & LEVEL_MASK];
+        }
+        s->schedule.next = *slot;
+        *slot = s;
+}
+
+
+/**
+ * Move the services of the upper level slot down to the lower levels
+ * @return The slot index
+ */
+static int _cascade(int level) {
+        int index = (wheel.current >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+        Service_T s = wheel.level[level][index];
+        wheel.level[level][index] = NULL;
+        while (s) {
+                Service_T next = s->schedule.next;
+                _insert(s);
+                s = next;
+        }
+        return index;
+}
+
+
+/**
+ * Merge two lists linked through the schedule link by the service order
+ */
+static Service_T _merge(Service_T a, Service_T b) {
+        Service_T list = NULL;
+        Service_T *tail = &list;
+        while (a && b) {
+                if (a->schedule.order <= b->schedule.order) {
+                        *tail = a;
+                        a = a->schedule.next;
+                } else {
+                        *tail = b;
+                        b = b->schedule.next;
+                }
+                tail = &(*tail)->schedule.next;
+        }
+        *tail = a ? a : b;
+        return list;
+}
+
+
+/**
+ * Sort the list linked through the schedule link into the service list order
+ */
+static Service_T _sort(Service_T list) {
+        if (! list || ! list->schedule.next)
+                return list;
+        Service_T middle = list;
+        for (Service_T fast = list->schedule.next; fast && fast->schedule.next; fast = fast->schedule.next->schedule.next)
+                middle = middle->schedule.next;
+        Service_T half = middle->schedule.next;
+        middle->schedule.next = NULL;
+        return _merge(_sort(list), _sort(half));
+}
+
+
+/**
+ * Set up the notification descriptors. The descriptors are non-blocking, so
+ * the notification never blocks and the daemon can drain them
+ */
+static void _notifyInit() {
+#ifdef HAVE_SYS_EVENTFD_H
+        int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fd >= 0) {
+                waiter.notify[0] = waiter.notify[1] = fd;
+                return;
+        }
+        DEBUG("Schedule eventfd setup failed, using pipe -- %s\n", STRERROR);
+#endif
+        int fds[2];
+        if (pipe(fds) < 0) {
+                LogError("Cannot create the wakeup notification pipe -- %s\n", STRERROR);
+                return;
+        }
+        for (int i = 0; i < 2; i++) {
+                fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+                fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        }
+        waiter.notify[0] = fds[0];
+        waiter.notify[1] = fds[1];
+}
+
+
+static void _reset(boolean_t spread) {
+        memset(&wheel, 0, sizeof(wheel));
+        long long now = _now();
+        wheel.current = now / WHEEL_TICK;
+        wheel.initialized = true;
+        if (waiter.notify[0] < 0)
+                _notifyInit();
+        int order = 0;
+        for (Service_T s = servicelist; s; s = s->next) {
+                s->schedule.due = spread ? _align(s, now) : now;
+                s->schedule.order = order++;
+                s->schedule.ready = false;
+                _insert(s);
+                /* The deferred work of the services is kept when all services are made due */
+                if (s->schedule.deferred) {
+                        s->schedule.next_deferred = wheel.deferred;
+                        wheel.deferred = s;
+                }
+        }
+}
+
+
+/* ------------------------------------------------------------------ Public */
+
+
+void Schedule_init() {
+        _reset(Run.flags & Run_SpreadChecks ? true : false);
+}
+
+
+void Schedule_now() {
+        _reset(false);
+}
+
+
+void Schedule_advance() {
+        if (! wheel.initialized)
+                Schedule_init();
+        long long now = _now();
+        Run.cycle.jitter = 0;
+        LOCK(wakeupmutex)
+        {
+                if (wheel.wakeup <= now)
+                        wheel.wakeup = 0;
+        }
+        END_LOCK;
+        for (long long target = now / WHEEL_TICK; wheel.current <= target; wheel.current++) {
+                int index = wheel.current & ROOT_MASK;
+                if (! index)
+                        for (int level = 0; level < LEVELS && ! _cascade(level); level++)
+                                ;
+                Service_T s = wheel.root[index];
+                wheel.root[index] = NULL;
+                while (s) {
+                        Service_T next = s->schedule.next;
+                        if (s->schedule.due > now) {
+                                /* Clamped time, not due yet */
+                                _insert(s);
+                        } else {
+                                Run.cycle.jitter = MAX(Run.cycle.jitter, now - s->schedule.due);
+                                s->schedule.ready = true;
+                                s->schedule.next = wheel.ready;
+                                wheel.ready = s;
+                        }
+                        s = next;
+                }
+        }
+        wheel.ready = _sort(wheel.ready);
+}
+
+
+Service_T Schedule_ready() {
+        return wheel.ready;
+}
+
+
+void Schedule_update() {
+        long long now = _now();
+        Service_T s = wheel.ready;
+        wheel.ready = NULL;
+        while (s) {
+                Service_T next = s->schedule.next;
+                _adapt(s);
+                long long interval = _interval(s);
+                /* Keep the cadence, skip the checks missed while the cycle overran. The spread checks
+                 * return to their phase, if they were moved off by a wakeup or an interval change */
+                if (Run.flags & Run_SpreadChecks)
+                        s->schedule.due = _align(s, s->schedule.due + interval / 2);
+                else
+                        s->schedule.due += interval;
+                if (s->schedule.due <= now) {
+                        long long missed = (now - s->schedule.due) / interval + 1;
+                        s->schedule.due += missed * interval;
+                        Run.cycle.overruns += missed;
+                }
+                s->schedule.ready = false;
+                _insert(s);
+                s = next;
+        }
+}
+
+
+/**
+ * The deadline of the next occupied slot on the monotonic clock in ms
+ */
+static long long _deadline() {
+        if (wheel.ready)
+                return 0;
+        long long wakeup = 0;
+        LOCK(wakeupmutex)
+        {
+                wakeup = wheel.wakeup;
+        }
+        END_LOCK;
+        long long next = wheel.current + WHEEL_SPAN;
+        /* The root level holds the services due within the next 256 ticks */
+        for (long long tick = wheel.current; tick < wheel.current + ROOT_SIZE; tick++) {
+                if (wheel.root[tick & ROOT_MASK]) {
+                        next = tick;
+                        break;
+                }
+        }
+        /* The upper level slots are cascaded down when the lower level wraps */
+        for (int level = 0; level < LEVELS; level++) {
+                long long block = wheel.current >> LEVEL_SHIFT(level);
+                int first = (wheel.current & ((1LL << LEVEL_SHIFT(level)) - 1)) ? 1 : 0;
+                for (int i = first; i < first + LEVEL_SIZE; i++) {
+                        if (wheel.level[level][(block + i) & LEVEL_MASK]) {
+                                next = MIN(next, (block + i) << LEVEL_SHIFT(level));
+                                break;
+                        }
+                }
+        }
+        return wakeup ? MIN(next * WHEEL_TICK, wakeup) : next * WHEEL_TICK;
+}
+
+
+void Schedule_wakeup(long delay) {
+        long long due = _now() + MAX(delay, 0);
+        LOCK(wakeupmutex)
+        {
+                if (! wheel.wakeup || due < wheel.wakeup)
+                        wheel.wakeup = due;
+        }
+        END_LOCK;
+}
+
+
+void Schedule_defer(Service_T s, long delay) {
+        ASSERT(s);
+        Schedule_wakeup(delay);
+        LOCK(wakeupmutex)
+        {
+                if (! s->schedule.deferred) {
+                        s->schedule.deferred = true;
+                        s->schedule.next_deferred = wheel.deferred;
+                        wheel.deferred = s;
+                }
+        }
+        END_LOCK;
+}
+
+
+Service_T Schedule_deferred() {
+        Service_T list = NULL;
+        LOCK(wakeupmutex)
+        {
+                list = wheel.deferred;
+                wheel.deferred = NULL;
+                for (Service_T s = list; s; s = s->schedule.next_deferred)
+                        s->schedule.deferred = false;
+        }
+        END_LOCK;
+        return list;
+}
+
+
+long Schedule_timeout() {
+        long long timeout = _deadline() - _now();
+        return timeout > 0 ? (long)timeout : 0;
+}
+
+
+void Schedule_wait() {
+        if (waiter.notify[0] < 0)
+                _notifyInit();
+        /* Don't sleep if some request came before the notification descriptor was set up */
+        if (Run.flags & (Run_ActionPending | Run_DoWakeup | Run_DoReload | Run_Stopped))
+                return;
+        long long deadline = _deadline();
+        if (deadline <= _now())
+                return;
+        int count = 0;
+        int timeout = -1;
+        struct pollfd fds[2];
+#ifdef HAVE_SYS_TIMERFD_H
+        /* Non-blocking, the descriptors are drained until read would block */
+        if (waiter.timer < 0)
+                waiter.timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (waiter.timer >= 0) {
+                struct itimerspec spec = {.it_value = {.tv_sec = deadline / 1000, .tv_nsec = (deadline % 1000) * 1000000}};
+                if (timerfd_settime(waiter.timer, TFD_TIMER_ABSTIME, &spec, NULL) == 0)
+                        fds[count++] = (struct pollfd){.fd = waiter.timer, .events = POLLIN};
+                else
+                        DEBUG("Schedule timer setup failed -- %s\n", STRERROR);
+        }
+#endif
+        if (! count)
+                timeout = (int)MAX(deadline - _now(), 0);
+        if (waiter.notify[0] >= 0)
+                fds[count++] = (struct pollfd){.fd = waiter.notify[0], .events = POLLIN};
+        if (count) {
+                /* The poll is also interrupted by a signal */
+                if (poll(fds, count, timeout) > 0) {
+                        for (int i = 0; i < count; i++) {
+                                if (fds[i].revents & POLLIN) {
+                                        char buf[64];
+                                        while (read(fds[i].fd, buf, sizeof(buf)) > 0)
+                                                ;
+                                        if (fds[i].fd == waiter.notify[0])
+                                                DEBUG("Woken up %lld ms after the notification\n", _now() - waiter.notified);
+                                }
+                        }
+                }
+        } else if (timeout > 0) {
+                struct timespec wait = {.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000};
+                nanosleep(&wait, NULL);
+        }
+}
+
+
+void Schedule_notify() {
+        int saved = errno;
+        if (waiter.notify[1] >= 0) {
+                unsigned long long one = 1;
+                waiter.notified = _now();
+                if (write(waiter.notify[1], &one, sizeof(one)) < 0) {
+                        // The descriptor is full, the daemon will wake up anyway
+                }
+        }
+        errno = saved;
+}
+
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) Tildeslash Ltd. All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU Affero General Public License in all respects
+ * for all of the code used other than OpenSSL.
+ */
+
+
+#ifndef MONIT_SCHEDULE_H
+#define MONIT_SCHEDULE_H
+
+
+/**
+ * Scheduling of the service checks.
+ *
+ * Each service is checked on its own interval, set with the "every <number>
+ * milliseconds|seconds|minutes|hours" statement. Services without an interval
+ * are checked every poll cycle. The services wait for their next check in a
+ * hierarchical timer wheel, so the daemon wakes up only when some service is
+ * due and each wakeup touches only the due services. The wakeups follow
+ * absolute deadlines on the monotonic clock, so the cadence doesn't drift
+ * by the time spent in the checks.
+ *
+ *  @file
+ */
+
+
+/**
+ * Initialize the schedule and make all services due now, or at their phase
+ * within the interval if the checks are spread. Must be called whenever the
+ * service list was replaced
+ */
+void Schedule_init();
+
+
+/**
+ * Make all services due now
+ */
+void Schedule_now();
+
+
+/**
+ * Mark the services which are due as ready to be checked in this cycle
+ */
+void Schedule_advance();
+
+
+/**
+ * Get the services to be checked in this cycle, linked through the
+ * schedule.next link in the service list order. Valid until Schedule_update()
+ * @return The first ready service or NULL if no service is due
+ */
+Service_T Schedule_ready();
+
+
+/**
+ * Schedule the next check of the services checked in this cycle
+ */
+void Schedule_update();
+
+
+/**
+ * Request a wakeup of the daemon after the given time, even if no service
+ * is due then
+ * @param delay Milliseconds from now
+ */
+void Schedule_wakeup(long delay);
+
+
+/**
+ * Defer some work of the service, such as a connection retry, and request a
+ * wakeup after the given time. The service is put into the deferred list
+ * once, until the list is taken by Schedule_deferred()
+ * @param s The service
+ * @param delay Milliseconds from now
+ */
+void Schedule_defer(Service_T s, long delay);
+
+
+/**
+ * Take the list of the services with deferred work, linked through the
+ * schedule.next_deferred link. The service may be deferred again while the
+ * list is processed, so the caller must read the link before the service
+ * work is done
+ * @return The first deferred service or NULL
+ */
+Service_T Schedule_deferred();
+
+
+/**
+ * Get the time until the next check
+ * @return Milliseconds until the next service is due
+ */
+long Schedule_timeout();
+
+
+/**
+ * Sleep until the next service is due. The sleep is interrupted by a
+ * signal or by Schedule_notify()
+ */
+void Schedule_wait();
+
+
+/**
+ * Wake up the daemon from Schedule_wait() to handle a request, such as a
+ * service action set by the http interface. Async-signal-safe, so it can be
+ * called from a signal handler
+ */
+void Schedule_notify();
+
+
+#endif
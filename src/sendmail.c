@@ -74,6 +74,12 @@
 /**
  *  Connect to a SMTP server and send mail.
  *
+ *  The SMTP session is kept open for the mailserver idle time, so the
+ *  alerts sent in short order don't pay for the connection, TLS and
+ *  authentication again. The commands are sent pipelined (RFC 2920) if
+ *  the server supports it and the mails with the same content are sent
+ *  as one message with multiple recipients.
+ *
  *  @file
  */
 
@@ -85,57 +91,86 @@
 typedef struct {
         Socket_T socket;
         StringBuffer_T status_message;
+        StringBuffer_T buffer;                   /**< Commands not sent yet */
+        StringBuffer_T recipients;           /**< The message To: header */
+        int status;                    /**< The last reply code, 0 if none */
         boolean_t quit;
-        const char *server;
+        boolean_t pipelining;      /**< true if the server supports RFC 2920 */
         int port;
         const char *username;
         const char *password;
         SslOptions_T ssl;
+        long long expire;        /**< Time (ms) the idle session is closed */
+        char server[STRLEN];
         char localhost[STRLEN];
 } SendMail_T;
 
 
+static SendMail_T session;
+static Mutex_T sendmutex = PTHREAD_MUTEX_INITIALIZER;
+
+
 /* ----------------------------------------------------------------- Private */
 
 
+/* The data are buffered and sent when the server reply is read by do_status() */
 void do_send(SendMail_T *S, const char *s, ...) {
         va_list ap;
         va_start(ap,s);
-        char *msg = Str_vcat(s, ap);
+        StringBuffer_vappend(S->buffer, s, ap);
         va_end(ap);
-        int rv = Socket_write(S->socket, msg, strlen(msg));
-        FREE(msg);
-        if (rv <= 0)
-                THROW(IOException, "Error sending data to the server '%s' -- %s", S->server, STRERROR);
+}
+
+
+static void do_flush(SendMail_T *S) {
+        int length = StringBuffer_length(S->buffer);
+        if (length > 0) {
+                int rv = Socket_write(S->socket, (void *)StringBuffer_toString(S->buffer), length);
+                StringBuffer_clear(S->buffer);
+                if (rv <= 0) {
+                        S->quit = false; // The connection is broken, don't wait for the QUIT reply
+                        THROW(IOException, "Error sending data to the server '%s' -- %s", S->server, STRERROR);
+                }
+        }
 }
 
 
 static void do_status(SendMail_T *S) {
         int status = 0;
+        S->status = 0;
+        do_flush(S);
         StringBuffer_clear(S->status_message);
         char buf[STRLEN];
         do {
-                if (! Socket_readLine(S->socket, buf, sizeof(buf)))
+                if (! Socket_readLine(S->socket, buf, sizeof(buf))) {
+                        S->quit = false; // The connection is broken or the server doesn't respond, don't wait for the QUIT reply
                         THROW(IOException, "Error receiving data from the mailserver '%s' -- %s", S->server, STRERROR);
+                }
                 StringBuffer_append(S->status_message, "%s", buf);
         } while (buf[3] == '-'); // multi-line response
         Str_chomp(buf);
-        if (sscanf(buf, "%d", &status) != 1 || status < 200 || status >= 400)
+        if (sscanf(buf, "%d", &status) == 1)
+                S->status = status;
+        if (status < 200 || status >= 400)
                 THROW(IOException, "%s", buf);
 }
 
 
+static void set_server(SendMail_T *S, MailServer_T mta) {
+        snprintf(S->server, sizeof(S->server), "%s", mta->host);
+        S->port     = mta->port;
+        S->username = mta->username;
+        S->password = mta->password;
+        S->ssl      = mta->ssl;
+}
+
+
 static void open_server(SendMail_T *S) {
         MailServer_T mta = Run.mailservers;
-        if (mta) {
-                S->server   = mta->host;
-                S->port     = mta->port;
-                S->username = mta->username;
-                S->password = mta->password;
-                S->ssl      = mta->ssl;
-        } else {
+        if (mta)
+                set_server(S, mta);
+        else
                 THROW(IOException, "No mail servers are defined -- see manual for 'set mailserver' statement");
-        }
         do {
                 /* wait with ssl-connect if SSL_TLS* is set (rfc2487) */
                 if (! S->ssl.use_ssl || S->ssl.version == SSL_TLSV1 || S->ssl.version == SSL_TLSV11 || S->ssl.version == SSL_TLSV12)
@@ -146,11 +181,7 @@ static void open_server(SendMail_T *S) {
                         break;
                 LogError("Cannot open a connection to the mailserver '%s:%i' -- %s\n", S->server, S->port, STRERROR);
                 if (mta && (mta = mta->next)) {
-                        S->server   = mta->host;
-                        S->port     = mta->port;
-                        S->username = mta->username;
-                        S->password = mta->password;
-                        S->ssl      = mta->ssl;
+                        set_server(S, mta);
                         LogInfo("Trying the next mail server '%s:%i'\n", S->server, S->port);
                         continue;
                 } else {
@@ -172,14 +203,195 @@ static void close_server(SendMail_T *S) {
         }
         ELSE
         {
-                LogError("Mail: %s\n", Exception_frame.message);
+                /* The server may have closed the idle session already */
+                DEBUG("Mail: %s\n", Exception_frame.message);
         }
         FINALLY
         {
                 if (S->socket)
                         Socket_free(&(S->socket));
+                StringBuffer_clear(S->buffer);
+                S->pipelining = false;
+        }
+        END_TRY;
+}
+
+
+static void do_handshake(SendMail_T *S) {
+        boolean_t starttls = S->ssl.use_ssl && (S->ssl.version == SSL_TLSV1 || S->ssl.version == SSL_TLSV11 || S->ssl.version == SSL_TLSV12);
+        snprintf(S->localhost, sizeof(S->localhost), "%s", Run.mail_hostname ? Run.mail_hostname : Run.system->name);
+        do_status(S);
+        /* Use EHLO to learn the server extensions, fall back to HELO if the server rejects it and neither TLS nor authentication is requested */
+        boolean_t ehlo = true;
+        TRY
+        {
+                do_send(S, "EHLO %s\r\n", S->localhost);
+                do_status(S);
+        }
+        ELSE
+        {
+                /* Only a 5xx reply means EHLO is not supported, a timeout or dropped connection goes to the failover */
+                if (starttls || S->username || S->status < 500 || S->status >= 600)
+                        RETHROW;
+                ehlo = false;
+        }
+        END_TRY;
+        if (! ehlo) {
+                do_send(S, "HELO %s\r\n", S->localhost);
+                do_status(S);
+        }
+        /* Switch to TLS now if configured */
+        if (starttls) {
+                do_send(S, "STARTTLS\r\n");
+                do_status(S);
+                TRY
+                {
+                        Socket_enableSsl(S->socket, S->ssl, NULL);
+                }
+                ELSE
+                {
+                        S->quit = false;
+                        RETHROW;
+                }
+                END_TRY;
+                /* After starttls, send ehlo again: RFC 3207: 4.2 Result of the STARTTLS Command */
+                do_send(S, "EHLO %s\r\n", S->localhost);
+                do_status(S);
+        }
+        S->pipelining = ehlo && StringBuffer_indexOf(S->status_message, "PIPELINING") > 0;
+        /* Authenticate if possible */
+        if (S->username) {
+                char buffer[STRLEN];
+                // PLAIN takes precedence
+                if (StringBuffer_indexOf(S->status_message, " PLAIN") > 0) {
+                        int len = snprintf(buffer, STRLEN, "%c%s%c%s", '\0', S->username, '\0', S->password ? S->password : "");
+                        char *b64 = encode_base64(len, (unsigned char *)buffer);
+                        TRY
+                        {
+                                do_send(S, "AUTH PLAIN %s\r\n", b64);
+                                do_status(S);
+                        }
+                        FINALLY
+                        {
+                                FREE(b64);
+                        }
+                        END_TRY;
+                } else if (StringBuffer_indexOf(S->status_message, " LOGIN") > 0) {
+                        do_send(S, "AUTH LOGIN\r\n");
+                        do_status(S);
+                        snprintf(buffer, STRLEN, "%s", S->username);
+                        char *b64 = encode_base64(strlen(buffer), (unsigned char *)buffer);
+                        TRY
+                        {
+                                do_send(S, "%s\r\n", b64);
+                                do_status(S);
+                        }
+                        FINALLY
+                        {
+                                FREE(b64);
+                        }
+                        END_TRY;
+                        snprintf(buffer, STRLEN, "%s", S->password ? S->password : "");
+                        b64 = encode_base64(strlen(buffer), (unsigned char *)buffer);
+                        TRY
+                        {
+                                do_send(S, "%s\r\n", b64);
+                                do_status(S);
+                        }
+                        FINALLY
+                        {
+                                FREE(b64);
+                        }
+                        END_TRY;
+                } else {
+                        THROW(IOException, "Authentication failed -- no supported authentication methods found");
+                }
+        }
+}
+
+
+/*
+ * Reuse the open session unless it was idle too long or its server was
+ * removed from the configuration. RSET checks the server didn't close the
+ * connection meanwhile.
+ */
+static boolean_t do_reuse(SendMail_T *S) {
+        if (! S->socket || Time_milli() >= S->expire)
+                return false;
+        boolean_t configured = false;
+        for (MailServer_T mta = Run.mailservers; mta && ! configured; mta = mta->next)
+                configured = IS(mta->host, S->server) && mta->port == S->port;
+        if (! configured)
+                return false;
+        boolean_t alive = true;
+        TRY
+        {
+                do_send(S, "RSET\r\n");
+                do_status(S);
+        }
+        ELSE
+        {
+                DEBUG("Mail: cannot reuse the session with the mailserver '%s' -- %s\n", S->server, Exception_frame.message);
+                S->quit = false;
+                alive = false;
         }
         END_TRY;
+        return alive;
+}
+
+
+static boolean_t is_same_message(Mail_T a, Mail_T b) {
+        return IS(a->from, b->from) && (a->replyto == b->replyto || IS(a->replyto, b->replyto)) && IS(a->subject, b->subject) && IS(a->message, b->message);
+}
+
+
+static void do_mail(SendMail_T *S, Mail_T mail) {
+        char now[STRLEN];
+        Time_gmtstring(Time_now(), now);
+        int count = 0;
+        for (Mail_T m = mail; m; m = m->next)
+                count++;
+        boolean_t sent[count];
+        memset(sent, 0, sizeof(sent));
+        int i = 0;
+        for (Mail_T m = mail; m; m = m->next, i++) {
+                if (sent[i])
+                        continue;
+                do_send(S, "MAIL FROM: <%s>\r\n", m->from);
+                if (! S->pipelining)
+                        do_status(S);
+                /* The mails with the same content are sent as one message with multiple recipients */
+                int recipients = 0, j = i;
+                StringBuffer_clear(S->recipients);
+                for (Mail_T n = m; n; n = n->next, j++) {
+                        if (! sent[j] && is_same_message(m, n)) {
+                                sent[j] = true;
+                                do_send(S, "RCPT TO: <%s>\r\n", n->to);
+                                if (! S->pipelining)
+                                        do_status(S);
+                                StringBuffer_append(S->recipients, "%s%s", recipients++ ? ", " : "", n->to);
+                        }
+                }
+                do_send(S, "DATA\r\n");
+                /* With pipelining the MAIL, RCPT and DATA commands are sent at once, read their replies in order */
+                for (int k = S->pipelining ? recipients + 2 : 1; k > 0; k--)
+                        do_status(S);
+                do_send(S, "From: %s\r\n", m->from);
+                if (m->replyto)
+                        do_send(S, "Reply-To: %s\r\n", m->replyto);
+                do_send(S, "To: %s\r\n", StringBuffer_toString(S->recipients));
+                do_send(S, "Subject: %s\r\n", m->subject);
+                do_send(S, "Date: %s\r\n", now);
+                do_send(S, "X-Mailer: Monit %s\r\n", VERSION);
+                do_send(S, "MIME-Version: 1.0\r\n");
+                do_send(S, "Content-Type: text/plain; charset=\"iso-8859-1\"\r\n");
+                do_send(S, "Content-Transfer-Encoding: 8bit\r\n");
+                do_send(S, "Message-Id: <%lld.%lu@%s>\r\n", (long long)Time_now(), random(), S->localhost);
+                do_send(S, "\r\n");
+                do_send(S, "%s\r\n", m->message);
+                do_send(S, ".\r\n");
+                do_status(S);
+        }
 }
 
 
@@ -189,127 +401,72 @@ static void close_server(SendMail_T *S) {
 /**
  * Send mail messages via SMTP
  * @param mail A Mail object
- * @return false if failed, true if succeeded
+ * @return false if succeeded, true if failed
  */
 boolean_t sendmail(Mail_T mail) {
-        SendMail_T S;
         boolean_t failed = false;
-        char now[STRLEN];
 
         ASSERT(mail);
 
-        memset(&S, 0, sizeof(S));
-        S.status_message = StringBuffer_create(STRLEN);
-
-        TRY
+        LOCK(sendmutex)
         {
-                open_server(&S);
-                Time_gmtstring(Time_now(), now);
-                snprintf(S.localhost, sizeof(S.localhost), "%s", Run.mail_hostname ? Run.mail_hostname : Run.system->name);
-                do_status(&S);
-                do_send(&S, "%s %s\r\n", ((S.ssl.use_ssl && (S.ssl.version == SSL_TLSV1 || S.ssl.version == SSL_TLSV11 || S.ssl.version == SSL_TLSV12)) || S.username) ? "EHLO" : "HELO", S.localhost); // Use EHLO if TLS or Authentication is requested
-                do_status(&S);
-                /* Switch to TLS now if configured */
-                if (S.ssl.use_ssl && (S.ssl.version == SSL_TLSV1 || S.ssl.version == SSL_TLSV11 || S.ssl.version == SSL_TLSV12)) {
-                        do_send(&S, "STARTTLS\r\n");
-                        do_status(&S);
-                        TRY
-                        {
-                                Socket_enableSsl(S.socket, S.ssl, NULL);
-                        }
-                        ELSE
-                        {
-                                S.quit = false;
-                                RETHROW;
-                        }
-                        END_TRY;
-                        /* After starttls, send ehlo again: RFC 3207: 4.2 Result of the STARTTLS Command */
-                        do_send(&S, "EHLO %s\r\n", S.localhost);
-                        do_status(&S);
+                SendMail_T *S = &session;
+                if (! S->status_message) {
+                        S->status_message = StringBuffer_create(STRLEN);
+                        S->buffer = StringBuffer_create(STRLEN);
+                        S->recipients = StringBuffer_create(STRLEN);
                 }
-                /* Authenticate if possible */
-                if (S.username) {
-                        char buffer[STRLEN];
-                        // PLAIN takes precedence
-                        if (StringBuffer_indexOf(S.status_message, " PLAIN") > 0) {
-                                int len = snprintf(buffer, STRLEN, "%c%s%c%s", '\0', S.username, '\0', S.password ? S.password : "");
-                                char *b64 = encode_base64(len, (unsigned char *)buffer);
-                                TRY
-                                {
-                                        do_send(&S, "AUTH PLAIN %s\r\n", b64);
-                                        do_status(&S);
-                                }
-                                FINALLY
-                                {
-                                        FREE(b64);
-                                }
-                                END_TRY;
-                        } else if (StringBuffer_indexOf(S.status_message, " LOGIN") > 0) {
-                                do_send(&S, "AUTH LOGIN\r\n");
-                                do_status(&S);
-                                snprintf(buffer, STRLEN, "%s", S.username);
-                                char *b64 = encode_base64(strlen(buffer), (unsigned char *)buffer);
-                                TRY
-                                {
-                                        do_send(&S, "%s\r\n", b64);
-                                        do_status(&S);
-                                }
-                                FINALLY
-                                {
-                                        FREE(b64);
-                                }
-                                END_TRY;
-                                snprintf(buffer, STRLEN, "%s", S.password ? S.password : "");
-                                b64 = encode_base64(strlen(buffer), (unsigned char *)buffer);
-                                TRY
-                                {
-                                        do_send(&S, "%s\r\n", b64);
-                                        do_status(&S);
-                                }
-                                FINALLY
-                                {
-                                        FREE(b64);
-                                }
-                                END_TRY;
-                        } else {
-                                THROW(IOException, "Authentication failed -- no supported authentication methods found");
+                TRY
+                {
+                        if (! do_reuse(S)) {
+                                close_server(S);
+                                open_server(S);
+                                do_handshake(S);
                         }
+                        do_mail(S, mail);
+                        S->expire = Time_milli() + Run.mailserver_idle;
                 }
-                for (Mail_T m = mail; m; m = m->next) {
-                        do_send(&S, "MAIL FROM: <%s>\r\n", m->from);
-                        do_status(&S);
-                        do_send(&S, "RCPT TO: <%s>\r\n", m->to);
-                        do_status(&S);
-                        do_send(&S, "DATA\r\n");
-                        do_status(&S);
-                        do_send(&S, "From: %s\r\n", m->from);
-                        if (m->replyto)
-                                do_send(&S, "Reply-To: %s\r\n", m->replyto);
-                        do_send(&S, "To: %s\r\n", m->to);
-                        do_send(&S, "Subject: %s\r\n", m->subject);
-                        do_send(&S, "Date: %s\r\n", now);
-                        do_send(&S, "X-Mailer: Monit %s\r\n", VERSION);
-                        do_send(&S, "MIME-Version: 1.0\r\n");
-                        do_send(&S, "Content-Type: text/plain; charset=\"iso-8859-1\"\r\n");
-                        do_send(&S, "Content-Transfer-Encoding: 8bit\r\n");
-                        do_send(&S, "Message-Id: <%lld.%lu@%s>\r\n", (long long)Time_now(), random(), S.localhost);
-                        do_send(&S, "\r\n");
-                        do_send(&S, "%s\r\n", m->message);
-                        do_send(&S, ".\r\n");
-                        do_status(&S);
+                ELSE
+                {
+                        failed = true;
+                        LogError("Mail: %s\n", Exception_frame.message);
+                        S->expire = 0;
                 }
+                END_TRY;
+                if (Time_milli() >= S->expire)
+                        close_server(S);
         }
-        ELSE
+        END_LOCK;
+        return failed;
+}
+
+
+/**
+ * Close the mail session if it was idle for the mailserver idle time
+ */
+void sendmail_idle() {
+        LOCK(sendmutex)
         {
-                failed = true;
-                LogError("Mail: %s\n", Exception_frame.message);
+                if (session.socket && Time_milli() >= session.expire)
+                        close_server(&session);
         }
-        FINALLY
+        END_LOCK;
+}
+
+
+/**
+ * Close the mail session
+ */
+void sendmail_close() {
+        LOCK(sendmutex)
         {
-                close_server(&S);
-                StringBuffer_free(&(S.status_message));
+                if (session.status_message) {
+                        close_server(&session);
+                        StringBuffer_free(&(session.status_message));
+                        StringBuffer_free(&(session.buffer));
+                        StringBuffer_free(&(session.recipients));
+                }
         }
-        END_TRY;
-        return failed;
+        END_LOCK;
 }
 
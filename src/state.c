@@ -135,6 +135,13 @@ typedef struct mystate1 {
 static int file = -1;
 
 
+/* The service states written by the last successful save */
+static struct {
+        State1_T *states;
+        int count;
+} saved;
+
+
 /* ----------------------------------------------------------------- Private */
 
 
@@ -176,6 +183,26 @@ static void update_v1() {
 }
 
 
+static void _state(Service_T service, State1_T *state) {
+        memset(state, 0, sizeof(*state));
+        snprintf(state->name, sizeof(state->name), "%s", service->name);
+        state->type = service->type;
+        state->monitor = service->monitor & ~Monitor_Waiting;
+        state->nstart = service->nstart;
+        state->ncycle = service->ncycle;
+        if (service->type == Service_File) {
+                state->priv.file.inode = service->inf->priv.file.inode;
+                state->priv.file.readpos = service->inf->priv.file.readpos;
+        }
+}
+
+
+static void _forget() {
+        FREE(saved.states);
+        saved.count = 0;
+}
+
+
 /* ------------------------------------------------------------------ Public */
 
 
@@ -191,6 +218,7 @@ boolean_t State_open() {
 
 
 void State_close() {
+        _forget();
         if (file != -1) {
                 if (close(file) == -1)
                         LogError("State file '%s': close error -- %s\n", Run.files.state, STRERROR);
@@ -201,6 +229,19 @@ void State_close() {
 
 
 void State_save() {
+        int count = 0;
+        for (Service_T service = servicelist; service; service = service->next)
+                count++;
+        State1_T *states = CALLOC(count + 1, sizeof(State1_T));
+        int i = 0;
+        for (Service_T service = servicelist; service; service = service->next)
+                _state(service, &states[i++]);
+        /* The state is saved after every cycle, skip the rewrite and sync if no service state changed */
+        if (saved.states && saved.count == count && ! memcmp(saved.states, states, count * sizeof(State1_T))) {
+                FREE(states);
+                return;
+        }
+        _forget();
         TRY
         {
                 if (ftruncate(file, 0L) == -1)
@@ -214,29 +255,21 @@ void State_save() {
                 int version = StateVersion1;
                 if (write(file, &version, sizeof(version)) != sizeof(version))
                         THROW(IOException, "Unable to write format version");
-                for (Service_T service = servicelist; service; service = service->next) {
-                        State1_T state;
-                        memset(&state, 0, sizeof(state));
-                        snprintf(state.name, sizeof(state.name), "%s", service->name);
-                        state.type = service->type;
-                        state.monitor = service->monitor & ~Monitor_Waiting;
-                        state.nstart = service->nstart;
-                        state.ncycle = service->ncycle;
-                        if (service->type == Service_File) {
-                                state.priv.file.inode = service->inf->priv.file.inode;
-                                state.priv.file.readpos = service->inf->priv.file.readpos;
-                        }
-                        if (write(file, &state, sizeof(state)) != sizeof(state))
-                                THROW(IOException, "Unable to write service state");
-                }
+                ssize_t length = count * sizeof(State1_T);
+                if (write(file, states, length) != length)
+                        THROW(IOException, "Unable to write service state");
                 if (fsync(file))
                         THROW(IOException, "Unable to sync -- %s", STRERROR);
+                saved.states = states;
+                saved.count = count;
         }
         ELSE
         {
                 LogError("State file '%s': %s\n", Run.files.state, Exception_frame.message);
         }
         END_TRY;
+        if (saved.states != states)
+                FREE(states);
 }
 
 
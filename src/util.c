@@ -788,7 +788,7 @@ void Util_printRunList() {
         printf(" %-18s = %s\n", "Use syslog", (Run.flags & Run_UseSyslog) ? "True" : "False");
         printf(" %-18s = %s\n", "Is Daemon", (Run.flags & Run_Daemon) ? "True" : "False");
         printf(" %-18s = %s\n", "Use process engine", (Run.flags & Run_ProcessEngineEnabled) ? "True" : "False");
-        printf(" %-18s = %d seconds with start delay %d seconds\n", "Poll time", Run.polltime, Run.startdelay);
+        printf(" %-18s = %g seconds with start delay %d seconds\n", "Poll time", Run.polltime / 1000., Run.startdelay);
         printf(" %-18s = %d bytes\n", "Expect buffer", Run.expectbuffer);
 
         if (Run.eventlist_dir) {
@@ -832,6 +832,7 @@ void Util_printRunList() {
                                mta->ssl.use_ssl ? "(ssl)" : "",
                                mta->next ? ", " : " ");
                 printf("with timeout %d seconds", Run.mailserver_timeout / 1000);
+                printf(" idle %d seconds", Run.mailserver_idle / 1000);
                 if (Run.mail_hostname)
                         printf(" using '%s' as my hostname", Run.mail_hostname);
                 printf("\n");
@@ -1294,6 +1295,11 @@ void Util_printService(Service_T s) {
                 printf(" %-20s = Check service every %s\n", "Every", s->every.spec.cron);
         else if (s->every.type == Every_NotInCron)
                 printf(" %-20s = Don't check service every %s\n", "Every", s->every.spec.cron);
+        else if (s->every.type == Every_Interval)
+                if (s->every.adaptive.maximum)
+                        printf(" %-20s = Check service every %d ms, adaptive up to %d ms after %d successful check(s)\n", "Every", s->every.spec.interval, s->every.adaptive.maximum, s->every.adaptive.after);
+                else
+                        printf(" %-20s = Check service every %d ms\n", "Every", s->every.spec.interval);
 
         for (ActionRate_T o = s->actionratelist; o; o = o->next) {
                 StringBuffer_clear(buf);
@@ -1408,6 +1414,27 @@ pid_t Util_getPid(char *pidfile) {
 }
 
 
+/**
+ * Test if the service process is alive. Where supported, a pidfd of the
+ * process is kept by the service, so the test is a poll of the descriptor
+ * and a reused pid is not mistaken for the service process. Otherwise the
+ * process existence is tested by getpgid().
+ */
+static boolean_t _isProcessAlive(Service_T s, pid_t pid) {
+        if (s->inf->priv.process.pidfd >= 0 && s->inf->priv.process.pidfd_pid != pid) {
+                close(s->inf->priv.process.pidfd);
+                s->inf->priv.process.pidfd = -1;
+        }
+        if (s->inf->priv.process.pidfd < 0 && (s->inf->priv.process.pidfd = openprocessfd(pid)) >= 0)
+                s->inf->priv.process.pidfd_pid = pid;
+        /* The caller reports errno as the reason, don't leave one from the process matching or pidfd open */
+        errno = 0;
+        if (s->inf->priv.process.pidfd >= 0)
+                return ! waitprocessfd(s->inf->priv.process.pidfd, 0);
+        return (getpgid(pid) > -1) || (errno == EPERM);
+}
+
+
 int Util_isProcessRunning(Service_T s, boolean_t refresh) {
         pid_t pid = -1;
         ASSERT(s);
@@ -1419,20 +1446,10 @@ int Util_isProcessRunning(Service_T s, boolean_t refresh) {
                  * which it traverses is changed during glob (process stopped). Note that the glob failure is rare and temporary - it will be OK on next cycle.
                  * We skip the process matching that cycle however because we don't have process informations - will retry next cycle */
                 if (Run.flags & Run_ProcessEngineEnabled) {
-                        for (int i = 0; i < ptreesize; i++) {
-                                boolean_t found = false;
-                                if (ptree[i].cmdline) {
-#ifdef HAVE_REGEX_H
-                                        found = regexec(s->matchlist->regex_comp, ptree[i].cmdline, 0, NULL, 0) ? false : true;
-#else
-                                        found = strstr(ptree[i].cmdline, s->matchlist->match_string) ? true : false;
-#endif
-                                }
-                                if (found) {
-                                        pid = ptree[i].pid;
-                                        break;
-                                }
-                        }
+                        /* Another validation worker may refresh the tree meanwhile */
+                        pthread_rwlock_rdlock(&ptreelock);
+                        pid = ptree ? matchprocess(s, ptree, ptreesize) : 0;
+                        pthread_rwlock_unlock(&ptreelock);
                 } else {
                         DEBUG("Process information not available -- skipping service %s process existence check for this cycle\n", s->name);
                         /* Return value is NOOP - it is based on existing errors bitmap so we don't generate false recovery/failures */
@@ -1442,9 +1459,9 @@ int Util_isProcessRunning(Service_T s, boolean_t refresh) {
                 pid = Util_getPid(s->path);
         }
         if (pid > 0) {
-                if ((getpgid(pid) > -1) || (errno == EPERM))
+                if (_isProcessAlive(s, pid))
                         return pid;
-                DEBUG("'%s' process test failed [pid=%d] -- %s\n", s->name, pid, STRERROR);
+                DEBUG("'%s' process test failed [pid=%d] -- %s\n", s->name, pid, errno ? STRERROR : "process exited");
         }
         Util_resetInfo(s);
         return 0;
@@ -1738,6 +1755,12 @@ void Util_resetInfo(Service_T s) {
                         s->inf->priv.process.cpu_percent = 0;
                         s->inf->priv.process.total_cpu_percent = 0;
                         s->inf->priv.process.uptime = 0;
+                        if (s->inf->priv.process.pidfd >= 0)
+                                close(s->inf->priv.process.pidfd);
+                        s->inf->priv.process.pidfd = -1;
+                        s->inf->priv.process.pidfd_pid = 0;
+                        s->inf->priv.process.cgroup_usage = 0ULL;
+                        s->inf->priv.process.cgroup_time = 0LL;
                         break;
                 case Service_Net:
                         if (s->inf->priv.net.stats)
@@ -1840,6 +1863,8 @@ void Util_monitorUnset(Service_T s) {
         s->error = Event_Null;
         if (s->eventlist)
                 gc_event(&s->eventlist);
+        if (s->events.slot)
+                memset(s->events.slot, 0, s->events.count * sizeof(*s->events.slot));
         Util_resetInfo(s);
         State_save();
 }
@@ -100,6 +100,10 @@
 #include "device.h"
 #include "process.h"
 #include "protocol.h"
+#include "schedule.h"
+#include "probe.h"
+#include "profile.h"
+#include "dispatch.h"
 
 // libmonit
 #include "system/Time.h"
@@ -141,15 +145,28 @@ static void _programOutput(InputStream_T I, StringBuffer_T S) {
 
 
 /**
- * Test the connection and protocol
+ * The delay of the next connection retry: exponential backoff with random jitter
  */
-static void check_connection(Service_T s, Port_T p) {
-        ASSERT(s && p);
-        volatile int retry_count = p->retry;
+static long _retryBackoff(int attempt) {
+        long long delay = Run.retry.backoff;
+        for (int i = 1; i < attempt && delay < Run.retry.maximum; i++)
+                delay *= 2;
+        delay = MIN(delay, Run.retry.maximum);
+        if (Run.retry.jitter)
+                delay += delay * Run.retry.jitter * (random() % 2001 - 1000) / 100000;
+        return (long)MAX(delay, 1);
+}
+
+
+/**
+ * Test the connection. If the test failed and retries are left, the retry is
+ * deferred with backoff and the event is posted once the port succeeds or the
+ * last attempt fails
+ */
+static void _testConnection(Service_T s, Port_T p) {
         volatile boolean_t rv = true;
         char buf[STRLEN];
         char report[STRLEN] = {};
-retry:
         TRY
         {
                 Socket_test(p);
@@ -162,17 +179,62 @@ retry:
         }
         END_TRY;
         if (! rv) {
-                if (retry_count-- > 1) {
-                        DEBUG("'%s' %s (attempt %d/%d)\n", s->name, report, p->retry - retry_count, p->retry);
-                        goto retry;
+                if (++p->pending.attempt < p->retry) {
+                        long delay = _retryBackoff(p->pending.attempt);
+                        p->pending.due = Time_milli() + delay;
+                        Schedule_defer(s, delay);
+                        DEBUG("'%s' %s (attempt %d/%d, next attempt in %ld ms)\n", s->name, report, p->pending.attempt, p->retry, delay);
+                        return;
                 }
+                p->pending.attempt = 0;
                 Event_post(s, Event_Connection, State_Failed, p->action, "%s", report);
         } else {
+                p->pending.attempt = 0;
                 Event_post(s, Event_Connection, State_Succeeded, p->action, "connection succeeded to %s", Util_portDescription(p, buf, sizeof(buf)));
         }
 }
 
 
+/**
+ * Run the connection retries which are due, defer the others again
+ */
+static void _testPendingConnections(Service_T s, Port_T p, long long now) {
+        for (; p; p = p->next) {
+                if (! p->pending.attempt)
+                        continue;
+                if (s->monitor == Monitor_Not)
+                        p->pending.attempt = 0;
+                else if (p->pending.due > now)
+                        Schedule_defer(s, (long)(p->pending.due - now));
+                else
+                        _testConnection(s, p);
+        }
+}
+
+
+/**
+ * Test the connection and protocol
+ */
+static void check_connection(Service_T s, Port_T p) {
+        ASSERT(s && p);
+        char buf[STRLEN];
+        if (p->probe.done) {
+                /* The port was already tested by the asynchronous engine in this cycle */
+                p->probe.done = false;
+                if (p->probe.error)
+                        Event_post(s, Event_Connection, State_Failed, p->action, "%s", p->probe.error);
+                else
+                        Event_post(s, Event_Connection, State_Succeeded, p->action, "connection succeeded to %s", Util_portDescription(p, buf, sizeof(buf)));
+                FREE(p->probe.error);
+                return;
+        }
+        /* The port is waiting for a retry, the result is reported by the retry */
+        if (p->pending.attempt)
+                return;
+        _testConnection(s, p);
+}
+
+
 /**
  * Test process state (e.g. Zombie)
  */
@@ -950,21 +1012,257 @@ static boolean_t check_skip(Service_T s) {
 
 
 /**
- * Returns true if scheduled action was performed
+ * Returns true if check_skip() would skip the service in this cycle. Unlike
+ * check_skip() it doesn't count the cycle nor mark the cron run, so the
+ * tests done ahead of the service check can follow the every statement
+ */
+boolean_t is_skipped(Service_T s) {
+        ASSERT(s);
+        if (s->visited)
+                return true;
+        time_t now = Time_now();
+        if (s->every.type == Every_SkipCycles)
+                return s->every.spec.cycle.counter + 1 < s->every.spec.cycle.number;
+        else if (s->every.type == Every_Cron)
+                return ! ((now - s->every.last_run) > 59 && Time_incron(s->every.spec.cron, now));
+        else if (s->every.type == Every_NotInCron)
+                return Time_incron(s->every.spec.cron, now);
+        return false;
+}
+
+
+/**
+ * Returns true if scheduled action was performed. The action requested by the
+ * http interface is guarded by the service mutex, the request stays set until
+ * the action was done, so the http interface rejects other actions meanwhile
  */
 static boolean_t do_scheduled_action(Service_T s) {
         int rv = false;
-        if (s->doaction != Action_Ignored) {
+        Action_Type doaction = Action_Ignored;
+        LOCK(s->mutex)
+        {
+                doaction = s->doaction;
+        }
+        END_LOCK;
+        if (doaction != Action_Ignored) {
                 // FIXME: let the event engine do the action directly? (just replace s->action_ACTION with s->doaction and drop control_service call)
-                rv = control_service(s->name, s->doaction);
-                Event_post(s, Event_Action, State_Changed, s->action_ACTION, "%s action %s", actionnames[s->doaction], rv ? "done" : "failed");
-                s->doaction = Action_Ignored;
-                FREE(s->token);
+                rv = control_service(s->name, doaction);
+                Event_post(s, Event_Action, State_Changed, s->action_ACTION, "%s action %s", actionnames[doaction], rv ? "done" : "failed");
+                LOCK(s->mutex)
+                {
+                        s->doaction = Action_Ignored;
+                        FREE(s->token);
+                }
+                END_LOCK;
+        }
+        return rv;
+}
+
+
+/**
+ * Validate one service. Returns false if the check failed
+ */
+static boolean_t _validateService(Service_T s) {
+        boolean_t rv = true;
+        if (! s->schedule.ready)
+                return rv;
+        if (! do_scheduled_action(s) && s->monitor && ! check_skip(s)) {
+                check_timeout(s); // Can disable monitoring => need to check s->monitor again
+                if (s->monitor) {
+                        long long start = Profile_now();
+                        rv = s->check(s);
+                        Profile_service(s, start);
+                        /* The monitoring may be disabled by some matching rule in s->check
+                         * so we have to check again before setting to Monitor_Yes */
+                        if (s->monitor != Monitor_Not)
+                                s->monitor = Monitor_Yes;
+                }
+                gettimeofday(&s->collected, NULL);
         }
         return rv;
 }
 
 
+/**
+ * Parallel validation. The services due in this cycle are handed to a pool of
+ * workers in the topological order of the servicelist. A service is ready once all services
+ * it depends on were validated, so the actions of a service, which may start
+ * the services it depends on or stop the services which depend on it, never
+ * run concurrently with the checks of these services.
+ */
+typedef struct ValidateJob_T {
+        Service_T service;
+        int waiting;               /**< Number of dependencies not validated yet */
+        int dependants;      /**< Offset of the dependant services in the edges */
+        int dependants_count;             /**< Number of the dependant services */
+} ValidateJob_T;
+
+
+typedef struct ValidateIndex_T {
+        Service_T service;
+        int job;
+} ValidateIndex_T;
+
+
+typedef struct ValidatePool_T {
+        Mutex_T mutex;
+        Sem_T ready;
+        int count;                                        /**< Number of services */
+        int done;                              /**< Number of validated services */
+        int head;                                 /**< Ready queue read position */
+        int tail;                                /**< Ready queue write position */
+        int errors;
+        ValidateJob_T *jobs;                        /**< Jobs in servicelist order */
+        int *edges;                        /**< Dependant services of all the jobs */
+        int *queue;                                         /**< Ready job indexes */
+} *ValidatePool_T;
+
+
+static int _compareIndex(const void *a, const void *b) {
+        Service_T x = ((const ValidateIndex_T *)a)->service;
+        Service_T y = ((const ValidateIndex_T *)b)->service;
+        return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+static int _findJob(ValidateIndex_T *index, int count, const char *name) {
+        ValidateIndex_T key = {.service = Util_getService(name)};
+        ValidateIndex_T *found = key.service ? bsearch(&key, index, count, sizeof(ValidateIndex_T), _compareIndex) : NULL;
+        return found ? found->job : -1;
+}
+
+
+/**
+ * Build the dependency graph of the services. The dependant services of all
+ * jobs are stored in one flat edges array, the services without dependencies
+ * are queued as ready
+ */
+static void _poolBuild(ValidatePool_T V) {
+        for (Service_T s = Schedule_ready(); s; s = s->schedule.next)
+                V->count++;
+        V->jobs = CALLOC(V->count, sizeof(ValidateJob_T));
+        V->queue = CALLOC(V->count, sizeof(int));
+        ValidateIndex_T *index = CALLOC(V->count, sizeof(ValidateIndex_T));
+        int i = 0;
+        for (Service_T s = Schedule_ready(); s; s = s->schedule.next, i++) {
+                V->jobs[i].service = index[i].service = s;
+                index[i].job = i;
+        }
+        qsort(index, V->count, sizeof(ValidateIndex_T), _compareIndex);
+        int edges = 0;
+        for (i = 0; i < V->count; i++) {
+                for (Dependant_T d = V->jobs[i].service->dependantlist; d; d = d->next) {
+                        int parent = _findJob(index, V->count, d->dependant);
+                        if (parent != -1) {
+                                V->jobs[parent].dependants_count++;
+                                V->jobs[i].waiting++;
+                                edges++;
+                        }
+                }
+        }
+        V->edges = CALLOC(edges + 1, sizeof(int));
+        int *fill = CALLOC(V->count, sizeof(int));
+        for (int offset = 0, j = 0; j < V->count; j++) {
+                V->jobs[j].dependants = offset;
+                offset += V->jobs[j].dependants_count;
+        }
+        for (i = 0; i < V->count; i++) {
+                for (Dependant_T d = V->jobs[i].service->dependantlist; d; d = d->next) {
+                        int parent = _findJob(index, V->count, d->dependant);
+                        if (parent != -1)
+                                V->edges[V->jobs[parent].dependants + fill[parent]++] = i;
+                }
+                if (V->jobs[i].waiting == 0)
+                        V->queue[V->tail++] = i;
+        }
+        FREE(fill);
+        FREE(index);
+}
+
+
+/**
+ * Validation worker. Takes the ready services from the queue until all
+ * services were validated, then releases the services depending on them
+ */
+static void *_poolWorker(void *args) {
+        ValidatePool_T V = args;
+        LOCK(V->mutex)
+        {
+                while (true) {
+                        while (V->head == V->tail && V->done < V->count)
+                                Sem_wait(V->ready, V->mutex);
+                        if (V->head == V->tail)
+                                break;
+                        ValidateJob_T *job = &V->jobs[V->queue[V->head++]];
+                        Mutex_unlock(V->mutex);
+                        boolean_t rv = true;
+                        if (! (Run.flags & Run_Stopped))
+                                rv = _validateService(job->service);
+                        Mutex_lock(V->mutex);
+                        if (! rv)
+                                V->errors++;
+                        V->done++;
+                        for (int i = 0; i < job->dependants_count; i++) {
+                                int dependant = V->edges[job->dependants + i];
+                                if (--V->jobs[dependant].waiting == 0)
+                                        V->queue[V->tail++] = dependant;
+                        }
+                        Sem_broadcast(V->ready);
+                }
+        }
+        END_LOCK;
+        return NULL;
+}
+
+
+static void *_poolThread(void *args) {
+        _poolWorker(args);
+#ifdef HAVE_OPENSSL
+        Ssl_threadCleanup();
+#endif
+        return NULL;
+}
+
+
+/**
+ * Validate the services with the given number of threads, the calling thread
+ * is one of the workers. Returns the number of failed checks
+ */
+static int _validateParallel(int workers) {
+        struct ValidatePool_T pool = {.count = 0};
+        ValidatePool_T V = &pool;
+        Mutex_init(V->mutex);
+        Sem_init(V->ready);
+        _poolBuild(V);
+        workers = MAX(MIN(workers, V->count), 1);
+        Thread_T threads[workers];
+        boolean_t started[workers];
+        for (int i = 1; i < workers; i++) {
+                started[i] = true;
+                TRY
+                {
+                        Thread_create(threads[i], _poolThread, V);
+                }
+                ELSE
+                {
+                        LogError("Cannot start the validation worker -- %s\n", Exception_frame.message);
+                        started[i] = false;
+                }
+                END_TRY;
+        }
+        _poolWorker(V);
+        for (int i = 1; i < workers; i++)
+                if (started[i])
+                        Thread_join(threads[i]);
+        FREE(V->queue);
+        FREE(V->edges);
+        FREE(V->jobs);
+        Sem_destroy(V->ready);
+        Mutex_destroy(V->mutex);
+        return V->errors;
+}
+
+
 /* ---------------------------------------------------------------- Public */
 
 
@@ -977,38 +1275,71 @@ int validate() {
         int errors = 0;
         Service_T s;
 
-        Run.handler_flag = Handler_Succeeded;
-        Event_queue_process();
-
-        update_system_load();
-        initprocesstree(&ptree, &ptreesize, &oldptree, &oldptreesize);
-        gettimeofday(&systeminfo.collected, NULL);
+        long long start = Profile_now();
+        /* The event queue is replayed and an idle mail session closed by the notification dispatcher if running */
+        if (! Dispatch_replay()) {
+                Event_queue_process();
+                sendmail_idle();
+        }
+        Profile_stage(Profile_Events, start);
+
+        Schedule_advance();
+
+        /* Run the due connection retries, the failing ports don't hold up the service checks */
+        start = Profile_now();
+        long long now = Time_milli();
+        Service_T next;
+        for (s = Schedule_deferred(); s; s = next) {
+                next = s->schedule.next_deferred;
+                _testPendingConnections(s, s->portlist, now);
+                _testPendingConnections(s, s->socketlist, now);
+        }
+        Profile_stage(Profile_Retries, start);
+
+        /* Collect the system and process data only if some service in this cycle needs them */
+        boolean_t collect = (Run.flags & Run_ActionPending) ? true : false;
+        for (s = Schedule_ready(); s && ! collect; s = s->schedule.next)
+                if (s->type == Service_Process || s->type == Service_System)
+                        collect = true;
+        if (collect) {
+                start = Profile_now();
+                update_system_load();
+                Profile_stage(Profile_SystemLoad, start);
+                start = Profile_now();
+                initprocesstree(&ptree, &ptreesize, &oldptree, &oldptreesize);
+                Profile_stage(Profile_ProcessTree, start);
+                gettimeofday(&systeminfo.collected, NULL);
+        }
 
         /* In the case that at least one action is pending, perform quick loop to handle the actions ASAP */
         if (Run.flags & Run_ActionPending) {
+                start = Profile_now();
                 Run.flags &= ~Run_ActionPending;
                 for (s = servicelist; s; s = s->next)
                         do_scheduled_action(s);
+                Profile_stage(Profile_Actions, start);
         }
 
+        /* Test the async ports of the due services concurrently, the results are reported by the service checks */
+        start = Profile_now();
+        Probe_run();
+        Profile_stage(Profile_Probes, start);
+
         /* Check the services */
-        for (s = servicelist; s; s = s->next) {
-                if (Run.flags & Run_Stopped)
-                        break;
-                if (! do_scheduled_action(s) && s->monitor && ! check_skip(s)) {
-                        check_timeout(s); // Can disable monitoring => need to check s->monitor again
-                        if (s->monitor) {
-                                if (! s->check(s))
-                                        errors++;
-                                /* The monitoring may be disabled by some matching rule in s->check
-                                 * so we have to check again before setting to Monitor_Yes */
-                                if (s->monitor != Monitor_Not)
-                                        s->monitor = Monitor_Yes;
-                        }
-                        gettimeofday(&s->collected, NULL);
+        start = Profile_now();
+        if (Run.validate_workers > 1 && Schedule_ready()) {
+                errors = _validateParallel(Run.validate_workers);
+        } else {
+                for (s = Schedule_ready(); s; s = s->schedule.next) {
+                        if (Run.flags & Run_Stopped)
+                                break;
+                        if (! _validateService(s))
+                                errors++;
                 }
         }
+        Profile_stage(Profile_Services, start);
 
+        Schedule_update();
         reset_depend();
 
         return errors;
@@ -1037,7 +1368,11 @@ boolean_t check_process(Service_T s) {
                 for (ActionRate_T ar = s->actionratelist; ar; ar = ar->next)
                         Event_post(s, Event_Timeout, State_Succeeded, ar->action, "process is running after previous restart timeout (manually recovered?)");
         if (Run.flags & Run_ProcessEngineEnabled) {
-                if (update_process_data(s, ptree, ptreesize, pid)) {
+                /* The tree may be refreshed by an action in another validation worker */
+                pthread_rwlock_rdlock(&ptreelock);
+                boolean_t updated = ptree && update_process_data(s, ptree, ptreesize, pid);
+                pthread_rwlock_unlock(&ptreelock);
+                if (updated) {
                         check_process_state(s);
                         check_process_pid(s);
                         check_process_ppid(s);
@@ -52,6 +52,7 @@
 #include "event.h"
 #include "process.h"
 #include "protocol.h"
+#include "profile.h"
 
 
 /**
@@ -79,6 +80,28 @@ static void _escapeCDATA(StringBuffer_T B, const char *buf) {
 }
 
 
+/**
+ * Prints a latency histogram summary into the given buffer.
+ * @param B StringBuffer object
+ * @param h The histogram
+ */
+static void status_histogram(StringBuffer_T B, Histogram_T *h) {
+        StringBuffer_append(B,
+                            "<count>%llu</count>"
+                            "<p50>%lld</p50>"
+                            "<p95>%lld</p95>"
+                            "<p99>%lld</p99>"
+                            "<max>%lld</max>"
+                            "<last>%lld</last>",
+                            h->count,
+                            Profile_percentile(h, 50),
+                            Profile_percentile(h, 95),
+                            Profile_percentile(h, 99),
+                            h->max,
+                            h->last);
+}
+
+
 /**
  * Prints a document header into the given buffer.
  * @param B StringBuffer object
@@ -99,14 +122,17 @@ static void document_head(StringBuffer_T B, int V, const char *myip) {
                                     Run.id,
                                     (long long)Run.incarnation,
                                     VERSION);
+        pthread_rwlock_rdlock(&ptreelock);
+        long long uptime = getProcessUptime(getpid(), ptree, ptreesize);
+        pthread_rwlock_unlock(&ptreelock);
         StringBuffer_append(B,
                             "<uptime>%lld</uptime>"
                             "<poll>%d</poll>"
                             "<startdelay>%d</startdelay>"
                             "<localhostname>%s</localhostname>"
                             "<controlfile>%s</controlfile>",
-                            (long long)getProcessUptime(getpid(), ptree, ptreesize),
-                            Run.polltime,
+                            uptime,
+                            MAX(Run.polltime / 1000, 1),
                             Run.startdelay,
                             Run.system->name ? Run.system->name : "",
                             Run.files.control ? Run.files.control : "");
@@ -121,6 +147,14 @@ static void document_head(StringBuffer_T B, int V, const char *myip) {
                         StringBuffer_append(B, "<credentials><username>%s</username><password>%s</password></credentials>", Run.mmonitcredentials->uname, Run.mmonitcredentials->passwd);
         }
 
+        StringBuffer_append(B, "<profile>");
+        for (Profile_Stage stage = Profile_Cycle; stage < Profile_Stages; stage++) {
+                StringBuffer_append(B, "<stage name=\"%s\">", Profile_name(stage));
+                status_histogram(B, Profile_histogram(stage));
+                StringBuffer_append(B, "</stage>");
+        }
+        StringBuffer_append(B, "</profile>");
+
         StringBuffer_append(B,
                             "</server>"
                             "<platform>"
@@ -182,10 +216,17 @@ static void status_service(Service_T S, StringBuffer_T B, Level_Type L, int V) {
                 StringBuffer_append(B, "<every><type>%d</type>", S->every.type);
                 if (S->every.type == 1)
                         StringBuffer_append(B, "<counter>%d</counter><number>%d</number>", S->every.spec.cycle.counter, S->every.spec.cycle.number);
+                else if (S->every.type == Every_Interval)
+                        StringBuffer_append(B, "<interval>%d</interval>", S->every.adaptive.current ? S->every.adaptive.current : S->every.spec.interval);
                 else
                         StringBuffer_append(B, "<cron>%s</cron>", S->every.spec.cron);
                 StringBuffer_append(B, "</every>");
         }
+        if (S->latency.count) {
+                StringBuffer_append(B, "<latency>");
+                status_histogram(B, &S->latency);
+                StringBuffer_append(B, "</latency>");
+        }
 
         if (L == Level_Full) {
                 if (Util_hasServiceStatus(S)) {